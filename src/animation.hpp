@@ -0,0 +1,252 @@
+﻿
+#pragma once
+
+//
+// ノードアニメーション
+// Assimpのシーンから階層構造とキーフレームを写しておき、
+// 任意の時刻のワールド行列を求める
+// TIPS:Assimpのシーンは読み込み後に破棄されるので、必要な分だけコピーする
+//
+
+#include "defines.hpp"
+#include <assimp/scene.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include "vector.hpp"
+#include "matrix.hpp"
+#include "model.hpp"
+
+
+namespace {
+
+class Animation {
+public:
+  using Matrices = std::vector<Affinef, Eigen::aligned_allocator<Affinef> >;
+
+
+private:
+  // 階層構造(親は必ず子より前に並ぶ)
+  struct NodeRecord {
+    std::string name;
+    int parent;
+    std::vector<u_int> mesh_indexes;
+  };
+  std::vector<NodeRecord> nodes_;
+  // アニメーションしない時の行列
+  Matrices base_matrices_;
+
+  // ノードごとのキーフレーム
+  struct VectorKey {
+    Real  time;
+    Vec3f value;
+  };
+  // TIPS:Quatfはコピーすると警告が出るので、係数(x, y, z, w)で持つ
+  using QuatCoeffs = Eigen::Matrix<Real, 4, 1>;
+  struct QuatKey {
+    Real       time;
+    QuatCoeffs value;
+  };
+  struct Channel {
+    int node;
+    std::vector<VectorKey> positions;
+    std::vector<QuatKey, Eigen::aligned_allocator<QuatKey> > rotations;
+    std::vector<VectorKey> scalings;
+  };
+  std::vector<Channel> channels_;
+
+  Real ticks_per_second_;
+  Real duration_;
+
+  // カメラ(ノードのローカル座標系)
+  int   camera_node_;
+  Vec3f camera_position_;
+  Vec3f camera_look_at_;
+  Vec3f camera_up_;
+
+
+public:
+  // TIPS:最初のアニメーションだけを使う
+  // ※メッシュの頂点を直接動かすので、複数のノードから参照されているメッシュには対応しない(例外を投げる)
+  explicit Animation(const aiScene& scene) :
+    ticks_per_second_(25.0),
+    duration_(0.0),
+    camera_node_(-1),
+    camera_position_(Vec3f::Zero()),
+    camera_look_at_(Vec3f::UnitZ()),
+    camera_up_(Vec3f::UnitY())
+  {
+    addNode(scene.mRootNode, -1);
+    checkSharedMesh(scene.mNumMeshes);
+
+    std::map<std::string, int> node_index;
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      node_index[nodes_[i].name] = int(i);
+    }
+
+    if (scene.HasCameras()) {
+      const auto& camera = **scene.mCameras;
+      auto it = node_index.find(camera.mName.C_Str());
+      if (it != node_index.end()) camera_node_ = it->second;
+
+      camera_position_ = Vec3f(camera.mPosition.x, camera.mPosition.y, camera.mPosition.z);
+      camera_look_at_  = Vec3f(camera.mLookAt.x, camera.mLookAt.y, camera.mLookAt.z);
+      camera_up_       = Vec3f(camera.mUp.x, camera.mUp.y, camera.mUp.z);
+    }
+
+    if (!scene.HasAnimations()) {
+      DOUT << "No animation." << std::endl;
+      return;
+    }
+
+    const auto& animation = **scene.mAnimations;
+    if (animation.mTicksPerSecond > 0.0) ticks_per_second_ = animation.mTicksPerSecond;
+    duration_ = animation.mDuration;
+
+    for (u_int i = 0; i < animation.mNumChannels; ++i) {
+      const auto& src = *animation.mChannels[i];
+      auto it = node_index.find(src.mNodeName.C_Str());
+      if (it == node_index.end()) continue;
+
+      Channel channel;
+      channel.node = it->second;
+      for (u_int k = 0; k < src.mNumPositionKeys; ++k) {
+        const auto& key = src.mPositionKeys[k];
+        channel.positions.push_back({ key.mTime, Vec3f(key.mValue.x, key.mValue.y, key.mValue.z) });
+      }
+      for (u_int k = 0; k < src.mNumRotationKeys; ++k) {
+        const auto& key = src.mRotationKeys[k];
+        channel.rotations.push_back({ key.mTime, QuatCoeffs(key.mValue.x, key.mValue.y, key.mValue.z, key.mValue.w) });
+      }
+      for (u_int k = 0; k < src.mNumScalingKeys; ++k) {
+        const auto& key = src.mScalingKeys[k];
+        channel.scalings.push_back({ key.mTime, Vec3f(key.mValue.x, key.mValue.y, key.mValue.z) });
+      }
+      channels_.push_back(std::move(channel));
+    }
+
+    DOUT << "animation channels:" << channels_.size()
+         << " duration(sec):" << duration_ / ticks_per_second_ << std::endl;
+  }
+
+
+  // 時刻(秒)でのワールド行列を求める
+  Matrices evaluate(const Real time) const {
+    Matrices local = base_matrices_;
+
+    // TIPS:最後のキーより後は最後の姿勢のまま
+    Real ticks = std::min(time * ticks_per_second_, duration_);
+    for (const auto& c : channels_) {
+      Vec3f position = c.positions.empty() ? Vec3f(local[c.node].translation()) : interpolate(c.positions, ticks);
+      Quatf rotation(c.rotations.empty() ? QuatCoeffs(Quatf(local[c.node].rotation()).coeffs())
+                                         : interpolate(c.rotations, ticks));
+      Vec3f scaling  = c.scalings.empty()  ? Vec3f(local[c.node].linear().colwise().norm().transpose())
+                                           : interpolate(c.scalings, ticks);
+
+      local[c.node] = Translation(position) * rotation * Scaling(scaling.x(), scaling.y(), scaling.z());
+    }
+
+    Matrices world(nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      int parent = nodes_[i].parent;
+      world[i] = (parent < 0) ? local[i] : world[parent] * local[i];
+    }
+    return world;
+  }
+
+  // メッシュの頂点をワールド座標に置き直す
+  // TIPS:各メッシュを参照するノードは1つだけ(読み込み時に確認済み)
+  void apply(const Matrices& world, const Model& model) const {
+    const auto& meshes = model.mesh();
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      for (auto index : nodes_[i].mesh_indexes) {
+        meshes[index]->transform(world[i]);
+      }
+    }
+  }
+
+  // カメラの位置と向きを求める
+  void camera(Vec3f& position, Vec3f& look_at, Vec3f& up, const Matrices& world) const {
+    if (camera_node_ < 0) {
+      position = camera_position_;
+      look_at  = camera_look_at_;
+      up       = camera_up_;
+      return;
+    }
+
+    const auto& m = world[camera_node_];
+    position = m * camera_position_;
+    look_at  = m.linear() * camera_look_at_;
+    up       = m.linear() * camera_up_;
+  }
+
+  // 長さ(秒)
+  Real duration() const { return duration_ / ticks_per_second_; }
+
+
+private:
+  // 同じメッシュを複数のノードが参照していたら読み込めない
+  void checkSharedMesh(const u_int mesh_num) const {
+    std::vector<int> owner(mesh_num, -1);
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      for (auto index : nodes_[i].mesh_indexes) {
+        if (owner[index] >= 0) {
+          DOUT << "Mesh " << index << " is shared by nodes:"
+               << nodes_[owner[index]].name << ", " << nodes_[i].name << std::endl;
+          throw "Mesh shared by several nodes.";
+        }
+        owner[index] = int(i);
+      }
+    }
+  }
+
+  void addNode(const aiNode* node, const int parent) {
+    int index = int(nodes_.size());
+    nodes_.push_back({ node->mName.C_Str(), parent, { node->mMeshes, node->mMeshes + node->mNumMeshes } });
+
+    Affinef matrix;
+    for (u_int low = 0; low < 4; ++low) {
+      for (u_int colm = 0; colm < 4; ++colm) {
+        matrix(colm, low) = node->mTransformation[colm][low];
+      }
+    }
+    base_matrices_.push_back(matrix);
+
+    for (u_int i = 0; i < node->mNumChildren; ++i) {
+      addNode(node->mChildren[i], index);
+    }
+  }
+
+
+  // キーの間を補間する
+  template <typename Keys>
+  static size_t findKey(const Keys& keys, const Real ticks) {
+    auto it = std::upper_bound(keys.begin(), keys.end(), ticks,
+                               [](const Real t, const typename Keys::value_type& key) { return t < key.time; });
+    return size_t(std::max(int(it - keys.begin()) - 1, 0));
+  }
+
+  static Real keyRatio(const Real t0, const Real t1, const Real ticks) {
+    return (t1 > t0) ? std::min(std::max((ticks - t0) / (t1 - t0), Real(0)), Real(1)) : 0.0;
+  }
+
+  static Vec3f interpolate(const std::vector<VectorKey>& keys, const Real ticks) {
+    size_t i = findKey(keys, ticks);
+    if ((i + 1) >= keys.size()) return keys[i].value;
+
+    Real t = keyRatio(keys[i].time, keys[i + 1].time, ticks);
+    return keys[i].value + (keys[i + 1].value - keys[i].value) * t;
+  }
+
+  static QuatCoeffs interpolate(const std::vector<QuatKey, Eigen::aligned_allocator<QuatKey> >& keys, const Real ticks) {
+    size_t i = findKey(keys, ticks);
+    if ((i + 1) >= keys.size()) return keys[i].value;
+
+    Real t = keyRatio(keys[i].time, keys[i + 1].time, ticks);
+    return Quatf(keys[i].value).slerp(t, Quatf(keys[i + 1].value)).normalized().coeffs();
+  }
+
+};
+
+}
@@ -10,7 +10,9 @@
 #include <deque>
 #include <limits>
 #include "collision.hpp"
+#include "simd.hpp"
 #include "model.hpp"
+#include "shape.hpp"
 
 
 namespace Bvh {
@@ -20,23 +22,38 @@ struct BBox {
   Vec3f sup;
 };
 
+// 葉ノードに置くポリゴンの参照
+// TIPS:頂点はGeometryが持っているので、面の番号だけ覚えておく
 struct BvhTriangle {
-  const Triangle* triangle;
-  const Triangle* normal;
-  const Triangle* uv;
-
+  const Geometry* geometry;
   const Material* material;
+  u_int face;
+};
+
+// 構築中だけ使うポリゴンの情報
+// 解析的な形状の場合はshapeを使う(ポリゴンの場合はnullptr)
+struct BuildTriangle {
+  BvhTriangle triangle;
+  const Shape* shape;
 
   BBox  bbox;
   Vec3f center;
 };
 
 
+// 交差判定に使うAABB
+// TIPS:Floatに丸める時は外側に広げて、ポリゴンがはみ出さないようにする
+struct NodeBox {
+  Vec3t inf;
+  Vec3t sup;
+};
+
 struct BvhNode {
-  BBox bbox;
+  NodeBox bbox;
   std::vector<BvhNode> children;
 
-  std::deque<BvhTriangle> triangles;
+  std::vector<BvhTriangle> triangles;
+  std::vector<const Shape*> shapes;
 };
 
 
@@ -65,11 +82,11 @@ BBox mergeAABB(const BBox& bbox1, const BBox& bbox2) {
 }
 
 // ポリゴンリストからAABBを生成
-BBox createAABBfromTriangles(const std::deque<BvhTriangle>& triangles) {
+BBox createAABBfromTriangles(const std::deque<BuildTriangle>& triangles) {
   auto bbox = emptyAABB();
   
   std::for_each(triangles.begin(), triangles.end(),
-                [&bbox](const BvhTriangle& t) {
+                [&bbox](const BuildTriangle& t) {
                   bbox = mergeAABB(t.bbox, bbox);
                 });
 
@@ -77,33 +94,49 @@ BBox createAABBfromTriangles(const std::deque<BvhTriangle>& triangles) {
 }
 
 
+// 交差判定用のAABBに変換
+NodeBox toNodeBox(const BBox& bbox) {
+  NodeBox box;
+  for (int i = 0; i < 3; ++i) {
+    box.inf(i) = std::nextafter(Float(bbox.inf(i)), -std::numeric_limits<Float>::infinity());
+    box.sup(i) = std::nextafter(Float(bbox.sup(i)),  std::numeric_limits<Float>::infinity());
+  }
+  return box;
+}
+
+BBox toBBox(const NodeBox& box) {
+  return BBox{ box.inf.cast<Real>(), box.sup.cast<Real>() };
+}
+
+
 const Real T_tri  = 1;                              // 適当
 const Real T_aabb = 1;                              // 適当
 
 
 // FIXME:trianglesの内容は破壊される
-BvhNode construct(std::deque<BvhTriangle>& triangles) {
+BvhNode construct(std::deque<BuildTriangle>& triangles) {
   BvhNode node;
 
   // 全体を囲うAABBを計算
-  node.bbox = createAABBfromTriangles(triangles);
+  auto root_bbox = createAABBfromTriangles(triangles);
+  node.bbox = toNodeBox(root_bbox);
 
   // 領域分割をせず、polygons を含む葉ノードを構築する場合を暫定の bestCost にする
   Real bestCost = T_tri * triangles.size();
 
   int bestAxis       = -1;                          // 分割に最も良い軸 (0:x, 1:y, 2:z)
   int bestSplitIndex = -1;                          // 最も良い分割場所
-  Real SA_root = surfaceArea(node.bbox);            // ノード全体のAABBの表面積
+  Real SA_root = surfaceArea(root_bbox);            // ノード全体のAABBの表面積
 
   for (int axis = 0; axis < 3; ++axis) {
     // ポリゴンリストを、それぞれのAABBの中心座標を使い、axis でソートする
     std::sort(triangles.begin(), triangles.end(),
-              [axis](const BvhTriangle& a, const BvhTriangle& b) {
+              [axis](const BuildTriangle& a, const BuildTriangle& b) {
                 return a.center(axis) < b.center(axis);
               });
     
-    std::deque<BvhTriangle> s1;
-    std::deque<BvhTriangle> s2(triangles);         // 分割された2つの領域
+    std::deque<BuildTriangle> s1;
+    std::deque<BuildTriangle> s2(triangles);         // 分割された2つの領域
     auto s1bbox = emptyAABB();                     // S1のAABB
     
     // AABBの表面積リスト。s1SA[i], s2SA[i] は、
@@ -117,7 +150,7 @@ BvhNode construct(std::deque<BvhTriangle>& triangles) {
       s1SA[i] = std::fabs(surfaceArea(s1bbox));
       if (s2.size() > 0) {
         // s2側で、axis について最左 (最小位置) にいるポリゴンをS1の最右 (最大位置) に移す
-        BvhTriangle p = s2.front();
+        BuildTriangle p = s2.front();
         s1.push_back(p);
         s2.pop_front();
 
@@ -159,19 +192,22 @@ BvhNode construct(std::deque<BvhTriangle>& triangles) {
   if (bestAxis == -1) {
     // 現在のノードを葉ノードとするのが最も効率が良い結果になった
     // => 葉ノードの作成
-    node.triangles = triangles;
+    for (const auto& t : triangles) {
+      if (t.shape) node.shapes.push_back(t.shape);
+      else         node.triangles.push_back(t.triangle);
+    }
   }
   else {
     // bestAxis に基づき、左右に分割
     // bestAxis でソート
     std::sort(triangles.begin(), triangles.end(),
-         [bestAxis](const BvhTriangle& a, const BvhTriangle& b) {
+         [bestAxis](const BuildTriangle& a, const BuildTriangle& b) {
                 return a.center(bestAxis) < b.center(bestAxis);
          });
 
     // ポリゴンリストを分割
-    std::deque<BvhTriangle> left(triangles.begin(), triangles.begin() + bestSplitIndex);
-    std::deque<BvhTriangle> right(triangles.begin() + bestSplitIndex, triangles.end());
+    std::deque<BuildTriangle> left(triangles.begin(), triangles.begin() + bestSplitIndex);
+    std::deque<BuildTriangle> right(triangles.begin() + bestSplitIndex, triangles.end());
 
     // 再帰処理
     node.children.resize(2);
@@ -182,75 +218,120 @@ BvhNode construct(std::deque<BvhTriangle>& triangles) {
   return node;
 }
 
+// 構築用のポリゴン情報を生成
+BuildTriangle buildTriangle(const Geometry& geometry, const Material& material, const u_int face) {
+  BuildTriangle t;
+
+  t.shape = nullptr;
+  t.triangle.geometry = &geometry;
+  t.triangle.material = &material;
+  t.triangle.face     = face;
+
+  Triangle polygon = geometry.polygon(face);
+  for (int i = 0; i < 3; ++i) {
+    t.bbox.inf(i) = std::min({ polygon.a(i), polygon.b(i), polygon.c(i) });
+    t.bbox.sup(i) = std::max({ polygon.a(i), polygon.b(i), polygon.c(i) });
+
+    t.center(i) = (t.bbox.inf(i) + t.bbox.sup(i)) / 2.0;
+  }
+
+  return t;
+}
+
+BuildTriangle buildShape(const Shape& shape) {
+  BuildTriangle t;
+
+  t.shape = &shape;
+  t.triangle.geometry = nullptr;
+  t.triangle.material = &shape.material();
+  t.triangle.face     = 0;
+
+  shape.bounds(t.bbox.inf, t.bbox.sup);
+  t.center = (t.bbox.inf + t.bbox.sup) / 2.0;
+
+  return t;
+}
+
+
+// 解析的な形状だけのBVHを生成
+BvhNode createFromShapes(const std::vector<Shape>& shapes) {
+  std::deque<BuildTriangle> triangles;
+  for (const auto& s : shapes) {
+    triangles.push_back(buildShape(s));
+  }
+  DOUT << "shape:" << shapes.size() << std::endl;
+
+  return construct(triangles);
+}
+
 // ModelからBVHを生成
-BvhNode createFromModel(const Model& model) {
-  std::deque<BvhTriangle> triangles;
+// shapes 一緒に入れる解析的な形状(BVHより長く保持しておく)
+BvhNode createFromModel(const Model& model, const std::vector<Shape>& shapes) {
+  std::deque<BuildTriangle> triangles;
+  for (const auto& s : shapes) {
+    triangles.push_back(buildShape(s));
+  }
 
   const auto& mesh     = model.mesh();
   const auto& material = model.material();
 
   int polygon_num = 0;
+  size_t memory = 0;
   
   for (const auto& m : mesh) {
-    const auto& polygons = m->polygons();
-    const auto& normals  = m->normals();
-    const auto& uvs      = m->uvs();
-    const auto& mat      = material[m->materialIndex()];
-    bool has_texture = mat.hasTexture();
+    const auto& mat = material[m->materialIndex()];
 
-    polygon_num += polygons.size();
+    polygon_num += m->faces();
+    memory += m->memory();
     
-    for (size_t ip = 0; ip < polygons.size(); ++ip) {
-      BvhTriangle t;
-
-      t.triangle = &polygons[ip];
-      t.normal   = &normals[ip];
-      t.uv       = has_texture ? &uvs[ip] : nullptr;
-      t.material = &mat;
-
-      for (int i = 0; i < 3; ++i) {
-        t.bbox.inf(i) = std::min({ polygons[ip].a(i), polygons[ip].b(i), polygons[ip].c(i) });
-        t.bbox.sup(i) = std::max({ polygons[ip].a(i), polygons[ip].b(i), polygons[ip].c(i) });
-
-        t.center(i) = (t.bbox.inf(i) + t.bbox.sup(i)) / 2.0;
-      }
-
-      triangles.push_back(t);
+    for (u_int ip = 0; ip < m->faces(); ++ip) {
+      triangles.push_back(buildTriangle(m->geometry(), mat, ip));
     }
   }
 
-  DOUT << "polygon:" << polygon_num << std::endl;
+  DOUT << "polygon:" << polygon_num << " shape:" << shapes.size() << std::endl;
+  DOUT << "geometry:" << (memory + polygon_num * sizeof(BvhTriangle)) / 1024 << "KB" << std::endl;
   
   return construct(triangles);
 }
 
 
-// AABBと光線(p + td)との交差判定と交差点
-bool testRayAABB(const Vec3f& p, const Vec3f& d, const BBox& b) {
-	Real tmin = 0.0;
-	Real tmax = FLT_MAX;
-
-	for (u_int i = 0; i < 3; ++i) {
-		if (std::abs(d(i)) < FLT_EPSILON) {
-			if (p(i) < b.inf(i) || p(i) > b.sup(i)) return false;
-		}
-		else {
-			Real ood = 1.0 / d(i);
-			Real t1 = (b.inf(i) - p(i)) * ood;
-			Real t2 = (b.sup(i) - p(i)) * ood;
+// 頂点が動いた後に、木の構造はそのままでAABBだけを計算し直す
+// 戻り値はノードのAABB
+BBox refit(BvhNode& node) {
+  auto bbox = emptyAABB();
+  for (auto& child : node.children) {
+    bbox = mergeAABB(bbox, refit(child));
+  }
+  for (const auto& t : node.triangles) {
+    bbox = mergeAABB(bbox, buildTriangle(*t.geometry, *t.material, t.face).bbox);
+  }
+  for (const auto* s : node.shapes) {
+    bbox = mergeAABB(bbox, buildShape(*s).bbox);
+  }
 
-			if (t1 > t2) std::swap(t1, t2);
-      tmin = std::max(t1, tmin);
-      tmax = std::min(t2, tmax);
+  node.bbox = toNodeBox(bbox);
+  return bbox;
+}
 
-			// if (t1 > tmin) tmin = t1;
-			// if (t2 < tmax) tmax = t2;
+// 木の交差判定コスト(SAH)
+// refitで木の質がどれだけ落ちたかを調べる
+Real sahCost(const BvhNode& node, const Real root_area) {
+  Real area = surfaceArea(toBBox(node.bbox)) / root_area;
+  if (node.children.empty()) {
+    return area * T_tri * (node.triangles.size() + node.shapes.size());
+  }
 
-			if (tmin > tmax) return false;
-		}
-	}
+  Real cost = area * T_aabb;
+  for (const auto& child : node.children) {
+    cost += sahCost(child, root_area);
+  }
+  return cost;
+}
 
-	return true;
+Real sahCost(const BvhNode& node) {
+  Real root_area = surfaceArea(toBBox(node.bbox));
+  return (root_area > 0.0) ? sahCost(node, root_area) : 0.0;
 }
 
 
@@ -259,57 +340,293 @@ struct TestInfo {
 
   Vec3f hit_pos;
   Vec3f hit_normal;
+  Vec3f hit_geometric_normal;                       // 頂点の並びから求めた面の法線
   Vec3f hit_uv;
+  Real  hit_uv_density;                             // ポリゴンのUV上の面積 / 空間での面積(テクスチャの縮小率に使う)
 
   const Material* material;
 
   TestInfo() :
-    distance(FLT_MAX)
+    distance(FLT_MAX),
+    hit_uv_density(0.0)
   {}
 };
 
 
-bool intersect(TestInfo& res, const Vec3f& ray_start, const Vec3f& ray_vec, const BvhNode& node, const bool back_face) {
-  bool  hit_res = false;
+// 交差判定用の光線
+// TIPS:走査の前に一度だけ作り、逆数やせん断の係数を使い回す
+// SOURCE:Woop, Benthin, Wald "Watertight Ray/Triangle Intersection" (JCGT 2013)
+struct Ray {
+  // 解析的な形状はRealで判定する
+  Vec3f start;
+  Vec3f vec;
+
+  Vec4s org;
+  Vec4s inv_dir;
+
+  // ポリゴンの判定はスカラーで行う
+  // TIPS:せん断は軸の入れ替えと分岐が主で、4要素にまとめても速くならない
+  Float org_s[3];
+  Float dir_s[3];
+
+  // 方向が最も大きい軸をzにして、xyに投影する
+  int kx, ky, kz;
+  Float sx, sy, sz;
+};
+
+Ray createRay(const Vec3f& ray_start, const Vec3f& ray_vec) {
+  Ray ray;
+  ray.start = ray_start;
+  ray.vec   = ray_vec;
 
-  if (!testRayAABB(ray_start, ray_vec, node.bbox)) return false;
+  Float d[3];
+  Float inv[3];
+  for (int i = 0; i < 3; ++i) {
+    d[i] = Float(ray_vec(i));
+    // TIPS:0の時は最小値に置き換えて、スラブ判定で0 * 無限大(NaN)にならないようにする
+    Float di = (std::abs(d[i]) < std::numeric_limits<Float>::min())
+             ? std::copysign(std::numeric_limits<Float>::min(), d[i]) : d[i];
+    inv[i] = Float(1) / di;
+  }
+  ray.org     = toSimd<Float>(ray_start);
+  ray.inv_dir = Vec4s(inv[0], inv[1], inv[2]);
+  for (int i = 0; i < 3; ++i) {
+    ray.org_s[i] = Float(ray_start(i));
+    ray.dir_s[i] = d[i];
+  }
+
+  ray.kz = 0;
+  if (std::abs(d[1]) > std::abs(d[ray.kz])) ray.kz = 1;
+  if (std::abs(d[2]) > std::abs(d[ray.kz])) ray.kz = 2;
+  ray.kx = (ray.kz + 1) % 3;
+  ray.ky = (ray.kx + 1) % 3;
+  // 面の向きが変わらないように入れ替える
+  if (d[ray.kz] < 0) std::swap(ray.kx, ray.ky);
+
+  ray.sx = d[ray.kx] / d[ray.kz];
+  ray.sy = d[ray.ky] / d[ray.kz];
+  ray.sz = Float(1) / d[ray.kz];
+
+  return ray;
+}
+
+
+// 丸め誤差の上限
+// SOURCE:Pharr, Jakob, Humphreys "Physically Based Rendering 3rd" 3.9
+constexpr Float roundingGamma(const int n) {
+  return (n * std::numeric_limits<Float>::epsilon() * Float(0.5))
+       / (1 - n * std::numeric_limits<Float>::epsilon() * Float(0.5));
+}
+
+// AABBと光線の交差判定
+// t AABBに入る距離
+// TIPS:3軸をまとめて計算する
+//      遠い側を誤差の分だけ広げて、境界をかすめる光線を取りこぼさない
+bool testRayBox(Float& t, const Ray& ray, const NodeBox& b, const Float max_t) {
+  Vec4s t1 = (Vec4s(b.inf.x(), b.inf.y(), b.inf.z()) - ray.org) * ray.inv_dir;
+  Vec4s t2 = (Vec4s(b.sup.x(), b.sup.y(), b.sup.z()) - ray.org) * ray.inv_dir;
+
+  Float tmin = std::max(maxCoeff3(min(t1, t2)), Float(0));
+  Float tmax = std::min(minCoeff3(max(t1, t2)) * (1 + 2 * roundingGamma(3)), max_t);
+  if (tmin > tmax) return false;
+
+  t = tmin;
+  return true;
+}
+
+
+// 光線とポリゴンの交差判定
+// 辺の上を通る光線は隣り合うポリゴンのどちらかに必ず当たる
+// t        交差点までの距離
+// center   重心座標
+// back_face 裏面も対象にする
+bool testRayTriangle(Float& t, Vec3f& center,
+                     const Ray& ray, const Geometry& geometry, const u_int face,
+                     const bool back_face, const Float max_t) {
+  const auto& f  = geometry.indices()[face];
+  const auto& p1 = geometry.positions()[f.v1];
+  const auto& p2 = geometry.positions()[f.v2];
+  const auto& p3 = geometry.positions()[f.v3];
+
+  const Float* o = ray.org_s;
+  Float a[3] = { p1.x - o[0], p1.y - o[1], p1.z - o[2] };
+  Float b[3] = { p2.x - o[0], p2.y - o[1], p2.z - o[2] };
+  Float c[3] = { p3.x - o[0], p3.y - o[1], p3.z - o[2] };
+
+  // 裏面は(b - a)×(c - a)が光線と同じ向き
+  if (!back_face) {
+    Float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+    Float e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+    const Float* d = ray.dir_s;
+    if ((d[0] * (e1[1] * e2[2] - e1[2] * e2[1])
+       + d[1] * (e1[2] * e2[0] - e1[0] * e2[2])
+       + d[2] * (e1[0] * e2[1] - e1[1] * e2[0])) >= 0) return false;
+  }
+
+  // 光線の方向が+zになるようにせん断する
+  Float ax = a[ray.kx] - ray.sx * a[ray.kz];
+  Float ay = a[ray.ky] - ray.sy * a[ray.kz];
+  Float bx = b[ray.kx] - ray.sx * b[ray.kz];
+  Float by = b[ray.ky] - ray.sy * b[ray.kz];
+  Float cx = c[ray.kx] - ray.sx * c[ray.kz];
+  Float cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+  Float u = cx * by - cy * bx;
+  Float v = ax * cy - ay * cx;
+  Float w = bx * ay - by * ax;
+
+#if MIXED_PRECISION
+  // 辺の上はfloatでは符号が決まらないので、doubleで計算し直す
+  if ((u == 0) || (v == 0) || (w == 0)) {
+    u = Float(double(cx) * double(by) - double(cy) * double(bx));
+    v = Float(double(ax) * double(cy) - double(ay) * double(cx));
+    w = Float(double(bx) * double(ay) - double(by) * double(ax));
+  }
+#endif
+
+  if (((u < 0) || (v < 0) || (w < 0)) && ((u > 0) || (v > 0) || (w > 0))) return false;
 
+  Float det = u + v + w;
+  if (det == 0) return false;
+
+  Float az = ray.sz * a[ray.kz];
+  Float bz = ray.sz * b[ray.kz];
+  Float cz = ray.sz * c[ray.kz];
+  Float hit_t = (u * az + v * bz + w * cz) / det;
+  if ((hit_t <= 0) || (hit_t >= max_t)) return false;
+
+  t = hit_t;
+  center << u / det, v / det, w / det;
+  return true;
+}
+
+
+// 走査中の最も近い交差点
+// TIPS:法線やUVは走査が終わってから、最も近い交差点だけ求める
+struct Hit {
+  const BvhTriangle* triangle;
+  const Shape* shape;
+  Float t;
+  Real  shape_t;                                    // 解析的な形状の交差距離
+  Vec3f center;
+};
+
+void intersect(Hit& hit, const Ray& ray, const BvhNode& node, const bool back_face) {
   if (node.children.empty()) {
     // AABB内のポリゴンとの交差判定
     for (const auto& t : node.triangles) {
-      Vec3f hit_pos;
-      Real  hit_t;
-      Vec3f hit_normal;
-      Vec3f hit_center;
+      if (testRayTriangle(hit.t, hit.center, ray, *t.geometry, t.face, back_face, hit.t)) {
+        hit.triangle = &t;
+        hit.shape    = nullptr;
+      }
+    }
+    for (const auto* s : node.shapes) {
+      Real t;
+      if (s->intersect(t, ray.start, ray.vec, back_face, hit.t)) {
+        hit.shape    = s;
+        hit.triangle = nullptr;
+        hit.shape_t  = t;
+        hit.t        = Float(t);
+      }
+    }
+    return;
+  }
 
-      if (testRayTriangle(hit_pos, hit_t, hit_normal, hit_center,
-                          ray_start, ray_vec, *t.triangle, back_face)) {
-        if (hit_t < res.distance) {
-          hit_res = true;
+  // 手前の子供から調べて、交差点より奥は調べない
+  Float t[2];
+  bool hit_box[2];
+  for (int i = 0; i < 2; ++i) {
+    hit_box[i] = testRayBox(t[i], ray, node.children[i].bbox, hit.t);
+  }
+  int first = (hit_box[0] && hit_box[1] && (t[1] < t[0])) ? 1 : 0;
 
-          res.distance = hit_t;
-          res.hit_pos  = hit_pos;
-          res.material = t.material;
+  for (int i = 0; i < 2; ++i) {
+    int c = first ^ i;
+    if (!hit_box[c] || (t[c] > hit.t)) continue;
+    intersect(hit, ray, node.children[c], back_face);
+  }
+}
 
-          res.hit_normal = (t.normal->a * hit_center.x()
-                          + t.normal->b * hit_center.y()
-                          + t.normal->c * hit_center.z()).normalized();
+bool intersect(TestInfo& res, const Vec3f& ray_start, const Vec3f& ray_vec, const BvhNode& node, const bool back_face) {
+  Ray ray = createRay(ray_start, ray_vec);
+
+  Hit hit;
+  hit.triangle = nullptr;
+  hit.shape    = nullptr;
+  hit.t = (res.distance < FLT_MAX) ? Float(res.distance) : std::numeric_limits<Float>::max();
+
+  Float t;
+  if (!testRayBox(t, ray, node.bbox, hit.t)) return false;
+
+  intersect(hit, ray, node, back_face);
+  if (hit.shape) {
+    const auto& shape = *hit.shape;
+    res.distance = hit.shape_t;
+    res.material = &shape.material();
+    res.hit_pos  = ray_start + ray_vec * hit.shape_t;
+    shape.surface(res.hit_pos, res.hit_normal, res.hit_uv);
+    res.hit_geometric_normal = res.hit_normal;
+    return true;
+  }
+  if (!hit.triangle) return false;
+
+  const auto& tri = *hit.triangle;
+  const auto& center = hit.center;
+  res.distance = hit.t;
+  res.material = tri.material;
+
+  // TIPS:交差点、法線、UVは頂点の値と重心座標から求められる
+  //      位置は距離からではなく重心座標から求めた方が誤差が少ない
+  Triangle polygon = tri.geometry->polygon(tri.face);
+  res.hit_pos = polygon.a * center.x() + polygon.b * center.y() + polygon.c * center.z();
+  Vec3f cross = (polygon.b - polygon.a).cross(polygon.c - polygon.a);
+  res.hit_geometric_normal = cross.normalized();
+  res.hit_normal = tri.geometry->normal(tri.face, center);
+  if (tri.material->hasTexture()) {
+    res.hit_uv = tri.geometry->uv(tri.face, center);
+
+    Vec3f uv_a = tri.geometry->uv(tri.face, Vec3f::UnitX());
+    Vec3f uv_b = tri.geometry->uv(tri.face, Vec3f::UnitY());
+    Vec3f uv_c = tri.geometry->uv(tri.face, Vec3f::UnitZ());
+    Real uv_area = std::abs((uv_b - uv_a).cross(uv_c - uv_a).z());
+    Real area    = cross.norm();
+    res.hit_uv_density = (area > 0.0) ? uv_area / area : 0.0;
+  }
 
-          if (t.uv) {
-            res.hit_uv = t.uv->a * hit_center.x()
-                       + t.uv->b * hit_center.y()
-                       + t.uv->c * hit_center.z();
-          }
-        }
+  return true;
+}
+
+
+// 光線を遮るポリゴンがあるか調べる
+// ※最も近い交差点は求めない(シャドウレイ用)
+bool occluded(const Ray& ray, const BvhNode& node, const Float max_t) {
+  Float t;
+  if (!testRayBox(t, ray, node.bbox, max_t)) return false;
+
+  if (node.children.empty()) {
+    for (const auto& tri : node.triangles) {
+      Float hit_t;
+      Vec3f hit_center;
+      if (testRayTriangle(hit_t, hit_center, ray, *tri.geometry, tri.face, false, max_t)) {
+        return true;
       }
     }
+    for (const auto* s : node.shapes) {
+      Real t;
+      if (s->intersect(t, ray.start, ray.vec, false, max_t)) return true;
+    }
+    return false;
   }
-  else {
-    if (intersect(res, ray_start, ray_vec, node.children[0], back_face)) hit_res = true;
-    if (intersect(res, ray_start, ray_vec, node.children[1], back_face)) hit_res = true;
-  }
-  
-  return hit_res;
+
+  return occluded(ray, node.children[0], max_t)
+      || occluded(ray, node.children[1], max_t);
+}
+
+// max_distance ray_vecが正規化されている時の判定距離
+bool occluded(const Vec3f& ray_start, const Vec3f& ray_vec, const BvhNode& node,
+              const Real max_distance = FLT_MAX) {
+  Float max_t = (max_distance < FLT_MAX) ? Float(max_distance) : std::numeric_limits<Float>::max();
+  return occluded(createRay(ray_start, ray_vec), node, max_t);
 }
 
 }
@@ -8,6 +8,8 @@
 
 #include "defines.hpp"
 #include <cfloat>
+#include <cstring>
+#include <cstdint>
 #include "matrix.hpp"
 
 
@@ -297,4 +299,34 @@ bool testRayTriangle(Vec3f& res, Real& t, Vec3f& n, Vec3f& center,
   return true;
 }
 
+
+// 交差点から光線を飛ばす時の開始位置
+// 交差点の誤差より少しだけ法線方向にずらす(固定の距離ではシーンの大きさで破綻する)
+// n 光線を飛ばす側を向いた面の法線
+// TIPS:交差判定はfloatなので、floatの表現できる間隔(ulp)単位でずらす
+// SOURCE:Wachter, Binder "A Fast and Robust Method for Avoiding Self-Intersection" (Ray Tracing Gems 6)
+Vec3f offsetRayOrigin(const Vec3f& p, const Vec3f& n) {
+  const float origin      = 1.0f / 32.0f;
+  const float float_scale = 1.0f / 65536.0f;
+  const float int_scale   = 256.0f;
+
+  Vec3f res;
+  for (int i = 0; i < 3; ++i) {
+    // 原点付近は間隔が細かすぎるので、一定量ずらす
+    if (std::abs(p(i)) < origin) {
+      res(i) = p(i) + float_scale * n(i);
+      continue;
+    }
+
+    float v = float(p(i));
+    int32_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    int32_t of = int32_t(int_scale * n(i));
+    bits += (v < 0) ? -of : of;
+    std::memcpy(&v, &bits, sizeof(v));
+    res(i) = v;
+  }
+  return res;
+}
+
 }
@@ -6,6 +6,8 @@
 //
 
 #include "defines.hpp"
+#include <cmath>
+#include <vector>
 #include <GLFW/glfw3.h>
 
 
@@ -16,6 +18,36 @@ namespace {
 using Pixel = Eigen::Array<Real, 3, 1>;
 
 
+// 輝度
+Real luminance(const Pixel& pixel) {
+  return 0.2126 * pixel.x() + 0.7152 * pixel.y() + 0.0722 * pixel.z();
+}
+
+
+// sRGB ←→ リニア
+// SOURCE:IEC 61966-2-1
+float srgbToLinear(const float value) {
+  return (value <= 0.04045f) ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+float linearToSrgb(const float value) {
+  return (value <= 0.0031308f) ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+}
+
+// 8bitのsRGB→リニア
+// TIPS:参照のたびにpowを呼ばないよう、表にしておく
+const float* srgbTable() {
+  static const std::vector<float> table = []() {
+    std::vector<float> t(256);
+    for (int i = 0; i < 256; ++i) {
+      t[i] = srgbToLinear(i / 255.0f);
+    }
+    return t;
+  }();
+  return &table[0];
+}
+
+
 class Color {
   float red_;
   float green_;
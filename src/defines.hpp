@@ -33,6 +33,21 @@ using Real = double;
 #endif
 
 
+// 交差判定の精度
+// 1:頂点、BVH、レイと交差判定をfloatで行う(カメラとピクセルの蓄積はReal)
+// 0:全てRealで行う(比較用)
+// TIPS:3要素のベクトルだけをfloatにするので、Eigenのアライメントの問題は起きない
+#ifndef MIXED_PRECISION
+#define MIXED_PRECISION 1
+#endif
+
+#if MIXED_PRECISION
+using Float = float;
+#else
+using Float = Real;
+#endif
+
+
 // 符号無し整数の別名定義
 using u_char = unsigned char;
 using u_int  = unsigned int;
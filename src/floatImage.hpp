@@ -0,0 +1,86 @@
+﻿
+#pragma once
+
+//
+// 露出をかける前の画像(RGBのfloat)を書き出す
+// Radiance HDR(.hdr)とPortable Float Map(.pfm)に対応
+// TIPS:1行ずつ取り出して書き出すので、画像全体のコピーは作らない
+//      行の番号はWritePngと同じく下から上に数える
+//
+
+#include "defines.hpp"
+#include <cstdio>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <functional>
+#include "fileUtil.hpp"
+#include "rgbe.h"
+
+
+namespace {
+
+// y行目(RGB x width)をrowに写す
+using FloatRowReader = std::function<void (const int y, float* row)>;
+
+
+bool WriteHdr(const std::string& path, const int width, const int height, const FloatRowReader& read_row) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    DOUT << "File create error:" << path << std::endl;
+    return false;
+  }
+
+  bool result = RGBE_WriteHeader(fp, width, height, NULL) == RGBE_RETURN_SUCCESS;
+
+  // TIPS:ヘッダが-Yなので上の行から書き出す
+  std::vector<float> row(width * 3);
+  for (int y = height - 1; result && (y >= 0); --y) {
+    read_row(y, &row[0]);
+    result = RGBE_WritePixels_RLE(fp, &row[0], width, 1) == RGBE_RETURN_SUCCESS;
+  }
+
+  fclose(fp);
+  return result;
+}
+
+
+// SOURCE:http://www.pauldebevec.com/Research/HDR/PFM/
+bool WritePfm(const std::string& path, const int width, const int height, const FloatRowReader& read_row) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    DOUT << "File create error:" << path << std::endl;
+    return false;
+  }
+
+  // スケールの符号でバイトオーダーを表す(負ならリトルエンディアン)
+  uint16_t order = 1;
+  u_char first;
+  std::memcpy(&first, &order, 1);
+  bool result = fprintf(fp, "PF\n%d %d\n%s\n", width, height, first ? "-1.0" : "1.0") > 0;
+
+  // TIPS:PFMは下の行から並ぶので、そのまま書き出せる
+  std::vector<float> row(width * 3);
+  for (int y = 0; result && (y < height); ++y) {
+    read_row(y, &row[0]);
+    result = fwrite(&row[0], sizeof(float) * 3, width, fp) == size_t(width);
+  }
+
+  fclose(fp);
+  return result;
+}
+
+
+// 拡張子で形式を選ぶ
+bool WriteFloatImage(const std::string& path, const int width, const int height, const FloatRowReader& read_row) {
+  auto ext = getFilenameExt(path);
+  if (ext == "pfm") return WritePfm(path, width, height, read_row);
+  if (ext == "hdr") return WriteHdr(path, width, height, read_row);
+
+  DOUT << "Unknown format:" << path << std::endl;
+  return false;
+}
+
+}
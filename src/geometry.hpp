@@ -0,0 +1,217 @@
+﻿
+#pragma once
+
+//
+// レイトレース用の頂点情報
+// 頂点、法線、UVを別々の配列にして、面はインデックスで参照する
+// TIPS:配列の実体は持たず、storageで寿命を管理する
+//      (Assimpから生成した配列、ファイルを割り当てたメモリなど)
+//      法線とUVは圧縮した形式(八面体に投影した32bit、半精度x2)でも持てる
+//
+
+#include "defines.hpp"
+#include <memory>
+#include <vector>
+#include "vector.hpp"
+#include "collision.hpp"
+#include "packing.hpp"
+
+
+namespace {
+
+class Geometry {
+public:
+	struct Vtx {
+		float x, y, z;
+	};
+
+	struct Uv {
+		float u, v;
+	};
+
+	struct Face {
+		u_int v1, v2, v3;
+	};
+
+  // 圧縮した法線とUV
+  using PackedNormal = uint32_t;
+  using PackedUv     = uint32_t;
+
+
+private:
+  bool has_texture_;
+
+  u_int vertices_;
+  u_int faces_;
+
+  const Vtx*  positions_;
+  const Vtx*  normals_;
+  const Uv*   uvs_;
+  const Face* indices_;
+
+  const PackedNormal* packed_normals_;
+  const PackedUv*     packed_uvs_;
+
+  std::shared_ptr<const void> storage_;
+
+  // 圧縮した配列と元の配列
+  struct PackedStreams {
+    std::shared_ptr<const void> base;
+    std::vector<PackedNormal> normals;
+    std::vector<PackedUv>     uvs;
+  };
+
+
+public:
+  Geometry() :
+    has_texture_(false),
+    vertices_(0),
+    faces_(0),
+    positions_(nullptr),
+    normals_(nullptr),
+    uvs_(nullptr),
+    indices_(nullptr),
+    packed_normals_(nullptr),
+    packed_uvs_(nullptr)
+  {}
+
+  // storage 配列の実体(配列を参照している間は保持しておく)
+  Geometry(const bool has_texture,
+           const u_int vertices,
+           const Vtx* positions, const Vtx* normals, const Uv* uvs,
+           const u_int faces, const Face* indices,
+           const std::shared_ptr<const void>& storage) :
+    has_texture_(has_texture),
+    vertices_(vertices),
+    faces_(faces),
+    positions_(positions),
+    normals_(normals),
+    uvs_(has_texture ? uvs : nullptr),
+    indices_(indices),
+    packed_normals_(nullptr),
+    packed_uvs_(nullptr),
+    storage_(storage)
+  {}
+
+  // 圧縮した法線とUVから生成
+  Geometry(const bool has_texture,
+           const u_int vertices,
+           const Vtx* positions, const PackedNormal* normals, const PackedUv* uvs,
+           const u_int faces, const Face* indices,
+           const std::shared_ptr<const void>& storage) :
+    has_texture_(has_texture),
+    vertices_(vertices),
+    faces_(faces),
+    positions_(positions),
+    normals_(nullptr),
+    uvs_(nullptr),
+    indices_(indices),
+    packed_normals_(normals),
+    packed_uvs_(has_texture ? uvs : nullptr),
+    storage_(storage)
+  {}
+
+
+  // 法線とUVを圧縮したものを生成
+  // TIPS:頂点と面の配列は共有する
+  Geometry quantized() const {
+    if (packed_normals_ || !normals_) return *this;
+
+    auto streams = std::make_shared<PackedStreams>();
+    streams->base = storage_;
+    streams->normals.reserve(vertices_);
+    for (u_int i = 0; i < vertices_; ++i) {
+      const auto& n = normals_[i];
+      streams->normals.push_back(packOctahedral(n.x, n.y, n.z));
+    }
+    if (has_texture_) {
+      streams->uvs.reserve(vertices_);
+      for (u_int i = 0; i < vertices_; ++i) {
+        streams->uvs.push_back(packHalf2(uvs_[i].u, uvs_[i].v));
+      }
+    }
+
+    return Geometry(has_texture_, vertices_,
+                    positions_, streams->normals.data(), streams->uvs.data(),
+                    faces_, indices_,
+                    streams);
+  }
+
+
+  bool hasTexture() const { return has_texture_; }
+
+  u_int vertices() const { return vertices_; }
+  u_int faces() const { return faces_; }
+
+  bool isQuantized() const { return packed_normals_ != nullptr; }
+
+  const Vtx*  positions() const { return positions_; }
+  const Vtx*  normals() const { return normals_; }
+  const Uv*   uvs() const { return uvs_; }
+  const Face* indices() const { return indices_; }
+
+
+  // 面の頂点座標
+  Triangle polygon(const u_int face) const {
+    const auto& f = indices_[face];
+    return Triangle{ position(f.v1), position(f.v2), position(f.v3) };
+  }
+
+  // 重心座標から面上の法線を求める
+  Vec3f normal(const u_int face, const Vec3f& center) const {
+    const auto& f  = indices_[face];
+    if (packed_normals_) {
+      return (unpackOctahedral<Vec3f>(packed_normals_[f.v1]) * center.x()
+            + unpackOctahedral<Vec3f>(packed_normals_[f.v2]) * center.y()
+            + unpackOctahedral<Vec3f>(packed_normals_[f.v3]) * center.z()).normalized();
+    }
+
+    const auto& n1 = normals_[f.v1];
+    const auto& n2 = normals_[f.v2];
+    const auto& n3 = normals_[f.v3];
+    return Vec3f(n1.x * center.x() + n2.x * center.y() + n3.x * center.z(),
+                 n1.y * center.x() + n2.y * center.y() + n3.y * center.z(),
+                 n1.z * center.x() + n2.z * center.y() + n3.z * center.z()).normalized();
+  }
+
+  // 重心座標から面上のUVを求める
+  Vec3f uv(const u_int face, const Vec3f& center) const {
+    if (!has_texture_) return Vec3f::Zero();
+
+    const auto& f   = indices_[face];
+    if (packed_uvs_) {
+      float u[3];
+      float v[3];
+      unpackHalf2(u[0], v[0], packed_uvs_[f.v1]);
+      unpackHalf2(u[1], v[1], packed_uvs_[f.v2]);
+      unpackHalf2(u[2], v[2], packed_uvs_[f.v3]);
+      return Vec3f(u[0] * center.x() + u[1] * center.y() + u[2] * center.z(),
+                   v[0] * center.x() + v[1] * center.y() + v[2] * center.z(),
+                   0.0);
+    }
+
+    const auto& uv1 = uvs_[f.v1];
+    const auto& uv2 = uvs_[f.v2];
+    const auto& uv3 = uvs_[f.v3];
+    return Vec3f(uv1.u * center.x() + uv2.u * center.y() + uv3.u * center.z(),
+                 uv1.v * center.x() + uv2.v * center.y() + uv3.v * center.z(),
+                 0.0);
+  }
+
+  // 保持しているメモリ量
+  size_t memory() const {
+    size_t attribute = packed_normals_ ? (sizeof(PackedNormal) + (has_texture_ ? sizeof(PackedUv) : 0))
+                                       : (sizeof(Vtx) + (has_texture_ ? sizeof(Uv) : 0));
+    return vertices_ * (sizeof(Vtx) + attribute) + faces_ * sizeof(Face);
+  }
+
+
+private:
+  Vec3f position(const u_int index) const {
+    const auto& v = positions_[index];
+    return Vec3f(v.x, v.y, v.z);
+  }
+
+};
+
+}
@@ -17,26 +17,39 @@ class GlBuffer : private boost::noncopyable {
 
   
 public:
-  GlBuffer() {
+  // TIPS:OpenGLのコンテキストがあるスレッドで転送するまで、バッファは生成しない
+  GlBuffer() :
+    vbo_(0)
+  {
     DOUT << "GlBuffer()" << std::endl;
-		glGenBuffers(1, &vbo_);
   }
 
   ~GlBuffer() {
     DOUT << "~GlBuffer()" << std::endl;
-		glDeleteBuffers(1, &vbo_);
+		if (vbo_) glDeleteBuffers(1, &vbo_);
   }
 
 
   template <typename T>
   void setData(const GLenum target, const std::vector<T>& body) {
     target_ = target;
+    if (!vbo_) glGenBuffers(1, &vbo_);
 
     bind();
 		glBufferData(target, sizeof(T) * body.size(), &body[0], GL_STATIC_DRAW);
     unbind();
   }
 
+  template <typename T>
+  void setData(const GLenum target, const T* body, const size_t num) {
+    target_ = target;
+    if (!vbo_) glGenBuffers(1, &vbo_);
+
+    bind();
+		glBufferData(target, sizeof(T) * num, body, GL_STATIC_DRAW);
+    unbind();
+  }
+
 
   void bind() const {
 		glBindBuffer(target_, vbo_);
@@ -0,0 +1,419 @@
+﻿
+#pragma once
+
+//
+// パスガイディング
+// 入射光の分布を空間(二分木)と方向(四分木)で学習する
+// SOURCE:Practical Path Guiding for Efficient Light-Transport Simulation
+//        by Thomas Müller, Markus Gross and Jan Novák
+//
+
+#include "defines.hpp"
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include "vector.hpp"
+#include "utils.hpp"
+#include "bvh.hpp"
+
+
+namespace {
+
+// 方向の分布(四分木)
+// 方向は円筒座標で[0, 1]x[0, 1]の正方形に等積写像する
+class DTree {
+  struct DNode {
+    int   child[4];                                 // 0の場合は葉
+    float energy[4];
+  };
+
+  // サンプリングに使う分布(前のパスで記録したもの)
+  std::vector<DNode> sampling_;
+  float total_;
+
+  // 記録中の分布
+  std::vector<DNode> building_;
+  std::unique_ptr<std::atomic<float>[]> record_;
+  std::atomic<u_int> sample_count_;
+
+  enum {
+    MAX_DEPTH = 20
+  };
+
+
+public:
+  DTree() :
+    sampling_(1, emptyNode()),
+    total_(0.0f),
+    building_(1, emptyNode()),
+    sample_count_(0)
+  {
+    resetRecord();
+  }
+
+  DTree(const DTree& src) :
+    sampling_(src.sampling_),
+    total_(src.total_),
+    building_(src.building_),
+    sample_count_(src.sample_count_.load())
+  {
+    resetRecord();
+    for (size_t i = 0; i < building_.size() * 4; ++i) {
+      record_[i] = src.record_[i].load();
+    }
+  }
+
+  DTree(DTree&& src) :
+    sampling_(std::move(src.sampling_)),
+    total_(src.total_),
+    building_(std::move(src.building_)),
+    record_(std::move(src.record_)),
+    sample_count_(src.sample_count_.load())
+  {}
+
+
+  // 学習済みの分布があるか
+  bool valid() const { return total_ > 0.0f; }
+
+  u_int sampleCount() const { return sample_count_; }
+  void sampleCount(const u_int count) { sample_count_ = count; }
+
+  // 使用メモリ(bytes)
+  // TIPS:記録用のノードは、区画ごとに加算する領域も持つ
+  size_t memory() const {
+    return sampling_.size() * sizeof(DNode) + building_.size() * (sizeof(DNode) + sizeof(std::atomic<float>) * 4);
+  }
+
+  // サンプリング用と記録用を1つずつ作る時のメモリ
+  static size_t nodePairMemory() {
+    return sizeof(DNode) * 2 + sizeof(std::atomic<float>) * 4;
+  }
+
+
+  // 分布に従って方向を選ぶ
+  Vec3f sample(Real u1, const Real u2) const {
+    Vec2f origin(0.0, 0.0);
+    Real size = 1.0;
+
+    int index = 0;
+    while (1) {
+      const auto& node = sampling_[index];
+      Real total = node.energy[0] + node.energy[1] + node.energy[2] + node.energy[3];
+      if (total <= 0.0) break;
+
+      // 選んだ区画の範囲で乱数を再利用する
+      int  q   = 0;
+      Real p   = 0.0;
+      Real sum = 0.0;
+      for (int i = 0; i < 4; ++i) {
+        if (node.energy[i] <= 0.0f) continue;
+        q = i;
+        p = node.energy[i] / total;
+        if (u1 < (sum + p)) break;
+        sum += p;
+      }
+      u1 = minmax((u1 - sum) / p, Real(0.0), Real(0.999999));
+
+      size /= 2;
+      origin.x() += (q & 1) * size;
+      origin.y() += (q >> 1) * size;
+
+      index = node.child[q];
+      if (!index) break;
+    }
+
+    return squareToDirection(origin + Vec2f(u1, u2) * size);
+  }
+
+  // 立体角あたりの確率密度
+  Real pdf(const Vec3f& vec) const {
+    if (!valid()) return 0.0;
+
+    Vec2f pos = directionToSquare(vec);
+    Real pdf = 1.0;
+
+    int index = 0;
+    while (1) {
+      const auto& node = sampling_[index];
+      Real total = node.energy[0] + node.energy[1] + node.energy[2] + node.energy[3];
+      if (total <= 0.0) break;
+
+      int q = quadrant(pos);
+      pdf *= 4.0 * node.energy[q] / total;
+
+      index = node.child[q];
+      if (!index) break;
+    }
+
+    // 正方形の面積1が全球4πに対応する
+    return pdf / (4.0 * M_PI);
+  }
+
+
+  // 入射光を記録する
+  // count falseの時はサンプル数に数えない(直接光のように、1つの頂点で何度も記録する場合)
+  // ※複数スレッドから呼び出せる
+  void record(const Vec3f& vec, const Real value, const bool count = true) {
+    if (count) sample_count_ += 1;
+    if (!(value > 0.0)) return;
+
+    Vec2f pos = directionToSquare(vec);
+
+    int index = 0;
+    while (1) {
+      int q = quadrant(pos);
+      atomicAdd(record_[index * 4 + q], float(value));
+
+      index = building_[index].child[q];
+      if (!index) break;
+    }
+  }
+
+
+  // 記録した分布をサンプリング用にし、記録用の分布を細分化し直す
+  // threshold 全体に対してこの割合を超える区画を細分化する
+  // ※記録中に呼び出してはいけない
+  void update(const Real threshold, const size_t max_nodes) {
+    std::vector<DNode> recorded(building_);
+    float total = 0.0f;
+    for (size_t i = 0; i < recorded.size(); ++i) {
+      for (int q = 0; q < 4; ++q) {
+        recorded[i].energy[q] = record_[i * 4 + q];
+      }
+    }
+    for (int q = 0; q < 4; ++q) total += recorded[0].energy[q];
+
+    // 何も記録されなかった場合は前回の分布を使い続ける
+    if (total > 0.0f) {
+      sampling_ = std::move(recorded);
+      total_    = total;
+    }
+
+    refine(threshold, max_nodes);
+    sample_count_ = 0;
+  }
+
+
+private:
+  static DNode emptyNode() {
+    DNode node = { { 0, 0, 0, 0 }, { 0.0f, 0.0f, 0.0f, 0.0f } };
+    return node;
+  }
+
+  void resetRecord() {
+    record_.reset(new std::atomic<float>[building_.size() * 4]);
+    for (size_t i = 0; i < building_.size() * 4; ++i) {
+      record_[i] = 0.0f;
+    }
+  }
+
+  // 正方形内の位置から区画を求め、位置を区画内の座標に変換
+  static int quadrant(Vec2f& pos) {
+    int qx = (pos.x() >= 0.5) ? 1 : 0;
+    int qy = (pos.y() >= 0.5) ? 1 : 0;
+    pos.x() = pos.x() * 2 - qx;
+    pos.y() = pos.y() * 2 - qy;
+
+    return qx + qy * 2;
+  }
+
+  // サンプリング用の分布から、記録用の分布の構造を作る
+  void refine(const Real threshold, const size_t max_nodes) {
+    building_.assign(1, emptyNode());
+
+    if (total_ > 0.0f) {
+      refineNode(0, &sampling_[0], 0, threshold * total_, max_nodes);
+    }
+
+    resetRecord();
+  }
+
+  void refineNode(const int index, const DNode* src, const int depth,
+                  const Real threshold, const size_t max_nodes) {
+    if (depth >= MAX_DEPTH) return;
+
+    for (int q = 0; q < 4; ++q) {
+      if ((src->energy[q] <= threshold) || (building_.size() >= max_nodes)) continue;
+
+      // 元の分布に子供が無い場合は均等に分ける
+      DNode child = emptyNode();
+      const DNode* child_src = src->child[q] ? &sampling_[src->child[q]] : nullptr;
+      for (int i = 0; i < 4; ++i) {
+        child.energy[i] = child_src ? child_src->energy[i] : src->energy[q] / 4;
+      }
+
+      int child_index = int(building_.size());
+      building_[index].child[q] = child_index;
+      building_.push_back(child);
+
+      // TIPS:元の分布に子供がいない場合は、今作った子供を元にする
+      DNode temp = child;
+      refineNode(child_index, child_src ? child_src : &temp, depth + 1, threshold, max_nodes);
+    }
+  }
+
+
+  // 正方形→方向(円筒座標による等積写像)
+  static Vec3f squareToDirection(const Vec2f& pos) {
+    Real cos_theta = 2.0 * pos.y() - 1.0;
+    Real sin_theta = std::sqrt(std::max(Real(0.0), 1.0 - cos_theta * cos_theta));
+    Real phi = 2.0 * M_PI * pos.x();
+
+    return Vec3f(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+  }
+
+  // 方向→正方形
+  static Vec2f directionToSquare(const Vec3f& vec) {
+    Real cos_theta = minmax(vec.z(), Real(-1.0), Real(1.0));
+    Real phi = std::atan2(vec.y(), vec.x());
+    if (phi < 0.0) phi += 2.0 * M_PI;
+
+    return Vec2f(minmax(phi / (2.0 * M_PI), Real(0.0), Real(0.999999)),
+                 minmax((cos_theta + 1.0) / 2.0, Real(0.0), Real(0.999999)));
+  }
+
+};
+
+
+// 空間の分布(二分木)
+// 葉ごとに方向の分布を持つ
+class SdTree {
+  struct SNode {
+    int axis;
+    int child[2];                                   // 0の場合は葉
+    int dtree;
+  };
+
+  Bvh::BBox bbox_;
+  std::vector<SNode> nodes_;
+  std::vector<DTree> dtrees_;
+
+  int  iteration_;
+  bool recording_;
+
+  Real bsdf_fraction_;
+  Real spatial_threshold_;
+  size_t max_memory_;
+
+
+public:
+  // spatial_threshold 空間を分割するサンプル数
+  // max_memory 使用メモリの上限(bytes)
+  SdTree(const Bvh::BBox& bbox,
+         const Real bsdf_fraction,
+         const Real spatial_threshold,
+         const size_t max_memory) :
+    bbox_(bbox),
+    nodes_(1, SNode{ 0, { 0, 0 }, 0 }),
+    dtrees_(1),
+    iteration_(0),
+    recording_(true),
+    bsdf_fraction_(bsdf_fraction),
+    spatial_threshold_(spatial_threshold),
+    max_memory_(max_memory)
+  {}
+
+
+  // 学習を続けるか
+  bool recording() const { return recording_; }
+  void recording(const bool value) { recording_ = value; }
+
+  // ガイディングで方向を選ぶ割合
+  Real guideFraction() const { return 1.0 - bsdf_fraction_; }
+
+
+  // 位置を含む葉の方向の分布を返す
+  DTree& dtree(const Vec3f& pos) {
+    Bvh::BBox bbox = bbox_;
+
+    int index = 0;
+    while (nodes_[index].child[0]) {
+      const auto& node = nodes_[index];
+      Real middle = (bbox.inf(node.axis) + bbox.sup(node.axis)) / 2;
+      if (pos(node.axis) < middle) {
+        bbox.sup(node.axis) = middle;
+        index = node.child[0];
+      }
+      else {
+        bbox.inf(node.axis) = middle;
+        index = node.child[1];
+      }
+    }
+
+    return dtrees_[nodes_[index].dtree];
+  }
+
+
+  // パスの終わりに分布を更新する
+  // ※記録中に呼び出してはいけない
+  void update() {
+    // サンプルの多い場所を分割
+    // TIPS:パスごとにサンプル数が倍になるので、閾値もそれに合わせる
+    Real threshold = spatial_threshold_ * std::sqrt(std::pow(2.0, iteration_));
+    size_t node_num = nodes_.size();
+    for (size_t i = 0; i < node_num; ++i) {
+      subdivide(int(i), threshold);
+    }
+
+    // 方向の分布は、空間の葉で均等にメモリを割り当てる
+    size_t spatial_memory = nodes_.size() * sizeof(SNode) + dtrees_.size() * sizeof(DTree);
+    size_t directional_memory = (max_memory_ > spatial_memory) ? max_memory_ - spatial_memory : 0;
+    size_t max_nodes = std::max(directional_memory / dtrees_.size() / DTree::nodePairMemory(), size_t(1));
+
+    // 全体の1%を超える区画を細分化する
+    for (auto& dtree : dtrees_) {
+      dtree.update(0.01, max_nodes);
+    }
+
+    iteration_ += 1;
+
+    DOUT << "guiding iteration:" << iteration_
+         << " spatial:" << dtrees_.size()
+         << " memory:" << memory() << std::endl;
+  }
+
+  // 使用メモリ(bytes)
+  size_t memory() const {
+    size_t total = nodes_.size() * sizeof(SNode) + dtrees_.size() * sizeof(DTree);
+    for (const auto& dtree : dtrees_) {
+      total += dtree.memory();
+    }
+    return total;
+  }
+
+
+private:
+  void subdivide(const int index, const Real threshold) {
+    if (nodes_[index].child[0]) return;
+
+    auto& dtree = dtrees_[nodes_[index].dtree];
+    if (dtree.sampleCount() <= threshold) return;
+
+    // メモリの上限を超える場合は分割しない
+    if ((memory() + sizeof(SNode) * 2 + sizeof(DTree) + dtree.memory()) > max_memory_) return;
+
+    // サンプルを半分ずつ持つ子供を作る
+    u_int count = dtree.sampleCount() / 2;
+    dtree.sampleCount(count);
+
+    int axis = (nodes_[index].axis + 1) % 3;
+    int child_index = int(nodes_.size());
+
+    // 片方は親の方向の分布をそのまま使う
+    int dtree_index = nodes_[index].dtree;
+    nodes_.push_back(SNode{ axis, { 0, 0 }, dtree_index });
+
+    dtrees_.push_back(DTree(dtrees_[dtree_index]));
+    nodes_.push_back(SNode{ axis, { 0, 0 }, int(dtrees_.size()) - 1 });
+
+    nodes_[index].child[0] = child_index;
+    nodes_[index].child[1] = child_index + 1;
+
+    subdivide(child_index, threshold);
+    subdivide(child_index + 1, threshold);
+  }
+
+};
+
+}
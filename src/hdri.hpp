@@ -4,27 +4,364 @@
 //
 // HDRI読み込み
 // SOURCE:http://www.graphics.cornell.edu/online/formats/rgbe/
+// TIPS:ファイルをメモリに割り当てて、RLEの行を並列に展開する
+//      対応していない形式はrgbe.cで読み込む
+//      テクセルはファイルと同じRGBE(4bytes)のまま持ち、参照する時に展開する
+//      参照は読み込み時に八面体マップへ描き直した画像から行い、三角関数を使わない
+//      重点サンプリングの分布だけは元の緯度経度で持つ
+// SOURCE:Cigolle et al. "A Survey of Efficient Representations for Independent Unit Vectors" (JCGT 2014)
 //
 
 #include "defines.hpp"
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <boost/noncopyable.hpp>
+#include "vector.hpp"
 #include "color.hpp"
 #include "utils.hpp"
+#include "packing.hpp"
+#include "parallel.hpp"
+#include "os.hpp"
 #include "rgbe.h"
 
 
 namespace {
 
 class Hdri {
+  // 元の緯度経度画像のサイズ
   int width_;
   int height_;
-  
-  std::vector<Pixel> pixel_;
+
+  // 八面体マップの縮小画像の列([0]が元の解像度)
+  // TIPS:読み込み直後の[0]だけは緯度経度画像
+  struct Level {
+    int width;
+    int height;
+    std::vector<uint32_t> texels;                   // RGBE
+  };
+  std::vector<Level> levels_;
+
+  // バイリニア補間するか
+  bool bilinear_;
+
+  // 重点サンプリング用の輝度分布
+  // TIPS:テクセル数と同じだけ必要なのでfloatで持つ
+  std::vector<float> marginal_cdf_;                 // 行を選ぶ累積分布(height + 1)
+  std::vector<float> conditional_cdf_;              // 行ごとに列を選ぶ累積分布((width + 1) * height)
+  Real integral_;                                   // 全方向の輝度の積分
+
+  // 疑似角度(角度と同じ順に並ぶ、三角関数を使わない値)の境界から区間を探す
+  // TIPS:疑似角度を等間隔に区切った表で見当をつけてから、数個だけ先へ進む
+  struct AngleBounds {
+    std::vector<float> bounds;                      // 境界(昇順)
+    std::vector<int>   start;                       // 区切りの始まりより前にある境界の数
+    Real scale;
+
+    // range  疑似角度の範囲[0, range)
+    // divide 1あたりの区切りの数(境界の間隔より細かくする)
+    void setup(const Real range, const int divide) {
+      scale = divide;
+      start.resize(int(range * divide) + 1);
+      for (size_t i = 0; i < start.size(); ++i) {
+        start[i] = int(std::lower_bound(bounds.begin(), bounds.end(), float(i / scale)) - bounds.begin());
+      }
+    }
+
+    // angle以下の境界の数
+    int find(const Real angle) const {
+      int i = start[minmax(int(angle * scale), 0, int(start.size()) - 1)];
+      while ((i < int(bounds.size())) && (bounds[i] <= angle)) ++i;
+      return i;
+    }
+  };
+
+  // 確率密度を求める時に、方向から緯度経度のピクセルを探す
+  AngleBounds row_bounds_;                          // θの境界
+  AngleBounds column_bounds_;                       // φの境界
+  int first_column_;                                // φ = 0の列
 
 
 public:
-  Hdri(const std::string& path) {
+  Hdri(const std::string& path) :
+    levels_(1),
+    bilinear_(false)
+  {
+    {
+      MappedFile file(path);
+      if (!file.valid() || !decode(file.data(), file.size())) {
+        DOUT << "HDRI: fallback to rgbe" << std::endl;
+        readRgbe(path);
+      }
+    }
+    levels_[0].width  = width_;
+    levels_[0].height = height_;
+
+    DOUT << "HDRI:" << width_ << "x" << height_
+         << " " << levels_[0].texels.size() * sizeof(uint32_t) / 1024 << "KB" << std::endl;
+
+    createDistribution();
+    createBounds();
+
+    levels_[0] = createOctahedral(levels_[0]);
+    DOUT << "HDRI octahedral:" << levels_[0].width << "x" << levels_[0].height << std::endl;
+  }
+
+
+  // 元の画像のサイズを返す
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // 全方向の輝度の積分
+  Real integral() const { return integral_; }
+
+
+  // 参照方法の設定
+  // bilinear バイリニア補間する
+  // mips     ぼかした参照(lodを指定するpixel)用の縮小画像を作る
+  void setupFilter(const bool bilinear, const bool mips) {
+    bilinear_ = bilinear;
+    if (mips && (levels_.size() == 1)) createMips();
+  }
+
+  int levels() const { return int(levels_.size()); }
+
+  // 広がり角(ラジアン)の光線が覆う範囲に合う縮小画像の段数
+  // TIPS:八面体マップの1テクセルはおよそ sqrt(4π) / 幅 の角度を覆う
+  Real lod(const Real spread) const {
+    if ((levels_.size() == 1) || (spread <= 0.0)) return 0.0;
+    return std::log2(spread * levels_[0].width / std::sqrt(4.0 * M_PI));
+  }
+
+
+  // 方向ベクトルからピクセルを求める
+  Pixel pixel(const Vec3f& vec) const {
+    Vec2f uv = directionToOctahedral(vec);
+    return lookup(levels_[0], uv.x(), uv.y());
+  }
+
+  // ぼかした値を求める
+  // lod 縮小画像の段数(0が元の画像、段の間は補間する)
+  Pixel pixel(const Vec3f& vec, const Real lod) const {
+    if ((levels_.size() == 1) || (lod <= 0.0)) return pixel(vec);
+
+    Vec2f uv = directionToOctahedral(vec);
+    Real l  = std::min(lod, Real(levels_.size() - 1));
+    int  l0 = int(l);
+    Real t  = l - l0;
+
+    Pixel p0 = lookup(levels_[l0], uv.x(), uv.y());
+    return (t > 0.0) ? Pixel(p0 * (1.0 - t) + lookup(levels_[l0 + 1], uv.x(), uv.y()) * t) : p0;
+  }
+
+
+  // 輝度分布に従って方向を選ぶ
+  // vec 選んだ方向
+  // pdf 立体角あたりの確率密度
+  Pixel sample(Vec3f& vec, Real& pdf, const Real u1, const Real u2) const {
+    // 行を選んでから、その行の中で列を選ぶ
+    Real dv;
+    int y = sampleCdf(dv, &marginal_cdf_[0], height_, u1);
+    Real du;
+    int x = sampleCdf(du, &conditional_cdf_[y * (width_ + 1)], width_, u2);
+
+    Real u = (x + du) / width_;
+    Real v = (y + dv) / height_;
+
+    // directionToUvの逆変換
+    Real theta = v * M_PI;
+    Real phi   = (u - 0.25) * 2.0 * M_PI;
+    Real sin_theta = std::sin(theta);
+    vec << sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi);
+
+    pdf = (sin_theta > 0.0) ? texelPdf(x, y) / (2.0 * M_PI * M_PI * sin_theta) : 0.0;
+
+    // TIPS:MISの相手側と同じ値になるよう、pixelで参照する
+    return pixel(vec);
+  }
+
+  // 方向に対する立体角あたりの確率密度
+  Real pdf(const Vec3f& vec) const {
+    Real sin_theta = std::sqrt(vec.x() * vec.x() + vec.z() * vec.z());
+    if (sin_theta <= 0.0) return 0.0;
+
+    // TIPS:acosの代わりに、疑似角度を境界と比べてピクセルを探す
+    int y = std::min(row_bounds_.find(pseudoAngle(vec.y(), sin_theta)), height_ - 1);
+    int x = (first_column_ + column_bounds_.find(pseudoAngle(vec.x(), vec.z()))) % width_;
+
+    return texelPdf(x, y) / (2.0 * M_PI * M_PI * sin_theta);
+  }
+
+
+  // 方向ベクトル→八面体マップのテクスチャ座標
+  // TIPS:+Yを中心に置き、下半分は四隅へ折り返す
+  static Vec2f directionToOctahedral(const Vec3f& vec) {
+    Real l = std::abs(vec.x()) + std::abs(vec.y()) + std::abs(vec.z());
+    Real a = vec.x() / l;
+    Real b = vec.z() / l;
+    if (vec.y() < 0.0) {
+      Real fa = (1.0 - std::abs(b)) * ((a >= 0.0) ? 1.0 : -1.0);
+      Real fb = (1.0 - std::abs(a)) * ((b >= 0.0) ? 1.0 : -1.0);
+      a = fa;
+      b = fb;
+    }
+    return Vec2f{ a * 0.5 + 0.5, b * 0.5 + 0.5 };
+  }
+
+  static Vec3f octahedralToDirection(const Real u, const Real v) {
+    Real a = u * 2.0 - 1.0;
+    Real b = v * 2.0 - 1.0;
+    Real y = 1.0 - std::abs(a) - std::abs(b);
+    if (y < 0.0) {
+      Real fa = (1.0 - std::abs(b)) * ((a >= 0.0) ? 1.0 : -1.0);
+      Real fb = (1.0 - std::abs(a)) * ((b >= 0.0) ? 1.0 : -1.0);
+      a = fa;
+      b = fb;
+    }
+    return Vec3f(a, y, b).normalized();
+  }
+
+  // 方向ベクトル→緯度経度のテクスチャ座標
+  // TIPS:読み込み時の変換でだけ使う
+  static Vec2f directionToUv(const Vec3f& vec) {
+    Real thera = std::acos(minmax(vec.y(), Real(-1.0), Real(1.0)));
+    Real l = std::sqrt(vec.x() * vec.x() + vec.z() * vec.z());
+    Real xz = (l > 0.0) ? vec.x() / l : 0.0;
+    Real phi = std::acos(minmax(xz, Real(-1.0), Real(1.0)));
+    if (vec.z() < 0.0) {
+      phi = 2.0 * M_PI - phi;
+    }
+
+    return Vec2f{ phi / (2.0 * M_PI) + 0.25, thera / M_PI };
+  }
+
+
+private:
+  // ヘッダを読んで、各行の開始位置を調べてから並列に展開する
+  // 対応していない形式の時はfalse
+  bool decode(const u_char* data, const size_t size) {
+    const u_char* end = data + size;
+    const u_char* p   = data;
+
+    // 1行ずつ取り出す(改行は含まない)
+    auto read_line = [&p, end](std::string& line) {
+      const u_char* eol = std::find(p, end, u_char('\n'));
+      if (eol == end) return false;
+      line.assign(reinterpret_cast<const char*>(p), eol - p);
+      p = eol + 1;
+      return true;
+    };
+
+    std::string line;
+    if (!read_line(line) || (line.compare(0, 2, "#?") != 0)) return false;
+
+    // 空行までがヘッダ
+    while (1) {
+      if (!read_line(line)) return false;
+      if (line.empty()) break;
+      if ((line.compare(0, 7, "FORMAT=") == 0) && (line != "FORMAT=32-bit_rle_rgbe")) return false;
+    }
+
+    // TIPS:上から下、左から右の並びだけ対応
+    int width;
+    int height;
+    if (!read_line(line) || (std::sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2)) return false;
+    if ((width <= 0) || (height <= 0)) return false;
+
+    // 各行の開始位置
+    // TIPS:RLEは展開しないと長さがわからないので、長さだけを順番に調べる
+    std::vector<const u_char*> rows(height + 1);
+    for (int y = 0; y < height; ++y) {
+      rows[y] = p;
+      p = skipScanline(p, end, width);
+      if (!p) return false;
+    }
+    rows[height] = p;
+
+    width_  = width;
+    height_ = height;
+    auto& texels = levels_[0].texels;
+    texels.resize(width_ * height_);
+
+    parallelFor(height_,
+                [this, &rows, &texels](const size_t y) {
+                  decodeScanline(&texels[y * width_], rows[y], width_);
+                });
+
+    return true;
+  }
+
+  static bool isRle(const u_char* p, const u_char* end, const int width) {
+    return (width >= 8) && (width <= 0x7fff) && ((end - p) >= 4)
+        && (p[0] == 2) && (p[1] == 2) && !(p[2] & 0x80)
+        && (((p[2] << 8) | p[3]) == width);
+  }
+
+  // 次の行の開始位置(壊れているか、古い形式のRLEの時はnullptr)
+  static const u_char* skipScanline(const u_char* p, const u_char* end, const int width) {
+    if (!isRle(p, end, width)) {
+      if ((end - p) < (width * 4)) return nullptr;
+      for (int x = 0; x < width; ++x) {
+        // TIPS:(1, 1, 1, n)は古い形式の繰り返し
+        if ((p[x * 4] == 1) && (p[x * 4 + 1] == 1) && (p[x * 4 + 2] == 1)) return nullptr;
+      }
+      return p + width * 4;
+    }
+
+    p += 4;
+    for (int c = 0; c < 4; ++c) {
+      int count = 0;
+      while (count < width) {
+        if (p >= end) return nullptr;
+        int n = *p++;
+        if (n > 128) {
+          // 同じ値の繰り返し
+          n -= 128;
+          p += 1;
+        }
+        else {
+          if (n == 0) return nullptr;
+          p += n;
+        }
+        count += n;
+        if ((count > width) || (p > end)) return nullptr;
+      }
+    }
+    return p;
+  }
+
+  // 1行を展開する(範囲はskipScanlineで確認済み)
+  // TIPS:texelはR, G, B, Eの順にバイトが並ぶので(リトルエンディアン)、直接書き込む
+  static void decodeScanline(uint32_t* dst, const u_char* p, const int width) {
+    u_char* rgbe = reinterpret_cast<u_char*>(dst);
+    if (!isRle(p, p + 4, width)) {
+      std::memcpy(rgbe, p, width * 4);
+      return;
+    }
+
+    // 成分ごとに並んでいるので、並べ直しながら展開する
+    p += 4;
+    for (int c = 0; c < 4; ++c) {
+      int x = 0;
+      while (x < width) {
+        int n = *p++;
+        if (n > 128) {
+          n -= 128;
+          u_char value = *p++;
+          for (int i = 0; i < n; ++i) rgbe[(x + i) * 4 + c] = value;
+        }
+        else {
+          for (int i = 0; i < n; ++i) rgbe[(x + i) * 4 + c] = p[i];
+          p += n;
+        }
+        x += n;
+      }
+    }
+  }
+
+  void readRgbe(const std::string& path) {
     FILE* f = fopen(path.c_str(), "rb");
 
     RGBE_ReadHeader(f, &width_, &height_, NULL);
@@ -34,33 +371,218 @@ public:
 
     fclose(f);
 
-    pixel_.reserve(width_ * height_);
-
-    int index = 0;
+    auto& texels = levels_[0].texels;
+    texels.resize(width_ * height_);
     for (int i = 0; i < (width_ * height_); ++i) {
-      Real r = image[index + 0];
-      Real g = image[index + 1];
-      Real b = image[index + 2];
+      texels[i] = packRgbe(image[i * 3 + 0], image[i * 3 + 1], image[i * 3 + 2]);
+    }
+  }
+
+
+  Pixel texel(const Level& level, const int x, const int y) const {
+    float r, g, b;
+    unpackRgbe(r, g, b, level.texels[y * level.width + x]);
+    return Pixel(r, g, b);
+  }
 
-      pixel_.push_back({ r, g, b });
-      
-      index += 3;
+  // 八面体マップを参照する
+  Pixel lookup(const Level& level, const Real u, const Real v) const {
+    if (!bilinear_) {
+      int x = std::min(int(level.width * u),  level.width - 1);
+      int y = std::min(int(level.height * v), level.height - 1);
+      return texel(level, x, y);
     }
 
-    DOUT << "HDRI:" << width_ << "x" << height_ << std::endl;
+    Real fx = u * level.width  - 0.5;
+    Real fy = v * level.height - 0.5;
+    int  x0 = int(std::floor(fx));
+    int  y0 = int(std::floor(fy));
+    Real tx = fx - x0;
+    Real ty = fy - y0;
+
+    return (octahedralTexel(level, x0, y0) * (1.0 - tx) + octahedralTexel(level, x0 + 1, y0) * tx) * (1.0 - ty)
+         + (octahedralTexel(level, x0, y0 + 1) * (1.0 - tx) + octahedralTexel(level, x0 + 1, y0 + 1) * tx) * ty;
   }
-  
 
-  // サイズを返す
-  int width() const { return width_; }
-  int height() const { return height_; }
+  // 端の外側は、辺の中点で反転した向こう側のテクセルになる
+  Pixel octahedralTexel(const Level& level, int x, int y) const {
+    if ((x < 0) || (x >= level.width)) {
+      x = minmax(x, 0, level.width - 1);
+      y = level.height - 1 - y;
+    }
+    if ((y < 0) || (y >= level.height)) {
+      y = minmax(y, 0, level.height - 1);
+      x = level.width - 1 - x;
+    }
+    return texel(level, x, y);
+  }
+
+  // 緯度経度画像のバイリニア補間
+  // TIPS:横方向は繰り返し、縦方向は端で止める
+  Pixel latLong(const Level& level, const Real u, const Real v) const {
+    Real fx = u * level.width  - 0.5;
+    Real fy = v * level.height - 0.5;
+    int  x0 = int(std::floor(fx));
+    int  y0 = int(std::floor(fy));
+    Real tx = fx - x0;
+    Real ty = fy - y0;
+
+    int xa = ((x0 % level.width) + level.width) % level.width;
+    int xb = (xa + 1) % level.width;
+    int ya = minmax(y0,     0, level.height - 1);
+    int yb = minmax(y0 + 1, 0, level.height - 1);
+
+    return (texel(level, xa, ya) * (1.0 - tx) + texel(level, xb, ya) * tx) * (1.0 - ty)
+         + (texel(level, xa, yb) * (1.0 - tx) + texel(level, xb, yb) * tx) * ty;
+  }
+
+  // 2x2を平均して半分の大きさにしていく
+  void createMips() {
+    size_t memory = 0;
+    while ((levels_.back().width > 1) || (levels_.back().height > 1)) {
+      const Level& src = levels_.back();
+      Level dst{ std::max(src.width / 2, 1), std::max(src.height / 2, 1), {} };
+      dst.texels.resize(dst.width * dst.height);
 
+      parallelFor(dst.height,
+                  [this, &src, &dst](const size_t y) {
+                    int y0 = std::min(int(y) * 2,     src.height - 1);
+                    int y1 = std::min(int(y) * 2 + 1, src.height - 1);
+                    for (int x = 0; x < dst.width; ++x) {
+                      int x0 = std::min(x * 2,     src.width - 1);
+                      int x1 = std::min(x * 2 + 1, src.width - 1);
+                      Pixel p = (texel(src, x0, y0) + texel(src, x1, y0) + texel(src, x0, y1) + texel(src, x1, y1)) / 4.0;
+                      dst.texels[y * dst.width + x] = packRgbe(p.x(), p.y(), p.z());
+                    }
+                  });
+
+      memory += dst.texels.size() * sizeof(uint32_t);
+      levels_.push_back(std::move(dst));
+    }
+
+    DOUT << "HDRI mips:" << levels_.size() << " " << memory / 1024 << "KB" << std::endl;
+  }
+
+  // 緯度経度画像を、同じくらいのテクセル数の八面体マップに描き直す
+  // TIPS:1テクセルを2x2に分けて参照し、細い光源が抜け落ちないようにする
+  Level createOctahedral(const Level& src) const {
+    int size = std::max(int(std::sqrt(Real(src.width) * src.height) + 0.5), 2);
+    Level dst{ size, size, {} };
+    dst.texels.resize(size * size);
+
+    parallelFor(size,
+                [this, &src, &dst, size](const size_t y) {
+                  for (int x = 0; x < size; ++x) {
+                    Pixel p = Pixel::Zero();
+                    for (int i = 0; i < 4; ++i) {
+                      Vec3f vec = octahedralToDirection((x + 0.25 + (i & 1) * 0.5) / size,
+                                                        (y + 0.25 + (i >> 1) * 0.5) / size);
+                      Vec2f uv = directionToUv(vec);
+                      p += latLong(src, uv.x(), uv.y());
+                    }
+                    p /= 4.0;
+                    dst.texels[y * size + x] = packRgbe(p.x(), p.y(), p.z());
+                  }
+                });
+
+    return dst;
+  }
+
+  // 緯度経度のピクセルの境界を求めておく
+  // 行: θ = π * y / height
+  // 列: φ = 2π * (x / width - 0.25) (directionToUvの逆)
+  // TIPS:疑似角度は角度の半分より密にはならないので、区切りは境界の数と同じだけあれば足りる
+  void createBounds() {
+    // θは(cosθ, sinθ)の疑似角度[0, 2]
+    row_bounds_.bounds.resize(height_ - 1);
+    for (int y = 1; y < height_; ++y) {
+      Real theta = M_PI * y / height_;
+      row_bounds_.bounds[y - 1] = pseudoAngle(std::cos(theta), std::sin(theta));
+    }
+    row_bounds_.setup(2.0, height_);
+
+    // φ = 0から一周する間に越える列の境界を並べる
+    first_column_ = int(std::floor(width_ * 0.25));
+    column_bounds_.bounds.clear();
+    for (int x = first_column_ + 1; x < (first_column_ + 1 + width_); ++x) {
+      Real phi = 2.0 * M_PI * (Real(x) / width_ - 0.25);
+      if (phi >= (2.0 * M_PI)) break;
+      column_bounds_.bounds.push_back(pseudoAngle(std::cos(phi), std::sin(phi)));
+    }
+    column_bounds_.setup(4.0, width_);
+  }
+
+  // atan2(z, x)と同じ順に並ぶ[0, 4)の値
+  // SOURCE:https://stackoverflow.com/questions/16542042/fastest-way-to-sort-vectors-by-angle-without-actually-computing-that-angle
+  static Real pseudoAngle(const Real x, const Real z) {
+    if (z >= 0.0) {
+      return (x >= 0.0) ? z / (x + z) : 1.0 - x / (-x + z);
+    }
+    return (x < 0.0) ? 2.0 - z / (-x - z) : 3.0 + x / (x - z);
+  }
+
+
+  // ピクセルの輝度と緯度による面積の差から分布を生成
+  void createDistribution() {
+    marginal_cdf_.resize(height_ + 1);
+    conditional_cdf_.resize((width_ + 1) * height_);
+
+    // TIPS:行ごとの分布は独立しているので並列に求める
+    std::vector<Real> row_sums(height_);
+    parallelFor(height_,
+                [this, &row_sums](const size_t y) {
+                  // TIPS:緯度経度マップは極に近いほど1ピクセルの立体角が小さい
+                  Real sin_theta = std::sin((y + 0.5) / height_ * M_PI);
+
+                  float* cdf = &conditional_cdf_[y * (width_ + 1)];
+                  Real row_sum = 0.0;
+                  cdf[0] = 0.0f;
+                  for (int x = 0; x < width_; ++x) {
+                    row_sum += luminance(texel(levels_[0], x, int(y))) * sin_theta;
+                    cdf[x + 1] = row_sum;
+                  }
+                  normalizeCdf(cdf, width_);
+
+                  row_sums[y] = row_sum;
+                });
+
+    marginal_cdf_[0] = 0.0f;
+    for (int y = 0; y < height_; ++y) {
+      marginal_cdf_[y + 1] = marginal_cdf_[y] + row_sums[y];
+    }
+    // TIPS:1ピクセルの立体角は (2π / width) * (π / height) * sinθ
+    integral_ = marginal_cdf_[height_] * 2.0 * M_PI * M_PI / (width_ * height_);
+
+    normalizeCdf(&marginal_cdf_[0], height_);
+  }
+
+  // 累積分布を[0, 1]にする
+  // 合計が0の場合は一様分布にする
+  static void normalizeCdf(float* cdf, const int num) {
+    float total = cdf[num];
+    for (int i = 1; i <= num; ++i) {
+      cdf[i] = (total > 0.0f) ? cdf[i] / total : float(i) / num;
+    }
+    cdf[num] = 1.0f;
+  }
+
+  // 累積分布から要素を選ぶ
+  // offset 要素内の位置[0, 1)
+  static int sampleCdf(Real& offset, const float* cdf, const int num, const Real u) {
+    int index = int(std::upper_bound(cdf, cdf + num + 1, float(u)) - cdf) - 1;
+    index = minmax(index, 0, num - 1);
+
+    Real width = cdf[index + 1] - cdf[index];
+    offset = (width > 0.0) ? minmax((u - cdf[index]) / width, Real(0.0), Real(0.999999)) : 0.5;
+
+    return index;
+  }
 
-  Pixel pixel(const Real u, const Real v) const {
-    int x = int(width_ * u) % width_;
-    int y = int(height_ * v) % height_;
-    
-    return pixel_[y * width_ + x];
+  // テクスチャ座標あたりの確率密度
+  Real texelPdf(const int x, const int y) const {
+    const float* cdf = &conditional_cdf_[y * (width_ + 1)];
+    return (marginal_cdf_[y + 1] - marginal_cdf_[y]) * height_
+         * (cdf[x + 1] - cdf[x]) * width_;
   }
   
 };
@@ -0,0 +1,103 @@
+﻿
+#pragma once
+
+//
+// PNGの書き出しを別スレッドで行う
+// TIPS:圧縮に時間がかかるので、プレビューや描画を止めないようにする
+//      依頼は順番に書き出す
+//
+
+#include "defines.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <boost/noncopyable.hpp>
+#include "png.hpp"
+
+
+namespace {
+
+class ImageWriter : private boost::noncopyable {
+  struct Request {
+    std::string path;
+    int width;
+    int height;
+    std::vector<u_char> image;
+  };
+  std::deque<Request> requests_;
+  bool writing_;
+  bool quit_;
+
+  // zlibの圧縮レベル(0〜9、-1は既定値)
+  int compression_level_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+
+
+public:
+  explicit ImageWriter(const int compression_level) :
+    writing_(false),
+    quit_(false),
+    compression_level_(compression_level),
+    thread_(&ImageWriter::run, this)
+  {}
+
+  // 残っている依頼を書き出してから終了する
+  ~ImageWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+  }
+
+
+  // image 下から上に並んだRGB8(書き出すまで預かる)
+  void write(const std::string& path, const int width, const int height, std::vector<u_char>&& image) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_.push_back({ path, width, height, std::move(image) });
+    }
+    cond_.notify_all();
+  }
+
+  // 依頼を全て書き出すまで待つ
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return requests_.empty() && !writing_; });
+  }
+
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (1) {
+      cond_.wait(lock, [this]() { return quit_ || !requests_.empty(); });
+      if (requests_.empty()) break;
+
+      Request request = std::move(requests_.front());
+      requests_.pop_front();
+      writing_ = true;
+
+      lock.unlock();
+      DOUT << "write:" << request.path << std::endl;
+      WritePng(request.path,
+               request.width, request.height,
+               &request.image[0],
+               compression_level_);
+      lock.lock();
+
+      writing_ = false;
+      cond_.notify_all();
+    }
+  }
+
+};
+
+}
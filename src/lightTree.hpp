@@ -0,0 +1,239 @@
+﻿
+#pragma once
+
+//
+// 発光ポリゴンの階層構造(Light BVH)
+// SOURCE:Importance Sampling of Many Lights with Adaptive Tree Splitting
+//        by Alejandro Conty Estevez and Christopher Kulla
+//
+
+#include "defines.hpp"
+#include <vector>
+#include <algorithm>
+#include "utils.hpp"
+#include "collision.hpp"
+#include "model.hpp"
+#include "bvh.hpp"
+
+
+namespace LightTree {
+
+// 発光ポリゴン
+struct Emitter {
+  Triangle triangle;
+  Vec3f normal;                                     // 面法線(表面だけが光る)
+  Real  area;
+
+  Pixel radiance;
+  Real  power;                                      // 全放射量(輝度)
+
+  Bvh::BBox bbox;
+  Vec3f center;
+};
+
+
+struct LightNode {
+  Bvh::BBox bbox;
+
+  // 法線の向きの範囲(円錐)
+  Vec3f axis;
+  Real  theta_o;
+
+  Real power;
+
+  std::vector<LightNode> children;
+
+  Emitter emitter;                                  // 葉ノードのみ有効
+};
+
+
+// 2つの法線の円錐をまとめる
+void mergeCone(Vec3f& axis, Real& theta_o,
+               const Vec3f& axis_a, const Real theta_a,
+               const Vec3f& axis_b, const Real theta_b) {
+  // 広い方をaにする
+  if (theta_b > theta_a) {
+    mergeCone(axis, theta_o, axis_b, theta_b, axis_a, theta_a);
+    return;
+  }
+
+  Real theta_d = std::acos(minmax(axis_a.dot(axis_b), Real(-1.0), Real(1.0)));
+  if (std::min(theta_d + theta_b, Real(M_PI)) <= theta_a) {
+    // bはaに含まれる
+    axis    = axis_a;
+    theta_o = theta_a;
+    return;
+  }
+
+  theta_o = (theta_a + theta_d + theta_b) / 2;
+  if (theta_o >= M_PI) {
+    axis    = axis_a;
+    theta_o = M_PI;
+    return;
+  }
+
+  // aをbの方向へ回転
+  Vec3f rot_axis = axis_a.cross(axis_b);
+  if (rot_axis.squaredNorm() < FLT_EPSILON) {
+    axis    = axis_a;
+    theta_o = M_PI;
+    return;
+  }
+  axis = AngleAxis(theta_o - theta_a, rot_axis.normalized()) * axis_a;
+}
+
+
+LightNode construct(std::vector<Emitter>& emitters, const size_t begin, const size_t end) {
+  LightNode node;
+
+  if ((end - begin) == 1) {
+    const auto& e = emitters[begin];
+    node.bbox    = e.bbox;
+    node.axis    = e.normal;
+    node.theta_o = 0.0;
+    node.power   = e.power;
+    node.emitter = e;
+    return node;
+  }
+
+  // 中心座標の広がりが一番大きい軸で半分に分ける
+  auto centers = Bvh::emptyAABB();
+  for (size_t i = begin; i < end; ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      centers.inf(axis) = std::min(centers.inf(axis), emitters[i].center(axis));
+      centers.sup(axis) = std::max(centers.sup(axis), emitters[i].center(axis));
+    }
+  }
+  int split_axis;
+  (centers.sup - centers.inf).maxCoeff(&split_axis);
+
+  size_t middle = (begin + end) / 2;
+  std::nth_element(emitters.begin() + begin, emitters.begin() + middle, emitters.begin() + end,
+                   [split_axis](const Emitter& a, const Emitter& b) {
+                     return a.center(split_axis) < b.center(split_axis);
+                   });
+
+  node.children.resize(2);
+  node.children[0] = construct(emitters, begin, middle);
+  node.children[1] = construct(emitters, middle, end);
+
+  const auto& c0 = node.children[0];
+  const auto& c1 = node.children[1];
+  node.bbox  = Bvh::mergeAABB(c0.bbox, c1.bbox);
+  node.power = c0.power + c1.power;
+  mergeCone(node.axis, node.theta_o, c0.axis, c0.theta_o, c1.axis, c1.theta_o);
+
+  return node;
+}
+
+// Modelの発光ポリゴンから生成
+// 発光ポリゴンが無い場合、powerが0になる
+LightNode createFromModel(const Model& model) {
+  std::vector<Emitter> emitters;
+
+  const auto& material = model.material();
+  for (const auto& m : model.mesh()) {
+    const auto& mat = material[m->materialIndex()];
+    if (mat.emissive().isZero()) continue;
+
+    Pixel radiance = mat.emission();
+    for (u_int ip = 0; ip < m->faces(); ++ip) {
+      Triangle polygon = m->polygon(ip);
+      Emitter e;
+      e.triangle = polygon;
+
+      Vec3f n = (polygon.b - polygon.a).cross(polygon.c - polygon.a);
+      Real  l = n.norm();
+      if (l <= 0.0) continue;
+
+      e.normal   = n / l;
+      e.area     = l / 2;
+      e.radiance = radiance;
+      // TIPS:片面の拡散発光なので π * 面積
+      e.power    = luminance(radiance) * e.area * M_PI;
+
+      for (int i = 0; i < 3; ++i) {
+        e.bbox.inf(i) = std::min({ polygon.a(i), polygon.b(i), polygon.c(i) });
+        e.bbox.sup(i) = std::max({ polygon.a(i), polygon.b(i), polygon.c(i) });
+      }
+      e.center = (e.bbox.inf + e.bbox.sup) / 2;
+
+      emitters.push_back(e);
+    }
+  }
+
+  DOUT << "emitter:" << emitters.size() << std::endl;
+
+  if (emitters.empty()) {
+    LightNode node;
+    node.power = 0.0;
+    return node;
+  }
+
+  return construct(emitters, 0, emitters.size());
+}
+
+
+// 点pos(法線normal)から見たノードの重要度
+Real importance(const Vec3f& pos, const Vec3f& normal, const LightNode& node) {
+  Vec3f center = (node.bbox.inf + node.bbox.sup) / 2;
+  Real  radius = (node.bbox.sup - node.bbox.inf).norm() / 2;
+
+  Vec3f d = center - pos;
+  Real  distance2 = d.squaredNorm();
+  Real  distance  = std::sqrt(distance2);
+  if (distance <= 0.0) return node.power;
+  Vec3f dir = d / distance;
+
+  // AABBが張る角度
+  Real theta_u = (distance > radius) ? std::asin(radius / distance) : M_PI;
+
+  // 発光面から見た角度(拡散発光なので90度を超えると光が届かない)
+  Real theta = std::acos(minmax(node.axis.dot(-dir), Real(-1.0), Real(1.0)));
+  Real theta_light = std::max(theta - node.theta_o - theta_u, Real(0.0));
+  if (theta_light >= M_PI / 2) return 0.0;
+
+  // 受光面から見た角度
+  Real theta_i = std::acos(minmax(normal.dot(dir), Real(-1.0), Real(1.0)));
+  Real theta_surface = std::max(theta_i - theta_u, Real(0.0));
+  if (theta_surface >= M_PI / 2) return 0.0;
+
+  // TIPS:近すぎると値が発散するので、AABBの大きさで抑える
+  distance2 = std::max(distance2, radius * radius);
+
+  return node.power * std::cos(theta_light) * std::cos(theta_surface) / distance2;
+}
+
+// 重要度に従って発光ポリゴンを１つ選ぶ
+// pdf 選んだポリゴンの選択確率
+const Emitter* sample(Real& pdf,
+                      const Vec3f& pos, const Vec3f& normal,
+                      const LightNode& root, Real u) {
+  if (root.power <= 0.0) return nullptr;
+
+  pdf = 1.0;
+  const LightNode* node = &root;
+  while (!node->children.empty()) {
+    Real i0 = importance(pos, normal, node->children[0]);
+    Real i1 = importance(pos, normal, node->children[1]);
+    if ((i0 + i1) <= 0.0) return nullptr;
+
+    // 選んだ子供の範囲で乱数を再利用する
+    Real p0 = i0 / (i0 + i1);
+    if (u < p0) {
+      u /= p0;
+      pdf *= p0;
+      node = &node->children[0];
+    }
+    else {
+      u = (u - p0) / (1.0 - p0);
+      pdf *= 1.0 - p0;
+      node = &node->children[1];
+    }
+    u = std::min(u, Real(0.999999));
+  }
+
+  return &node->emitter;
+}
+
+}
@@ -0,0 +1,131 @@
+﻿
+#pragma once
+
+//
+// レンダリング中の積算結果を、ファイルに割り当てたメモリへ書き出す
+// 外部のビューアはファイルを読むだけで、いつでも途中経過を見られる
+// TIPS:書き込みはメモリへのコピーだけで、ファイルへの書き出しはOSに任せる
+//      レンダラは倍精度で積算するので、ここにはfloatに丸めた写しを持つ
+//      (画像1枚分 width * height * 16bytes が増えるが、ファイルに割り当てたメモリなのでOSが追い出せる)
+//
+// ファイルの中身(リトルエンディアン)
+//   Header
+//   float    accum[height][width][3]   積算したRGB(露出をかける前、下から上に並ぶ)
+//   uint32_t samples[height][width]    画素ごとの積算したサンプル数
+// 画素の値は accum / samples
+//
+// 読む側の手順(seqlock)
+//   1. generationを読む。奇数なら書き込み中なので読み直す
+//   2. 必要な範囲を写す
+//   3. generationを読み直し、1.と違っていれば最初からやり直す
+//
+
+#include "defines.hpp"
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+#include "color.hpp"
+#include "os.hpp"
+
+
+namespace {
+
+class LiveFramebuffer : private boost::noncopyable {
+public:
+  struct Header {
+    char     magic[8];                              // "SRTLIVE"
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t spp;                                   // 全画素で終わったサンプル数
+    uint64_t generation;                            // 書き換え中は奇数、書き終えたら偶数
+  };
+
+
+private:
+  enum { VERSION = 2 };
+
+  int width_;
+  int height_;
+  WritableMappedFile file_;
+
+  Header*   header_;
+  float*    accum_;
+  uint32_t* samples_;
+
+
+public:
+  LiveFramebuffer(const std::string& path, const int width, const int height) :
+    width_(width),
+    height_(height),
+    file_(path, sizeof(Header) + size_t(width) * height * (sizeof(float) * 3 + sizeof(uint32_t))),
+    header_(nullptr),
+    accum_(nullptr),
+    samples_(nullptr)
+  {
+    if (!file_.valid()) {
+      DOUT << "Can't map live framebuffer:" << path << std::endl;
+      return;
+    }
+
+    header_  = reinterpret_cast<Header*>(file_.data());
+    accum_   = reinterpret_cast<float*>(header_ + 1);
+    samples_ = reinterpret_cast<uint32_t*>(accum_ + size_t(width) * height * 3);
+
+    // TIPS:ファイルは作り直したばかりなので、中身は0
+    std::memcpy(header_->magic, "SRTLIVE", 8);
+    header_->version = VERSION;
+    header_->width   = width;
+    header_->height  = height;
+    header_->spp     = 0;
+    header_->generation = 0;
+
+    DOUT << "live framebuffer:" << path << std::endl;
+  }
+
+
+  bool valid() const { return header_ != nullptr; }
+
+  // 1行分の積算結果を書き込む
+  // samples この行の画素ごとのサンプル数
+  void writeRow(const int y, const Pixel* accum, const uint32_t samples) {
+    beginWrite();
+    float* dst = &accum_[size_t(y) * width_ * 3];
+    for (int x = 0; x < width_; ++x) {
+      *dst++ = float(accum[x].x());
+      *dst++ = float(accum[x].y());
+      *dst++ = float(accum[x].z());
+    }
+    std::fill(&samples_[size_t(y) * width_], &samples_[size_t(y + 1) * width_], samples);
+    endWrite();
+  }
+
+  // 全画素で終わったサンプル数
+  void setSpp(const uint32_t spp) {
+    beginWrite();
+    header_->spp = spp;
+    endWrite();
+  }
+
+
+private:
+  // 書き込みの前後で世代を進める(書き込み中は奇数)
+  // TIPS:書き込むのは描画スレッドだけなので、読んでから足して良い
+  void beginWrite() {
+    volatile uint64_t* generation = &header_->generation;
+    *generation = *generation + 1;
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void endWrite() {
+    std::atomic_thread_fence(std::memory_order_release);
+    volatile uint64_t* generation = &header_->generation;
+    *generation = *generation + 1;
+  }
+
+};
+
+}
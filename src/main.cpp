@@ -9,20 +9,144 @@
 #include <sstream>
 #include <iomanip>
 #include <deque>
+#include <map>
+#include <functional>
+#include <fstream>
+#include <stdexcept>
 #include "appEnv.hpp"
 #include "json.hpp"
 #include "sceneLoader.hpp"
+#include "sceneFile.hpp"
 #include "preview.hpp"
 #include "pathtrace.hpp"
 #include "os.hpp"
 #include "bvh.hpp"
 #include "hdri.hpp"
+#include "png.hpp"
+#include "floatImage.hpp"
+#include "imageWriter.hpp"
 
 
+// [x, y, z]を読み込む
+Vec3f readVec3(const picojson::value& value) {
+  const auto& array = value.get<picojson::array>();
+  return Vec3f(array[0].get<double>(), array[1].get<double>(), array[2].get<double>());
+}
+
+// 解析的な形状を読み込む
+// { "type": "sphere", "center": [x, y, z], "radius": r }
+// { "type": "disk",   "center": [x, y, z], "normal": [x, y, z], "radius": r }
+// { "type": "quad",   "corner": [x, y, z], "edge_u": [x, y, z], "edge_v": [x, y, z] }
+// 色は diffuse, reflective, transparent, ior で指定する(省略時は白い拡散面)
+// FIXME:発光は光源の選択で扱えないので指定できない
+void createShapes(Pathtrace::RenderInfo& info, const picojson::value& params) {
+  if (!params.contains("shapes")) return;
+
+  const auto& shapes = params.at("shapes").get<picojson::array>();
+  // TIPS:形状がマテリアルを参照するので、先に領域を確保しておく
+  info.shape_materials.reserve(shapes.size());
+  info.shapes.reserve(shapes.size());
+
+  for (const auto& s : shapes) {
+    auto color = [&s](const std::string& name, const Pixel& value) {
+      return s.contains(name) ? Pixel(readVec3(s.at(name))) : value;
+    };
+    info.shape_materials.emplace_back(color("diffuse", Pixel::Ones()),
+                                      color("reflective", Pixel::Zero()),
+                                      color("transparent", Pixel::Zero()),
+                                      s.contains("ior") ? s.at("ior").get<double>() : 1.0);
+    const auto& material = info.shape_materials.back();
+
+    const auto& type = s.at("type").get<std::string>();
+    if (type == "sphere") {
+      info.shapes.push_back(Shape::sphere(readVec3(s.at("center")), s.at("radius").get<double>(), material));
+    }
+    else if (type == "disk") {
+      info.shapes.push_back(Shape::disk(readVec3(s.at("center")), readVec3(s.at("normal")),
+                                        s.at("radius").get<double>(), material));
+    }
+    else if (type == "quad") {
+      info.shapes.push_back(Shape::quad(readVec3(s.at("corner")), readVec3(s.at("edge_u")), readVec3(s.at("edge_v")),
+                                        material));
+    }
+    else {
+      DOUT << "unknown shape:" << type << std::endl;
+    }
+  }
+}
+
+
+// シーン全体を囲うAABB
+Bvh::BBox sceneBBox(const Pathtrace::RenderInfo& info) {
+  Bvh::BBox bbox = Bvh::toBBox(info.bvh_node.bbox);
+  if (info.chunks) {
+    bbox = info.shapes.empty() ? info.chunks->bbox()
+                               : Bvh::mergeAABB(bbox, info.chunks->bbox());
+  }
+  return bbox;
+}
+
+// 学習や積算を行うサンプリングの準備
+// TIPS:シーンが変わった時は作り直す
+void setupSampling(Pathtrace::RenderInfo& info, const picojson::value& params, const Bvh::BBox& scene_bbox) {
+  // パスガイディング
+  if (params.contains("guiding")) {
+    const auto& guiding = params.at("guiding");
+    if (guiding.at("enable").get<bool>()) {
+      info.guiding = std::make_shared<SdTree>(scene_bbox,
+                                              guiding.at("bsdf_fraction").get<double>(),
+                                              guiding.at("spatial_threshold").get<double>(),
+                                              size_t(guiding.at("max_memory_mb").get<double>()) * 1024 * 1024);
+      info.guiding_passes = int(guiding.at("training_passes").get<double>());
+    }
+  }
+
+  // フォトンマップによるコースティクス
+  if (params.contains("caustics")) {
+    const auto& caustics = params.at("caustics");
+    SphereVolume target;
+    if (caustics.at("enable").get<bool>() && specularBounds(target, info.model, info.shapes)) {
+      info.photon_map = std::make_shared<PhotonMap>(int(caustics.at("photon_num").get<double>()),
+                                                    caustics.at("radius").get<double>(),
+                                                    caustics.at("alpha").get<double>(),
+                                                    info.light_tree,
+                                                    target);
+    }
+  }
+
+  // 二回目以降の拡散反射で使うキャッシュ
+  if (params.contains("radiance_cache")) {
+    const auto& cache = params.at("radiance_cache");
+    if (cache.at("enable").get<bool>()) {
+      info.radiance_cache = std::make_shared<RadianceCache>(cache.at("cell_size").get<double>(),
+                                                            int(cache.at("min_samples").get<double>()),
+                                                            int(cache.at("table_size").get<double>()));
+    }
+  }
+}
+
+
+// 分割読み込み
+bool useOutOfCore(const picojson::value& params) {
+  return params.contains("out_of_core") && params.at("out_of_core").at("enable").get<bool>();
+}
+
+std::string chunkDirectory(const picojson::value& params, const std::string& document_path) {
+  return document_path + params.at("out_of_core").at("directory").get<std::string>();
+}
+
+u_int chunkFaces(const picojson::value& params) {
+  return u_int(params.at("out_of_core").at("chunk_faces").get<double>());
+}
+
+
+// scene_path 変換元のシーン(書き出し済みのチャンクが使えるか調べる)
 std::shared_ptr<Pathtrace::RenderInfo> createRenderInfo(const picojson::value& params,
                                                         const std::string& document_path,
+                                                        const std::string& scene_path,
                                                         const int window_width, const int window_height,
-                                                        const Scene& scene) {
+                                                        const Scene& scene,
+                                                        Hdri&& bg) {
 
   // posToWorldで使うviewport
   std::vector<GLint> viewport{ 0, 0, window_width, window_height };
@@ -35,21 +159,534 @@ std::shared_ptr<Pathtrace::RenderInfo> createRenderInfo(const picojson::value& p
                                                       scene.lights,
                                                       scene.model,
 
-                                                      document_path + "res/" + params.at("environment").get<std::string>(),
+                                                      std::move(bg),
 
                                                       int(params.at("subpixel_num").get<double>()),
                                                       int(params.at("sample_num").get<double>()),
                                                       int(params.at("recursive_depth").get<double>()),
 
                                                       params.at("focal_distance").get<double>(),
-                                                      params.at("lens_radius").get<double>(),
-    
-                                                      params.at("exposure").get<double>());
+                                                      params.at("lens_radius").get<double>());
+
+  // 背景の参照方法
+  if (params.contains("environment_filter")) {
+    const auto& filter = params.at("environment_filter");
+    info->bg.setupFilter(filter.at("bilinear").get<bool>(), filter.at("mips").get<bool>());
+  }
+
+  if (params.contains("texture")) {
+    info->use_texture = params.at("texture").get<bool>();
+  }
+  if (params.contains("live_framebuffer") && params.at("live_framebuffer").at("enable").get<bool>()) {
+    std::string path = document_path + params.at("live_framebuffer").at("path").get<std::string>();
+    auto live = std::make_shared<LiveFramebuffer>(path, window_width, window_height);
+    if (live->valid()) info->live = live;
+  }
+  if (params.contains("ray_cone")) {
+    const auto& cone = params.at("ray_cone");
+    info->ray_cone       = cone.at("enable").get<bool>();
+    info->diffuse_spread = info->ray_cone ? cone.at("diffuse_spread").get<double>() : 0.0;
+  }
+
+  createShapes(*info, params);
+
+  // 交差判定の準備
+  // シーンをチャンクに分けて、必要な分だけ読み込むこともできる
+  bool quantize = params.contains("quantize_attributes") && params.at("quantize_attributes").get<bool>();
+  bool out_of_core = useOutOfCore(params);
+  if (scene.animation && (quantize || out_of_core)) {
+    // TIPS:フレームごとに頂点を書き換えるので使えない
+    DOUT << "animation: quantize_attributes and out_of_core are ignored." << std::endl;
+    quantize    = false;
+    out_of_core = false;
+  }
+  if (out_of_core) {
+    const auto& chunk = params.at("out_of_core");
+    std::string directory = chunkDirectory(params, document_path);
+    Os::createDirecrory(directory);
+    info->chunks = std::make_shared<ChunkedScene>(info->model.material(),
+                                                  size_t(chunk.at("memory_budget_mb").get<double>()) * 1024 * 1024,
+                                                  quantize);
+    if (!info->chunks->open(directory, scene_path, chunkFaces(params))) {
+      info->chunks->build(info->model, directory, scene_path, chunkFaces(params));
+    }
+
+    // チャンクに書き出したメッシュの頂点は捨てる
+    // TIPS:光源とコースティクスで使うメッシュだけ残す
+    const auto& material = info->model.material();
+    for (const auto& m : info->model.mesh()) {
+      if (!ChunkedScene::isResident(material[m->materialIndex()])) m->releaseGeometry();
+    }
+  }
+
+  // 法線とUVを圧縮する
+  // TIPS:チャンクは読み込む時に圧縮する
+  if (quantize && !out_of_core) {
+    for (const auto& m : info->model.mesh()) {
+      m->quantize();
+    }
+  }
+
+  info->bvh_node = out_of_core ? Bvh::createFromShapes(info->shapes)
+                                : Bvh::createFromModel(info->model, info->shapes);
+
+  setupSampling(*info, params, sceneBBox(*info));
 
   return info;
 }
 
 
+// 連番画像をレンダリングするか
+bool isAnimation(const picojson::value& params) {
+  return params.contains("animation") && params.at("animation").at("enable").get<bool>();
+}
+
+// テクスチャをページ単位で読み込む
+// ※シーンを読み込む前に呼ぶ
+void setupTextureCache(const picojson::value& params, const std::string& document_path) {
+  if (!params.contains("texture_cache") || !params.at("texture_cache").at("enable").get<bool>()) return;
+
+  const auto& cache = params.at("texture_cache");
+  std::string directory = document_path + cache.at("directory").get<std::string>();
+  Os::createDirecrory(directory);
+  TextureCache::instance().setup(directory, size_t(cache.at("memory_budget_mb").get<double>()) * 1024 * 1024);
+}
+
+// シーンの読み込み
+// アニメーションする時は、変換済みのシーンを使わない
+// 変換済みのシーンがあれば、Assimpを使わずにファイルをメモリに割り当てて読み込む
+// 書き出し済みのチャンクが使える時は、光源とコースティクスで使うメッシュだけ頂点を読み込む
+Scene loadScene(const picojson::value& params, const std::string& document_path, const std::string& path) {
+  if (isAnimation(params)) return SceneLoader::load(path, true);
+
+  Model::MeshFilter filter;
+  if (useOutOfCore(params)
+      && ChunkedScene::isLatest(chunkDirectory(params, document_path), path, chunkFaces(params))) {
+    filter = ChunkedScene::isResident;
+  }
+
+  bool use_binary = params.contains("binary_scene") && params.at("binary_scene").get<bool>();
+  if (!use_binary) return SceneLoader::load(path, false, filter);
+
+  std::string binary_path = replaceFilenameExt(path, "srts");
+  auto file = std::make_shared<MappedFile>(binary_path);
+  if (SceneFile::isLatest(*file, path)) {
+    return SceneFile::load(file, path, filter);
+  }
+  file.reset();
+
+  auto scene = SceneLoader::load(path);
+  if (!SceneFile::write(binary_path, scene, path)) {
+    DOUT << "Can't write scene:" << binary_path << std::endl;
+  }
+  return scene;
+}
+
+
+// PNGの圧縮レベル(0〜9、-1は既定値)
+int pngCompression(const picojson::value& params) {
+  return params.contains("png_compression") ? int(params.at("png_compression").get<double>())
+                                            : Z_DEFAULT_COMPRESSION;
+}
+
+// 表示用の変換(露出、トーンカーブ、sRGB、ディザ)
+PostProcess createPostProcess(const picojson::value& params) {
+  PostProcess post_process;
+  post_process.exposure = params.at("exposure").get<double>();
+  if (params.contains("post_process")) {
+    const auto& settings = params.at("post_process");
+    post_process.tone_curve = PostProcess::toneCurve(settings.at("tone_curve").get<std::string>());
+    post_process.srgb       = settings.at("srgb").get<bool>();
+    post_process.dither     = settings.at("dither").get<bool>();
+  }
+  return post_process;
+}
+
+// 露出をかける前の結果を"hdr_output"の形式で書き出す
+// base_path 拡張子を除いたパス
+bool hasHdrOutput(const picojson::value& params) {
+  return params.contains("hdr_output") && !params.at("hdr_output").get<picojson::array>().empty();
+}
+
+// 書き出しは1行ずつSharedImageから取り出して行う
+void writeHdrOutput(const picojson::value& params, const std::string& base_path,
+                    const SharedImage& image) {
+  if (!hasHdrOutput(params)) return;
+
+  for (const auto& format : params.at("hdr_output").get<picojson::array>()) {
+    WriteFloatImage(base_path + "." + format.get<std::string>(),
+                    image.width(), image.height(),
+                    [&image](const int y, float* row) { image.readRow(y, row); });
+  }
+}
+
+
+// 時刻(秒)の姿勢にメッシュとカメラを合わせる
+void applyFrame(const Model& model, Camera3D& camera, const Animation& animation, const Real time) {
+  auto world = animation.evaluate(time);
+  animation.apply(world, model);
+
+  Vec3f position;
+  Vec3f look_at;
+  Vec3f up;
+  animation.camera(position, look_at, up, world);
+  SceneLoader::setupCamera(camera, position, look_at, up);
+}
+
+// 読み込んだシーンをレンダリングできる状態にする
+void prepareScene(Scene& scene, const picojson::value& params) {
+  // アニメーションの最初のフレーム
+  if (scene.animation) {
+    const auto& settings = params.at("animation");
+    applyFrame(scene.model, scene.camera, *scene.animation,
+               settings.at("start_frame").get<double>() / settings.at("fps").get<double>());
+  }
+
+  // Cheetah3Dが書き出すColladaはIORを含んでいないので、強制的に設定
+  if (params.contains("ior_value")) {
+    auto& model = scene.model;
+    auto& materials = model.material();
+    Real ior_value = params.at("ior_value").get<double>();
+    for (auto& m : materials) {
+      m.ior(ior_value);
+    }
+  }
+}
+
+// 連番画像のレンダリング
+// シーンやテクスチャは読み込み直さず、フレームごとに頂点を動かしてBVHを作り直す
+// TIPS:BVHはAABBの計算し直し(refit)で済ませ、SAHのコストが
+//      構築時の rebuild_threshold 倍を超えたら構築し直す
+bool renderAnimation(std::shared_ptr<SharedImage> row_image,
+                     std::shared_ptr<Pathtrace::RenderInfo> info,
+                     std::shared_ptr<Animation> animation,
+                     const picojson::value& params,
+                     const std::string& save_path,
+                     std::shared_ptr<ImageWriter> writer) {
+  const auto& settings = params.at("animation");
+  int  start_frame       = int(settings.at("start_frame").get<double>());
+  int  end_frame         = int(settings.at("end_frame").get<double>());
+  Real fps               = settings.at("fps").get<double>();
+  Real rebuild_threshold = settings.at("rebuild_threshold").get<double>();
+
+  Real build_cost = Bvh::sahCost(info->bvh_node);
+  for (int frame = start_frame; frame <= end_frame; ++frame) {
+    // 最初のフレームはcreateRenderInfoの前に設定済み
+    if (frame != start_frame) {
+      applyFrame(info->model, info->camera, *animation, frame / fps);
+      info->camera(Vec2f{ info->size.x(), info->size.y() });
+
+      Bvh::refit(info->bvh_node);
+      Real cost = Bvh::sahCost(info->bvh_node);
+      if (cost > (build_cost * rebuild_threshold)) {
+        DOUT << "rebuild BVH:" << cost / build_cost << std::endl;
+        info->bvh_node = Bvh::createFromModel(info->model, info->shapes);
+        build_cost = Bvh::sahCost(info->bvh_node);
+      }
+
+      info->light_tree = LightTree::createFromModel(info->model);
+      setupSampling(*info, params, sceneBBox(*info));
+    }
+
+    auto frame_begin = std::chrono::steady_clock::now();
+    Pathtrace::render(row_image, info);
+    auto frame_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - frame_begin);
+
+    std::ostringstream path;
+    path << save_path << "/frame_" << std::setw(4) << std::setfill('0') << frame;
+    // TIPS:PNGの圧縮は次のフレームと並行して行う
+    writer->write(path.str() + ".png",
+                  info->size.x(), info->size.y(),
+                  row_image->snapshot());
+    writeHdrOutput(params, path.str(), *row_image);
+
+    std::cout << "Frame:" << frame << " (sec):" << frame_time.count() / 1000.0f << std::endl;
+  }
+
+  return true;
+}
+
+
+// 常駐してレンダリングの依頼を受け付ける
+// 読み込んだシーン(モデル、BVH、テクスチャ、HDRI)はパスごとに保持して、次の依頼で使い回す
+//
+// 依頼は1行のJson
+//   { "scene": "res/からのパス(省略時はparams.jsonのpath)",
+//     "params": { "sample_num": 4, "exposure": -2.0, ... },
+//     "camera": { "position": [x, y, z], "look_at": [x, y, z], "up": [x, y, z] },
+//     "output": "書き出すパス(.png, .hdr, .pfm 省略可)",
+//     "framebuffer": true }
+//   { "quit": true } で終了する
+// 返答は1行のJson
+// framebufferを指定した時は、続けて露出をかける前のRGB(float、下から上)を送る
+struct ServerScene {
+  std::shared_ptr<Pathtrace::RenderInfo> info;
+
+  // 依頼ごとにカメラを元に戻す
+  Camera3D camera;
+};
+
+std::shared_ptr<ServerScene> loadServerScene(const picojson::value& params,
+                                             const std::string& document_path,
+                                             const std::string& scene_name,
+                                             const int window_width, const int window_height) {
+  std::string bg_path = document_path + "res/" + params.at("environment").get<std::string>();
+  auto bg = std::async(std::launch::async,
+                       [bg_path]() {
+                         return Hdri(bg_path);
+                       });
+
+  std::string scene_path = document_path + "res/" + scene_name;
+  auto scene = loadScene(params, document_path, scene_path);
+  prepareScene(scene, params);
+
+  auto info = createRenderInfo(params,
+                               document_path,
+                               scene_path,
+                               window_width, window_height,
+                               scene,
+                               bg.get());
+  return std::make_shared<ServerScene>(ServerScene{ info, scene.camera });
+}
+
+bool reply(LocalServer& server, const picojson::object& response) {
+  std::string text = picojson::value(response).serialize() + "\n";
+  return server.write(text.data(), text.size());
+}
+
+bool replyError(LocalServer& server, const std::string& message) {
+  picojson::object response;
+  response["status"]  = picojson::value("error");
+  response["message"] = picojson::value(message);
+  return reply(server, response);
+}
+
+
+// 依頼の内容を調べる(問題が無ければ空文字列)
+// TIPS:picojsonは型が違うと例外を投げるので、値を読む前に調べておく
+std::string checkJob(const picojson::value& job) {
+  auto isVec3 = [](const picojson::value& v) {
+    if (!v.is<picojson::array>()) return false;
+    const auto& array = v.get<picojson::array>();
+    return (array.size() == 3)
+        && array[0].is<double>() && array[1].is<double>() && array[2].is<double>();
+  };
+
+  if (job.contains("scene") && !job.at("scene").is<std::string>()) return "scene must be a string";
+  if (job.contains("output") && !job.at("output").is<std::string>()) return "output must be a string";
+  if (job.contains("framebuffer") && !job.at("framebuffer").is<bool>()) return "framebuffer must be a boolean";
+  if (job.contains("quit") && !job.at("quit").is<bool>()) return "quit must be a boolean";
+
+  if (job.contains("params")) {
+    const auto& params = job.at("params");
+    if (!params.is<picojson::object>()) return "params must be an object";
+    for (const auto& p : params.get<picojson::object>()) {
+      if (!p.second.is<double>()) return "params." + p.first + " must be a number";
+    }
+  }
+
+  if (job.contains("camera")) {
+    const auto& camera = job.at("camera");
+    for (const auto* name : { "position", "look_at", "up" }) {
+      if (!camera.contains(name) || !isVec3(camera.at(name))) {
+        return std::string("camera.") + name + " must be [x, y, z]";
+      }
+    }
+  }
+
+  return std::string();
+}
+
+bool renderJob(LocalServer& server, ServerScene& scene, const picojson::value& job,
+               const picojson::value& params, const std::string& document_path) {
+  auto& info = *scene.info;
+
+  // 依頼に無い設定はparams.jsonの値を使う
+  auto value = [&job, &params](const std::string& name) {
+    return (job.contains("params") && job.at("params").contains(name)) ? job.at("params").at(name).get<double>()
+                                                                        : params.at(name).get<double>();
+  };
+  info.subpixel_num    = int(value("subpixel_num"));
+  info.sample_num      = int(value("sample_num"));
+  info.recursive_depth = int(value("recursive_depth"));
+  info.focal_distance  = value("focal_distance");
+  info.lens_radius     = value("lens_radius");
+
+  info.camera = scene.camera;
+  if (job.contains("camera")) {
+    const auto& camera = job.at("camera");
+    SceneLoader::setupCamera(info.camera,
+                             readVec3(camera.at("position")),
+                             readVec3(camera.at("look_at")),
+                             readVec3(camera.at("up")));
+  }
+  info.camera(Vec2f{ info.size.x(), info.size.y() });
+
+  // 前の依頼で学習した分布や縮めた半径は使わない
+  setupSampling(info, params, sceneBBox(info));
+
+  auto row_image = std::make_shared<SharedImage>(info.size.x(), info.size.y());
+  PostProcess post_process = createPostProcess(params);
+  post_process.exposure = value("exposure");
+  row_image->postProcess(post_process);
+
+  auto begin = std::chrono::steady_clock::now();
+  Pathtrace::render(row_image, scene.info);
+  auto end = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+
+  picojson::object response;
+  response["status"] = picojson::value("ok");
+  response["width"]  = picojson::value(double(info.size.x()));
+  response["height"] = picojson::value(double(info.size.y()));
+  response["time"]   = picojson::value(end.count() / 1000.0);
+
+  if (job.contains("output")) {
+    // .hdrと.pfmは露出をかける前の値を書き出す
+    std::string path = document_path + job.at("output").get<std::string>();
+    std::string ext  = getFilenameExt(path);
+    if ((ext == "hdr") || (ext == "pfm")) {
+      WriteFloatImage(path, info.size.x(), info.size.y(),
+                      [&row_image](const int y, float* row) { row_image->readRow(y, row); });
+    }
+    else {
+      auto image = row_image->snapshot();
+      WritePng(path,
+               info.size.x(), info.size.y(),
+               &image[0],
+               pngCompression(params));
+    }
+  }
+
+  bool send_framebuffer = job.contains("framebuffer") && job.at("framebuffer").get<bool>();
+  size_t row_bytes = info.size.x() * 3 * sizeof(float);
+  size_t bytes     = send_framebuffer ? row_bytes * info.size.y() : 0;
+  response["framebuffer"] = picojson::value(double(bytes));
+
+  std::cout << "Job time (sec):" << end.count() / 1000.0f << std::endl;
+
+  if (!reply(server, response)) return false;
+  if (!send_framebuffer) return true;
+
+  // 1行ずつSharedImageから取り出して送る
+  std::vector<float> row(info.size.x() * 3);
+  for (int y = 0; y < info.size.y(); ++y) {
+    row_image->readRow(y, &row[0]);
+    if (!server.write(&row[0], row_bytes)) return false;
+  }
+  return true;
+}
+
+// FIXME:ウインドウのイベントを処理しないので、OSによっては応答なしと表示される
+void runServer(const picojson::value& params, const std::string& document_path,
+               const int window_width, const int window_height) {
+  LocalServer server(params.at("server").at("name").get<std::string>());
+  if (!server.valid()) {
+    DOUT << "Can't open server." << std::endl;
+    return;
+  }
+
+  // QMC初期化
+  init_prime_numbers();
+
+  std::map<std::string, std::shared_ptr<ServerScene> > scenes;
+
+  bool quit = false;
+  while (!quit && server.accept()) {
+    DOUT << "server: connected" << std::endl;
+
+    std::string line;
+    while (server.readLine(line)) {
+      picojson::value job;
+      std::istringstream stream(line);
+      std::string error = picojson::parse(job, stream);
+      if (!error.empty() || !job.is<picojson::object>()) {
+        picojson::object response;
+        response["status"]  = picojson::value("error");
+        response["message"] = picojson::value(error.empty() ? std::string("not an object") : error);
+        if (!reply(server, response)) break;
+        continue;
+      }
+
+      std::string message = checkJob(job);
+      if (!message.empty()) {
+        if (!replyError(server, message)) break;
+        continue;
+      }
+
+      if (job.contains("quit") && job.at("quit").get<bool>()) {
+        quit = true;
+        break;
+      }
+
+      // TIPS:失敗した依頼は返事をするだけで、常駐しているシーンはそのまま使い続ける
+      std::string scene_name = job.contains("scene") ? job.at("scene").get<std::string>()
+                                                     : params.at("path").get<std::string>();
+      bool connected = true;
+      try {
+        auto& scene = scenes[scene_name];
+        if (!scene) {
+          if (!std::ifstream(document_path + "res/" + scene_name)) {
+            throw std::runtime_error("scene not found:" + scene_name);
+          }
+          scene = loadServerScene(params, document_path, scene_name, window_width, window_height);
+        }
+
+        connected = renderJob(server, *scene, job, params, document_path);
+      }
+      catch (const std::exception& e) {
+        connected = replyError(server, e.what());
+      }
+      catch (const char* e) {
+        connected = replyError(server, e);
+      }
+      catch (...) {
+        connected = replyError(server, "unknown error");
+      }
+      // 読み込みに失敗したシーンは次の依頼で読み込み直す
+      auto it = scenes.find(scene_name);
+      if ((it != scenes.end()) && !it->second) scenes.erase(it);
+      if (!connected) break;
+    }
+  }
+}
+
+
+// 基準画像との差を表示
+// 精度や設定を変えた時に、画像がどれだけ変わったかを調べる
+// TIPS:imageは下から上に並んでいる
+void compareImage(const std::string& path,
+                  const int window_width, const int window_height,
+                  const std::vector<u_char>& image) {
+  Png reference(path);
+  if ((reference.width() != window_width) || (reference.height() != window_height)) {
+    DOUT << "reference size mismatch:" << path << std::endl;
+    return;
+  }
+
+  int channel = (reference.type() == PNG_COLOR_TYPE_RGB) ? 3 : 4;
+  Real square = 0.0;
+  int max_diff = 0;
+  for (int y = 0; y < window_height; ++y) {
+    const u_char* src = reference.image() + y * window_width * channel;
+    const u_char* dst = &image[(window_height - y - 1) * window_width * 3];
+    for (int x = 0; x < window_width; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        int diff = int(src[x * channel + c]) - int(dst[x * 3 + c]);
+        square  += diff * diff;
+        max_diff = std::max(max_diff, std::abs(diff));
+      }
+    }
+  }
+
+  Real rmse = std::sqrt(square / (window_width * window_height * 3));
+  Real psnr = (rmse > 0.0) ? 20.0 * std::log10(255.0 / rmse) : std::numeric_limits<Real>::infinity();
+  std::cout << "Reference:" << path
+            << " RMSE:" << rmse
+            << " PSNR(dB):" << psnr
+            << " max:" << max_diff << std::endl;
+}
+
+
 int main() {
   // FIXME:最初にGLFWを初期化しないと、OSXでcurrent pathがアプリのリソースフォルダに
   //       なっていない
@@ -65,33 +702,51 @@ int main() {
   const int window_height = params.at("window_height").get<double>();
 
   // プレビュー環境作成
+  // TIPS:テクスチャの生成にOpenGLのコンテキストが必要
   AppEnv app_env{ window_width, window_height };
 
-  auto scene = SceneLoader::load(os.documentPath() + "res/" + params.at("path").get<std::string>());
+  setupTextureCache(params, os.documentPath());
 
-  // Cheetah3Dが書き出すColladaはIORを含んでいないので、強制的に設定
-  if (params.contains("ior_value")) {
-    auto& model = scene.model;
-    auto& materials = model.material();
-    Real ior_value = params.at("ior_value").get<double>();
-    for (auto& m : materials) {
-      m.ior(ior_value);
-    }
+  // 常駐して依頼を受け付ける
+  if (params.contains("server") && params.at("server").at("enable").get<bool>()) {
+    runServer(params, os.documentPath(), window_width, window_height);
+    return 0;
   }
 
+  // HDRIはシーンと並行して読み込む
+  std::string bg_path = os.documentPath() + "res/" + params.at("environment").get<std::string>();
+  auto bg = std::async(std::launch::async,
+                       [bg_path]() {
+                         return Hdri(bg_path);
+                       });
+
+  std::string scene_path = os.documentPath() + "res/" + params.at("path").get<std::string>();
+  auto scene = loadScene(params, os.documentPath(), scene_path);
+
+  // プレビュー用にOpenGLへ転送
+  scene.model.upload();
+
+  // TIPS:プレビューは変換前の頂点を階層構造で表示する
+  prepareScene(scene, params);
+
   // 書き出し先(フォルダ作成)
   std::string save_path{ os.documentPath() + "progress" };
   Os::createDirecrory(save_path);
 
   // レンダリング結果の格納先
-  auto row_image = std::make_shared<std::vector<u_char> >(window_height * window_width * 3);
-  std::fill(row_image->begin(), row_image->end(), 255);
+  auto row_image = std::make_shared<SharedImage>(window_width, window_height);
+  row_image->postProcess(createPostProcess(params));
+
+  // PNGは別スレッドで書き出す
+  auto writer = std::make_shared<ImageWriter>(pngCompression(params));
 
   // レンダリングに必要な情報を生成
   auto info = createRenderInfo(params,
                                os.documentPath(),
+                               scene_path,
                                window_width, window_height,
-                               scene);
+                               scene,
+                               bg.get());
 
   // QMC初期化
   init_prime_numbers();
@@ -108,8 +763,11 @@ int main() {
   const std::chrono::seconds wait_time(int(params.at("wait_time").get<double>()));
 
   // Raytraceスレッド開始
-  std::packaged_task<bool()> task(std::bind(Pathtrace::render,
-                                            row_image, info));
+  std::packaged_task<bool()> task(scene.animation ? std::function<bool()>(std::bind(renderAnimation,
+                                                                                    row_image, info, scene.animation,
+                                                                                    params, save_path, writer))
+                                                  : std::function<bool()>(std::bind(Pathtrace::render,
+                                                                                    row_image, info)));
 
   auto future = task.get_future();
   std::thread render_thread{ std::move(task) };
@@ -131,9 +789,11 @@ int main() {
       // 結果を空読み
       future.get();
 
-      WritePng(save_path + "/completion.png",
-               window_width, window_height,
-               &(*row_image)[0]);
+      auto image = row_image->snapshot();
+      writer->write(save_path + "/completion.png",
+                    window_width, window_height,
+                    std::vector<u_char>(image));
+      writeHdrOutput(params, save_path + "/completion", *row_image);
 
       // 所要時間を計算
       auto current = std::chrono::steady_clock::now();
@@ -141,19 +801,28 @@ int main() {
 
       std::cout << "Render time (sec):" << end.count() / 1000.0f << std::endl;
 
+      if (params.contains("reference_image")) {
+        const auto& reference = params.at("reference_image").get<std::string>();
+        if (!reference.empty()) {
+          compareImage(os.documentPath() + reference, window_width, window_height, image);
+        }
+      }
+
+      writer->flush();
       break;
     }
 
     {
       // 途中経過を出力
+      // TIPS:描画中の画像を写して、圧縮と書き出しは別スレッドで行う
       std::ostringstream path;
       path << save_path << "/" << std::setw(2) << std::setfill('0') << png_index << ".png";
 
       DOUT << "progress:" << path.str() << std::endl;
 
-      WritePng(path.str(),
-               window_width, window_height,
-               &(*row_image)[0]);
+      writer->write(path.str(),
+                    window_width, window_height,
+                    row_image->snapshot());
 
       png_index += 1;
     }
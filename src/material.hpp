@@ -9,6 +9,7 @@
 #include "texMng.hpp"
 #include "fileUtil.hpp"
 #include "color.hpp"
+#include "sceneFormat.hpp"
 
 
 namespace {
@@ -26,6 +27,7 @@ class Material {
 
   bool has_texture_;
   TexMng::TexPtr texture_;
+  std::string texture_name_;
 
   
 public:
@@ -114,13 +116,43 @@ public:
       aiString name;
       if (material.Get(AI_MATKEY_TEXTURE_DIFFUSE(0), name) == AI_SUCCESS) {
         // パスを除いた名前を生成
-        std::string texture_file = getFilename(std::string(name.C_Str()));
-        texture_ = tex_mng.read(path + "/" + texture_file);
-        has_texture_ = true;
+        readTexture(getFilename(std::string(name.C_Str())), tex_mng, path);
       }
     }
   }
+
+  // 変換済みのシーンから生成
+  Material(const SceneFormat::MaterialRecord& record, TexMng& tex_mng, const std::string& path) :
+    diffuse_(record.diffuse[0], record.diffuse[1], record.diffuse[2]),
+    specular_(record.specular[0], record.specular[1], record.specular[2]),
+    shininess_(record.shininess),
+    emissive_(record.emissive[0], record.emissive[1], record.emissive[2]),
+    reflective_(record.reflective[0], record.reflective[1], record.reflective[2]),
+    transparent_(record.transparent[0], record.transparent[1], record.transparent[2]),
+    ior_(record.ior),
+    has_texture_(false)
+  {
+    DOUT << "Material()" << std::endl;
+
+    if (record.texture[0]) {
+      readTexture(std::string(record.texture), tex_mng, path);
+    }
+  }
   
+  // 色だけ指定して生成(解析的な形状などで使う)
+  Material(const Pixel& diffuse, const Pixel& reflective, const Pixel& transparent, const Real ior) :
+    diffuse_(diffuse),
+    specular_(Pixel::Zero()),
+    shininess_(80.0),
+    emissive_(Pixel::Zero()),
+    reflective_(reflective),
+    transparent_(transparent),
+    ior_(ior),
+    has_texture_(false)
+  {
+    DOUT << "Material()" << std::endl;
+  }
+
   ~Material() {
     DOUT << "~Material()" << std::endl;
   }
@@ -131,7 +163,12 @@ public:
   Real shininess() const { return shininess_; }
   const Pixel& emissive() const { return emissive_; }
 
+  // レイトレで使う自己発光の強さ
+  // FIXME:emissiveはツールで0.0~1.0の範囲でしか設定できないので、ここで大きな値にする
+  Pixel emission() const { return emissive_ * 100; }
+
   bool hasTexture() const { return has_texture_; }
+  const std::string& textureName() const { return texture_name_; }
   const Texture& texture() const { return *texture_.get(); };
   void bindTexture() const { texture_->bind(); }
 
@@ -141,6 +178,14 @@ public:
   Real ior() const { return ior_; }
 
   void ior(const Real value) { ior_ = value; } 
+
+
+private:
+  void readTexture(const std::string& name, TexMng& tex_mng, const std::string& path) {
+    texture_      = tex_mng.read(path + "/" + name);
+    texture_name_ = name;
+    has_texture_  = true;
+  }
   
 };
 
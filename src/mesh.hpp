@@ -10,33 +10,29 @@
 #include "defines.hpp"
 #include <assimp/scene.h>
 #include <cfloat>
+#include <vector>
+#include <memory>
 #include <boost/noncopyable.hpp>
 #include "vector.hpp"
+#include "matrix.hpp"
 #include "glBuffer.hpp"
 #include "collision.hpp"
+#include "geometry.hpp"
 
 
 namespace {
 
 class Mesh : private boost::noncopyable {
 public:
-	struct Vtx {
-		GLfloat x, y, z;
-	};
-  
-	struct Uv {
-		GLfloat u, v;
-	};
+	using Vtx  = Geometry::Vtx;
+	using Uv   = Geometry::Uv;
+	using Face = Geometry::Face;
   
 	struct Body {
 		Vtx vertex;
 		Vtx normal;
 		Uv uv;
 	};
-  
-	struct Face {
-		GLuint v1, v2, v3;
-	};
 
   
 private:
@@ -52,12 +48,24 @@ private:
   GlBuffer body_;
   GlBuffer face_;
 
-  std::vector<Triangle> polygons_;
-  std::vector<Triangle> normals_;
-  std::vector<Triangle> uvs_;
+  // レイトレース用の頂点情報
+  // TIPS:変換済みのシーンを読み込んだ時は、ファイルを割り当てたメモリを直接参照する
+  Geometry geometry_;
 
   AABBVolume bbox_;
 
+  // Assimpから生成した頂点情報
+  struct Streams {
+    std::vector<Vtx>  positions;
+    std::vector<Vtx>  normals;
+    std::vector<Uv>   uvs;
+    std::vector<Face> faces;
+  };
+  // Assimpから生成した時だけ持つ(圧縮したら法線とUVは捨てる)
+  std::shared_ptr<Streams> streams_;
+  // 変形前の頂点と法線(アニメーションする時だけ持つ)
+  std::shared_ptr<Streams> rest_;
+
   
 public:
   explicit Mesh(const aiMesh& mesh) :
@@ -80,47 +88,33 @@ public:
 #endif
     
     // 頂点情報を生成
-    const auto* v  = mesh.mVertices;
-    const auto* n  = mesh.mNormals;
-    const auto* uv = mesh.mTextureCoords[0];
-
-    std::vector<Body> body;
-    body.reserve(mesh.mNumVertices);
+    auto streams = std::make_shared<Streams>();
     // TIPS:あらかじめvectorのサイズを予約し、push_backによるコピーを防ぐ
+    streams->positions.reserve(mesh.mNumVertices);
+    streams->normals.reserve(mesh.mNumVertices);
+    if (has_texture_) streams->uvs.reserve(mesh.mNumVertices);
 
     for (u_int i = 0; i < mesh.mNumVertices; ++i) {
-      Body obj;
-      obj.vertex.x = v->x;
-      obj.vertex.y = v->y;
-      obj.vertex.z = v->z;
+      const auto& v = mesh.mVertices[i];
+      streams->positions.push_back({ v.x, v.y, v.z });
+
       if (has_normal_) {
-        obj.normal.x = n->x;
-        obj.normal.y = n->y;
-        obj.normal.z = n->z;
+        const auto& n = mesh.mNormals[i];
+        streams->normals.push_back({ n.x, n.y, n.z });
       }
-      if (has_texture_) {
-        obj.uv.u = uv->x;
-        obj.uv.v = uv->y;
+      else {
+        streams->normals.push_back({ 0.0f, 0.0f, 0.0f });
       }
-      body.push_back(obj);
 
-      min_pos_.x() = std::min(min_pos_.x(), Real(v->x));
-      min_pos_.y() = std::min(min_pos_.y(), Real(v->y));
-      min_pos_.z() = std::min(min_pos_.z(), Real(v->z));
-
-      max_pos_.x() = std::max(max_pos_.x(), Real(v->x));
-      max_pos_.y() = std::max(max_pos_.y(), Real(v->y));
-      max_pos_.z() = std::max(max_pos_.z(), Real(v->z));
-      
-      ++v;
-      ++n;
-      ++uv;
+      if (has_texture_) {
+        const auto& uv = mesh.mTextureCoords[0][i];
+        streams->uvs.push_back({ uv.x, uv.y });
+      }
     }
 
     // 面情報を生成
     auto* f = mesh.mFaces;
-    std::vector<Face> face;
-    face.reserve(mesh.mNumFaces);
+    streams->faces.reserve(mesh.mNumFaces);
 
     for (u_int i = 0; i < mesh.mNumFaces; ++i) {
       // 三角ポリゴン以外はエラー
@@ -130,61 +124,138 @@ public:
       obj.v1 = f->mIndices[0];
       obj.v2 = f->mIndices[1];
       obj.v3 = f->mIndices[2];
-      face.push_back(obj);
+      streams->faces.push_back(obj);
 
       ++f;
     }
 
-    // OpenGLのFrame Buffer Objectを生成して、頂点データを転送する
-    body_.setData(GL_ARRAY_BUFFER, body);
-    face_.setData(GL_ELEMENT_ARRAY_BUFFER, face);
+    geometry_ = Geometry(has_texture_,
+                         mesh.mNumVertices,
+                         streams->positions.data(), streams->normals.data(), streams->uvs.data(),
+                         mesh.mNumFaces, streams->faces.data(),
+                         streams);
+    streams_ = streams;
 
+    setup();
+  }
 
-    // 三角形ポリゴンを生成
-    polygons_.reserve(mesh.mNumFaces);
-    normals_.reserve(mesh.mNumFaces);
-    if (has_texture_) uvs_.reserve(mesh.mNumFaces);
+  // 頂点配列から生成
+  // storage 頂点配列の実体(配列を参照している間は保持しておく)
+  Mesh(const u_int material_index,
+       const bool has_normal, const bool has_texture,
+       const u_int vertices,
+       const Vtx* positions, const Vtx* normals, const Uv* uvs,
+       const u_int faces, const Face* indices,
+       const std::shared_ptr<const void>& storage) :
+    has_normal_(has_normal),
+    has_texture_(has_texture),
+    faces_(faces),
+    points_(faces * 3),
+    material_index_(material_index),
+    min_pos_(FLT_MAX, FLT_MAX, FLT_MAX),
+    max_pos_(-FLT_MAX, -FLT_MAX, -FLT_MAX),
+    geometry_(has_texture, vertices, positions, normals, uvs, faces, indices, storage)
+  {
+    DOUT << "Mesh()" << std::endl;
+    setup();
+  }
 
-    for (u_int i = 0; i < mesh.mNumFaces; ++i) {
-      const auto& v1 = body[face[i].v1];
-      const auto& v2 = body[face[i].v2];
-      const auto& v3 = body[face[i].v3];
-
-      // Triangle polygon = makeTriangle(Vec3f(v1.vertex.x, v1.vertex.y, v1.vertex.z),
-      //                                 Vec3f(v2.vertex.x, v2.vertex.y, v2.vertex.z),
-      //                                 Vec3f(v3.vertex.x, v3.vertex.y, v3.vertex.z));
-      
-      Triangle polygon{
-        { v1.vertex.x, v1.vertex.y, v1.vertex.z },
-        { v2.vertex.x, v2.vertex.y, v2.vertex.z },
-        { v3.vertex.x, v3.vertex.y, v3.vertex.z },
-      };
-
-      Triangle normal{
-        { v1.normal.x, v1.normal.y, v1.normal.z },
-        { v2.normal.x, v2.normal.y, v2.normal.z },
-        { v3.normal.x, v3.normal.y, v3.normal.z },
-      };
-      
-      polygons_.push_back(polygon);
-      normals_.push_back(normal);
+  // 頂点を持たないメッシュ(分割読み込みで、頂点をチャンクから読む時)
+  explicit Mesh(const u_int material_index) :
+    has_normal_(false),
+    has_texture_(false),
+    faces_(0),
+    points_(0),
+    material_index_(material_index),
+    min_pos_(FLT_MAX, FLT_MAX, FLT_MAX),
+    max_pos_(-FLT_MAX, -FLT_MAX, -FLT_MAX)
+  {
+    setup();
+  }
 
-      if (has_texture_) {
-        Triangle uv{
-          { v1.uv.u, v1.uv.v, 0.0 },
-          { v2.uv.u, v2.uv.v, 0.0 },
-          { v3.uv.u, v3.uv.v, 0.0 },
-        };
-        uvs_.push_back(uv);
-      }
+  ~Mesh() {
+    DOUT << "~Mesh()" << std::endl;
+  }
+
+
+  // OpenGLのFrame Buffer Objectを生成して、頂点データを転送する
+  // ※OpenGLのコンテキストがあるスレッドで呼ぶ
+  void upload() {
+    const u_int vertices = geometry_.vertices();
+    if (!vertices) return;
+
+    const auto* positions = geometry_.positions();
+    const auto* normals   = geometry_.normals();
+    const auto* uvs       = geometry_.uvs();
+
+    std::vector<Body> body;
+    body.reserve(vertices);
+    for (u_int i = 0; i < vertices; ++i) {
+      Body obj;
+      obj.vertex = positions[i];
+      obj.normal = normals[i];
+      obj.uv     = has_texture_ ? uvs[i] : Uv{ 0.0f, 0.0f };
+      body.push_back(obj);
     }
 
-    bbox_.point  = (max_pos_ + min_pos_) / 2;
-    bbox_.radius = (max_pos_ - min_pos_) / 2;
+    body_.setData(GL_ARRAY_BUFFER, body);
+    face_.setData(GL_ELEMENT_ARRAY_BUFFER, geometry_.indices(), faces_);
   }
 
-  ~Mesh() {
-    DOUT << "~Mesh()" << std::endl;
+
+  // レイトレース用の法線とUVを圧縮する
+  // ※法線とUVの配列を使う処理(OpenGLへの転送、ファイルへの書き出し)より後に呼ぶ
+  // TIPS:変換済みのシーンは、元の配列を参照しなければメモリに読み込まれない
+  void quantize() {
+    geometry_ = geometry_.quantized();
+    if (streams_) {
+      std::vector<Vtx>().swap(streams_->normals);
+      std::vector<Uv>().swap(streams_->uvs);
+    }
+  }
+
+
+  // レイトレース用の頂点情報を捨てる(チャンクに書き出した後)
+  // TIPS:OpenGLへ転送済みの頂点はそのまま描画できるよう、points_は残す
+  void releaseGeometry() {
+    geometry_ = Geometry();
+    streams_.reset();
+    rest_.reset();
+    faces_ = 0;
+  }
+
+
+  // 頂点と法線を変形する
+  // TIPS:変形前の値から毎回計算する
+  //      配列の中身だけを書き換えるので、BVHが参照しているGeometryはそのまま使える
+  // FIXME:Assimpから生成して、圧縮していないメッシュのみ
+  void transform(const Affinef& matrix) {
+    if (!streams_ || geometry_.isQuantized()) {
+      DOUT << "Can't transform mesh." << std::endl;
+      return;
+    }
+    if (!rest_) {
+      rest_ = std::make_shared<Streams>();
+      rest_->positions = streams_->positions;
+      rest_->normals   = streams_->normals;
+    }
+
+    Eigen::Matrix<Real, 3, 3> normal_matrix = matrix.linear().inverse().transpose();
+    for (size_t i = 0; i < rest_->positions.size(); ++i) {
+      const auto& v = rest_->positions[i];
+      Vec3f p = matrix * Vec3f(v.x, v.y, v.z);
+      streams_->positions[i] = { float(p.x()), float(p.y()), float(p.z()) };
+
+      const auto& n = rest_->normals[i];
+      Vec3f tn = normal_matrix * Vec3f(n.x, n.y, n.z);
+      Real l = tn.norm();
+      if (l > 0.0) tn /= l;
+      streams_->normals[i] = { float(tn.x()), float(tn.y()), float(tn.z()) };
+    }
+
+    min_pos_ = Vec3f(FLT_MAX, FLT_MAX, FLT_MAX);
+    max_pos_ = Vec3f(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    setup();
   }
 
 
@@ -192,6 +263,10 @@ public:
 
 	GLuint points() const { return points_; }
   u_int faces() const { return faces_; }
+  u_int vertices() const { return geometry_.vertices(); }
+
+  bool hasNormal() const { return has_normal_; }
+  bool hasTexture() const { return has_texture_; }
 
   const Vec3f& minPos() const { return min_pos_; }
   const Vec3f& maxPos() const { return max_pos_; }
@@ -213,12 +288,43 @@ public:
     face_.unbind();
   }
 
-  const std::vector<Triangle>& polygons() const { return polygons_; }
-  const std::vector<Triangle>& normals() const { return normals_; }
-  const std::vector<Triangle>& uvs() const { return uvs_; }
+  const Geometry& geometry() const { return geometry_; }
+
+  // 面の頂点座標
+  Triangle polygon(const u_int face) const { return geometry_.polygon(face); }
+
+  // 頂点配列
+  const Vtx*  positions() const { return geometry_.positions(); }
+  const Vtx*  normals() const { return geometry_.normals(); }
+  const Uv*   uvs() const { return geometry_.uvs(); }
+  const Face* indices() const { return geometry_.indices(); }
+
+  // レイトレース用に保持しているメモリ量
+  size_t memory() const { return geometry_.memory(); }
 
   const AABBVolume& bbox() const { return bbox_; }
-  
+
+
+private:
+  // AABBを生成
+  // TIPS:OpenGLを使わないので、どのスレッドからでも生成できる
+  void setup() {
+    const auto* positions = geometry_.positions();
+    for (u_int i = 0; i < geometry_.vertices(); ++i) {
+      const auto& v = positions[i];
+      min_pos_.x() = std::min(min_pos_.x(), Real(v.x));
+      min_pos_.y() = std::min(min_pos_.y(), Real(v.y));
+      min_pos_.z() = std::min(min_pos_.z(), Real(v.z));
+
+      max_pos_.x() = std::max(max_pos_.x(), Real(v.x));
+      max_pos_.y() = std::max(max_pos_.y(), Real(v.y));
+      max_pos_.z() = std::max(max_pos_.z(), Real(v.z));
+    }
+
+    bbox_.point  = (max_pos_ + min_pos_) / 2;
+    bbox_.radius = (max_pos_ - min_pos_) / 2;
+  }
+
 };
 
 }
@@ -9,6 +9,7 @@
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <functional>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -17,6 +18,8 @@
 #include "mesh.hpp"
 #include "material.hpp"
 #include "node.hpp"
+#include "sceneFormat.hpp"
+#include "parallel.hpp"
 
 
 // リンクするライブラリの定義(Windows)
@@ -34,6 +37,13 @@
 namespace {
 
 class Model {
+public:
+  // 頂点を読み込むメッシュをマテリアルで選ぶ(nullptrなら全て)
+  // TIPS:選ばれなかったメッシュは頂点を持たない
+  using MeshFilter = std::function<bool (const Material&)>;
+
+
+private:
   TexMng textures_;
 
   std::vector<std::shared_ptr<Mesh> > meshes_;
@@ -66,15 +76,18 @@ public:
     Model::Model(scene, path);
   }
 
-  Model(const aiScene* scene, const std::string& path) {
+  Model(const aiScene* scene, const std::string& path, const MeshFilter& filter = nullptr) {
     DOUT << "Model()" << std::endl;
 
-    // メッシュ生成
-    for (u_int i = 0; i < scene->mNumMeshes; ++i) {
-      const auto& scene_mesh = *(scene->mMeshes[i]);
-      // TIPS:コンテナ内に直接Meshを生成する
-      meshes_.emplace_back(std::make_shared<Mesh>(scene_mesh));
+    // テクスチャを並列に読み込んでおく
+    std::vector<std::string> texture_names;
+    for (u_int i = 0; i < scene->mNumMaterials; ++i) {
+      aiString name;
+      if (scene->mMaterials[i]->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), name) == AI_SUCCESS) {
+        texture_names.push_back(getFilename(std::string(name.C_Str())));
+      }
     }
+    readTextures(texture_names, getDirectoryname(path));
 
     // マテリアル
     for (u_int i = 0; i < scene->mNumMaterials; ++i) {
@@ -82,15 +95,85 @@ public:
       material_.emplace_back(scene_material, textures_, getDirectoryname(path));
     }
 
+    // メッシュ生成
+    // TIPS:OpenGLへの転送はupload()で行うので、並列に生成できる
+    meshes_.resize(scene->mNumMeshes);
+    parallelFor(scene->mNumMeshes,
+                [this, scene, &filter](const size_t i) {
+                  const auto& m = *(scene->mMeshes[i]);
+                  meshes_[i] = (!filter || filter(material_[m.mMaterialIndex])) ? std::make_shared<Mesh>(m)
+                                                                                 : std::make_shared<Mesh>(m.mMaterialIndex);
+                });
+
     // 階層構造を生成
     root_node_.setup(scene->mRootNode);
   }
 
+  // 変換済みのシーンから生成
+  // data    ファイルを割り当てたメモリ
+  // storage メモリの実体(Meshが頂点配列を参照している間保持される)
+  // TIPS:選ばれなかったメッシュの頂点配列には触れないので、メモリに読み込まれない
+  Model(const u_char* data, const std::shared_ptr<const void>& storage, const std::string& path,
+        const MeshFilter& filter = nullptr) {
+    DOUT << "Model()" << std::endl;
+
+    const auto& header = *SceneFormat::pointer<SceneFormat::Header>(data, 0);
+
+    // テクスチャを並列に読み込んでおく
+    const auto* material = SceneFormat::pointer<SceneFormat::MaterialRecord>(data, header.materials);
+    std::vector<std::string> texture_names;
+    for (u_int i = 0; i < header.material_num; ++i) {
+      if (material[i].texture[0]) texture_names.push_back(std::string(material[i].texture));
+    }
+    readTextures(texture_names, getDirectoryname(path));
+
+    // マテリアル
+    for (u_int i = 0; i < header.material_num; ++i) {
+      material_.emplace_back(material[i], textures_, getDirectoryname(path));
+    }
+
+    // メッシュ生成
+    // TIPS:頂点配列はコピーせず、ファイルを割り当てたメモリを直接参照する
+    const auto* mesh = SceneFormat::pointer<SceneFormat::MeshRecord>(data, header.meshes);
+    meshes_.resize(header.mesh_num);
+    parallelFor(header.mesh_num,
+                [this, mesh, data, &storage, &filter](const size_t i) {
+                  const auto& m = mesh[i];
+                  if (filter && !filter(material_[m.material_index])) {
+                    meshes_[i] = std::make_shared<Mesh>(m.material_index);
+                    return;
+                  }
+                  meshes_[i] = std::make_shared<Mesh>(m.material_index,
+                                                      m.has_normal != 0, m.has_texture != 0,
+                                                      m.vertex_num,
+                                                      SceneFormat::pointer<Mesh::Vtx>(data, m.positions),
+                                                      SceneFormat::pointer<Mesh::Vtx>(data, m.normals),
+                                                      SceneFormat::pointer<Mesh::Uv>(data, m.uvs),
+                                                      m.face_num,
+                                                      SceneFormat::pointer<Mesh::Face>(data, m.faces),
+                                                      storage);
+                });
+
+    // 階層構造を生成
+    root_node_.setup(SceneFormat::pointer<SceneFormat::NodeRecord>(data, header.nodes),
+                     SceneFormat::pointer<u_int>(data, header.node_meshes));
+  }
+
   ~Model() {
     DOUT << "~Model()" << std::endl;
   }
 
 
+  // メッシュとテクスチャをOpenGLへ転送する
+  // ※OpenGLのコンテキストがあるスレッドで呼ぶ
+  void upload() {
+    for (auto& mesh : meshes_) {
+      mesh->upload();
+    }
+    textures_.upload();
+  }
+
+
   const std::vector<std::shared_ptr<Mesh> >& mesh() const { return meshes_; }
   const std::vector<Material>& material() const {return material_; }
 
@@ -102,7 +185,14 @@ public:
 
 
 private:
-
+  // テクスチャを並列に読み込む
+  // TIPS:TexMngに格納されるので、Materialの生成時には読み込み済み
+  void readTextures(const std::vector<std::string>& names, const std::string& directory) {
+    parallelFor(names.size(),
+                [this, &names, &directory](const size_t i) {
+                  textures_.read(directory + "/" + names[i]);
+                });
+  }
   
 };
 
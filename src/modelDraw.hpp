@@ -39,6 +39,9 @@ void setupMaterial(const Material& material) {
 
 // メッシュの描画
 void meshDraw(const Mesh& mesh, const bool use_texture) {
+  // 頂点を読み込んでいないメッシュ(分割読み込み)は描かない
+  if (!mesh.points()) return;
+
   mesh.bindArrayBuffer();
   mesh.bindElementBuffer();
 
@@ -13,6 +13,7 @@
 #include <assimp/scene.h>
 #include "vector.hpp"
 #include "matrix.hpp"
+#include "sceneFormat.hpp"
 
 
 namespace {
@@ -43,6 +44,13 @@ public:
     create(node);
   }
 
+  // 変換済みのシーンから生成
+  // node, mesh_indexes 読み込んだ分だけ進める
+  Node(const SceneFormat::NodeRecord*& node, const u_int*& mesh_indexes) {
+    DOUT << "Node()" << std::endl;
+    create(node, mesh_indexes);
+  }
+
   ~Node() {
     DOUT << "~Node()" << std::endl;
   }
@@ -54,6 +62,12 @@ public:
     create(node);
   }
 
+  void setup(const SceneFormat::NodeRecord* node, const u_int* mesh_indexes) {
+    child_nodes_.clear();
+    mesh_indexes_.clear();
+    create(node, mesh_indexes);
+  }
+
   const std::string& name() const { return name_; }
   
   const Affinef& matrix() const { return matrix_; }
@@ -101,6 +115,25 @@ private:
       // TIPS:vector内に直接Nodeを生成
     }
   }
+
+  void create(const SceneFormat::NodeRecord*& node, const u_int*& mesh_indexes) {
+    const auto& record = *node;
+    ++node;
+
+    for (u_int i = 0; i < 16; ++i) {
+      matrix_.data()[i] = record.matrix[i];
+    }
+
+    for (u_int i = 0; i < record.mesh_num; ++i) {
+      mesh_indexes_.push_back(*mesh_indexes);
+      ++mesh_indexes;
+    }
+
+    child_nodes_.reserve(record.child_num);
+    for (u_int i = 0; i < record.child_num; ++i) {
+      child_nodes_.emplace_back(node, mesh_indexes);
+    }
+  }
   
 };
 
@@ -13,6 +13,15 @@
 #include <string>
 #include <boost/noncopyable.hpp>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <cerrno>
+#include <cstring>
+#include <vector>
 
 
 namespace {
@@ -44,6 +53,28 @@ public:
     mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
   }
 
+  // ディレクトリにあるファイル名の一覧
+  static std::vector<std::string> listFiles(const std::string& path) {
+    std::vector<std::string> names;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return names;
+
+    while (const dirent* entry = readdir(dir)) {
+      if (entry->d_type == DT_REG) names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    return names;
+  }
+
+  static int processId() {
+    return int(getpid());
+  }
+
+  // TIPS:権限が無くてシグナルを送れない時も、プロセスは存在する
+  static bool isProcessAlive(const int id) {
+    return (kill(pid_t(id), 0) == 0) || (errno == EPERM);
+  }
+
 
 private:
 #ifdef DEBUG
@@ -67,6 +98,181 @@ private:
 #endif
 };
 
+
+// ファイルをメモリに割り当てる(読み込み専用)
+class MappedFile : private boost::noncopyable {
+  void*  data_;
+  size_t size_;
+
+
+public:
+  explicit MappedFile(const std::string& path) :
+    data_(nullptr),
+    size_(0)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat info;
+    if ((fstat(fd, &info) == 0) && (info.st_size > 0)) {
+      void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = data;
+        size_ = info.st_size;
+      }
+    }
+    // TIPS:割り当て後はファイルを閉じても良い
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_) munmap(data_, size_);
+  }
+
+
+  bool valid() const { return data_ != nullptr; }
+
+  const u_char* data() const { return static_cast<const u_char*>(data_); }
+  size_t size() const { return size_; }
+  
+};
+
+
+// 書き込み用に割り当てたファイル
+// TIPS:他のプロセスからも同じ内容が見える。ファイルは作り直してsizeにする
+class WritableMappedFile : private boost::noncopyable {
+  void*  data_;
+  size_t size_;
+
+
+public:
+  WritableMappedFile(const std::string& path, const size_t size) :
+    data_(nullptr),
+    size_(0)
+  {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+
+    if (ftruncate(fd, off_t(size)) == 0) {
+      void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = data;
+        size_ = size;
+      }
+    }
+    close(fd);
+  }
+
+  ~WritableMappedFile() {
+    if (data_) munmap(data_, size_);
+  }
+
+
+  bool valid() const { return data_ != nullptr; }
+
+  u_char* data() const { return static_cast<u_char*>(data_); }
+  size_t size() const { return size_; }
+
+};
+
+
+// ローカルの接続を一つずつ受け付ける(UNIXドメインソケット)
+// name ソケットの名前(/tmp/name.sockに作る)
+class LocalServer : private boost::noncopyable {
+  std::string path_;
+  int listen_fd_;
+  int client_fd_;
+
+  std::string buffer_;
+
+
+public:
+  explicit LocalServer(const std::string& name) :
+    path_("/tmp/" + name + ".sock"),
+    listen_fd_(-1),
+    client_fd_(-1)
+  {
+    sockaddr_un address;
+    if (path_.size() >= sizeof(address.sun_path)) return;
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) return;
+
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path_.c_str());
+
+    // 前回のソケットが残っていたら消す
+    unlink(path_.c_str());
+    if ((bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+        || (listen(listen_fd_, 1) < 0)) {
+      close(listen_fd_);
+      listen_fd_ = -1;
+    }
+  }
+
+  ~LocalServer() {
+    disconnect();
+    if (listen_fd_ >= 0) {
+      close(listen_fd_);
+      unlink(path_.c_str());
+    }
+  }
+
+
+  bool valid() const { return listen_fd_ >= 0; }
+
+  // 次の接続を待つ
+  bool accept() {
+    disconnect();
+    client_fd_ = ::accept(listen_fd_, nullptr, nullptr);
+    if (client_fd_ < 0) return false;
+
+#ifdef SO_NOSIGPIPE
+    // TIPS:相手が切断した後に書き込んでも、SIGPIPEで終了しないようにする
+    int on = 1;
+    setsockopt(client_fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return true;
+  }
+
+  void disconnect() {
+    if (client_fd_ >= 0) close(client_fd_);
+    client_fd_ = -1;
+    buffer_.clear();
+  }
+
+  // 改行までを読み込む(改行は含まない)
+  bool readLine(std::string& line) {
+    while (1) {
+      auto pos = buffer_.find('\n');
+      if (pos != std::string::npos) {
+        line = buffer_.substr(0, pos);
+        buffer_.erase(0, pos + 1);
+        return true;
+      }
+
+      char data[4096];
+      ssize_t size = read(client_fd_, data, sizeof(data));
+      if (size <= 0) return false;
+      buffer_.append(data, size_t(size));
+    }
+  }
+
+  bool write(const void* data, const size_t size) {
+    const char* p = static_cast<const char*>(data);
+    size_t rest = size;
+    while (rest > 0) {
+      ssize_t written = ::write(client_fd_, p, rest);
+      if (written <= 0) return false;
+      p    += written;
+      rest -= size_t(written);
+    }
+    return true;
+  }
+
+};
+
 }
 
 #endif
@@ -13,6 +13,8 @@
 #include <string>
 #include <streambuf>
 #include <vector>
+#include <algorithm>
+#include <cstdint>
 #include <boost/noncopyable.hpp>
 #include <direct.h>
 
@@ -78,9 +80,203 @@ public:
   static void createDirecrory(const std::string& path) {
     _mkdir(path.c_str());
   }
+
+  // ディレクトリにあるファイル名の一覧
+  static std::vector<std::string> listFiles(const std::string& path) {
+    std::vector<std::string> names;
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((path + "/*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) return names;
+
+    do {
+      if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) names.push_back(data.cFileName);
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+    return names;
+  }
+
+  static int processId() {
+    return int(GetCurrentProcessId());
+  }
+
+  static bool isProcessAlive(const int id) {
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, DWORD(id));
+    if (!process) return GetLastError() == ERROR_ACCESS_DENIED;
+
+    bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+  }
   
 };
 
+
+// ファイルをメモリに割り当てる(読み込み専用)
+class MappedFile : private boost::noncopyable {
+  HANDLE file_;
+  HANDLE mapping_;
+  const void* data_;
+  size_t size_;
+
+
+public:
+  explicit MappedFile(const std::string& path) :
+    file_(INVALID_HANDLE_VALUE),
+    mapping_(NULL),
+    data_(nullptr),
+    size_(0)
+  {
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || (size.QuadPart == 0)) return;
+
+    mapping_ = CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping_) return;
+
+    data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (data_) size_ = size_t(size.QuadPart);
+  }
+
+  ~MappedFile() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+  }
+
+
+  bool valid() const { return data_ != nullptr; }
+
+  const u_char* data() const { return static_cast<const u_char*>(data_); }
+  size_t size() const { return size_; }
+
+};
+
+
+// 書き込み用に割り当てたファイル
+// TIPS:他のプロセスからも同じ内容が見える。ファイルは作り直してsizeにする
+class WritableMappedFile : private boost::noncopyable {
+  HANDLE file_;
+  HANDLE mapping_;
+  void* data_;
+  size_t size_;
+
+
+public:
+  WritableMappedFile(const std::string& path, const size_t size) :
+    file_(INVALID_HANDLE_VALUE),
+    mapping_(NULL),
+    data_(nullptr),
+    size_(0)
+  {
+    file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) return;
+
+    // TIPS:割り当てる大きさでファイルも広がる
+    mapping_ = CreateFileMapping(file_, NULL, PAGE_READWRITE,
+                                 DWORD(uint64_t(size) >> 32), DWORD(size & 0xffffffff), NULL);
+    if (!mapping_) return;
+
+    data_ = MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, size);
+    if (data_) size_ = size;
+  }
+
+  ~WritableMappedFile() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+  }
+
+
+  bool valid() const { return data_ != nullptr; }
+
+  u_char* data() const { return static_cast<u_char*>(data_); }
+  size_t size() const { return size_; }
+
+};
+
+
+// ローカルの接続を一つずつ受け付ける(名前付きパイプ)
+// name パイプの名前(\\.\pipe\の後ろ)
+class LocalServer : private boost::noncopyable {
+  std::string path_;
+  HANDLE pipe_;
+  bool connected_;
+
+  std::string buffer_;
+
+
+public:
+  explicit LocalServer(const std::string& name) :
+    path_("\\\\.\\pipe\\" + name),
+    pipe_(INVALID_HANDLE_VALUE),
+    connected_(false)
+  {
+    pipe_ = CreateNamedPipeA(path_.c_str(), PIPE_ACCESS_DUPLEX,
+                             PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+                             1, 64 * 1024, 64 * 1024, 0, NULL);
+  }
+
+  ~LocalServer() {
+    disconnect();
+    if (pipe_ != INVALID_HANDLE_VALUE) CloseHandle(pipe_);
+  }
+
+
+  bool valid() const { return pipe_ != INVALID_HANDLE_VALUE; }
+
+  // 次の接続を待つ
+  bool accept() {
+    disconnect();
+    // TIPS:待つ前に接続された時はERROR_PIPE_CONNECTEDが返る
+    connected_ = ConnectNamedPipe(pipe_, NULL) || (GetLastError() == ERROR_PIPE_CONNECTED);
+    return connected_;
+  }
+
+  void disconnect() {
+    if (connected_) {
+      FlushFileBuffers(pipe_);
+      DisconnectNamedPipe(pipe_);
+    }
+    connected_ = false;
+    buffer_.clear();
+  }
+
+  // 改行までを読み込む(改行は含まない)
+  bool readLine(std::string& line) {
+    while (1) {
+      auto pos = buffer_.find('\n');
+      if (pos != std::string::npos) {
+        line = buffer_.substr(0, pos);
+        buffer_.erase(0, pos + 1);
+        return true;
+      }
+
+      char data[4096];
+      DWORD size = 0;
+      if (!ReadFile(pipe_, data, sizeof(data), &size, NULL) || (size == 0)) return false;
+      buffer_.append(data, size);
+    }
+  }
+
+  bool write(const void* data, const size_t size) {
+    const char* p = static_cast<const char*>(data);
+    size_t rest = size;
+    while (rest > 0) {
+      DWORD written = 0;
+      DWORD chunk = DWORD(std::min(rest, size_t(1 << 20)));
+      if (!WriteFile(pipe_, p, chunk, &written, NULL) || (written == 0)) return false;
+      p    += written;
+      rest -= written;
+    }
+    return true;
+  }
+
+};
+
 }
 
 #endif
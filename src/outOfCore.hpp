@@ -0,0 +1,711 @@
+﻿
+#pragma once
+
+//
+// メモリに収まらないシーンのための分割読み込み
+// ポリゴンを空間的にまとまったチャンクに分けてファイルに書き出し、
+// チャンクを囲う上位のBVHだけを常駐させる
+// チャンクの頂点とBVHは必要になった時に読み込み、上限を超えたら古い順に捨てる
+// 上位のBVHは目次ファイルに書き出し、変換元が変わっていなければ次回から読み込むだけにする
+// チャンクのBVHも構築済みのものをチャンクファイルに書き出しておき、読み込む時は作り直さない
+// FIXME:光線を待たせておく仕組みが無いので、チャンクを読み込む間はレンダリング全体が止まる
+//       (積分は光線を深さ優先で1本ずつ追いかけ、Pathtrace::renderは1スレッドで動く)
+//
+
+#include "defines.hpp"
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include "geometry.hpp"
+#include "model.hpp"
+#include "bvh.hpp"
+#include "sceneFile.hpp"
+
+
+namespace {
+
+class ChunkedScene {
+  using Vtx  = Geometry::Vtx;
+  using Uv   = Geometry::Uv;
+  using Face = Geometry::Face;
+
+  struct Chunk {
+    std::string path;
+    u_int faces;
+    uint64_t bytes;                                 // ファイルの大きさ(書き出し途中で止まっていないか調べる)
+  };
+
+  // 上位のBVH
+  struct TopNode {
+    Bvh::BBox bbox;
+    int child[2];
+    int chunk;                                      // 葉の場合はチャンク番号(それ以外は-1)
+  };
+
+  // 読み込んだチャンク
+  struct Resident {
+    std::vector<u_char> buffer;
+    Geometry geometry;
+    Bvh::BvhNode bvh;
+    size_t memory;
+
+    std::list<int>::iterator lru;
+  };
+
+  // 分割中のポリゴン
+  struct FaceRef {
+    u_int mesh;
+    u_int face;
+    float center[3];
+  };
+
+  // 目次ファイル
+  // TIPS:上位のBVHを書き出しておき、チャンクを作り直さずに読み込む
+  enum {
+    INDEX_MAGIC   = 0x43545253,                     // 'SRTC'
+    INDEX_VERSION = 2,
+
+    CHUNK_MAGIC   = 0x4b4e4843,                     // 'CHNK'
+  };
+
+  struct IndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_faces;
+    uint32_t node_num;
+    uint64_t source_size;                           // 変換元ファイルの大きさと更新時刻
+    uint64_t source_time;
+  };
+
+  struct NodeRecord {
+    double  inf[3];
+    double  sup[3];
+    int32_t child[2];
+    int32_t chunk;
+    uint32_t faces;                                 // 葉の場合はチャンクのポリゴン数
+    uint64_t bytes;                                 // 葉の場合はチャンクファイルの大きさ
+  };
+
+  // チャンクファイル
+  // 頂点、法線、UV、面、マテリアル番号、BVHのノード、葉のポリゴン番号の順に並ぶ
+  struct ChunkHeader {
+    uint32_t magic;
+    uint32_t faces;
+    uint32_t node_num;
+    uint32_t reserved;
+  };
+
+  // 深さ優先で並べたBVHのノード
+  // TIPS:葉のポリゴン番号はノードと同じ順に並べる
+  struct BvhRecord {
+    double   inf[3];
+    double   sup[3];
+    uint32_t leaf;
+    uint32_t triangles;                             // 葉のポリゴン数
+  };
+
+  // TIPS:チャンクを読み込む時にマテリアルを参照するので、Modelより先に破棄すること
+  const std::vector<Material>& materials_;
+
+  // 読み込みに失敗したら目次を消して、次回作り直す
+  std::string index_path_;
+
+  std::vector<Chunk>   chunks_;
+  std::vector<TopNode> nodes_;
+
+  // 読み込み済みのチャンク
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Resident> > resident_;
+  std::list<int> lru_;                              // 先頭が最後に使ったチャンク
+  size_t memory_;
+  size_t budget_;
+
+  // 読み込んだ法線とUVを圧縮する
+  bool quantize_;
+
+  // 統計
+  std::atomic<u_int>  page_in_;
+  std::atomic<u_int>  page_out_;
+  std::atomic<u_int>  hit_;
+  mutable std::atomic<size_t> read_bytes_;
+
+
+public:
+  // budget      チャンクに使うメモリの上限(bytes)
+  // quantize    法線とUVを圧縮して持つ
+  ChunkedScene(const std::vector<Material>& materials, const size_t budget, const bool quantize) :
+    materials_(materials),
+    memory_(0),
+    budget_(budget),
+    quantize_(quantize),
+    page_in_(0),
+    page_out_(0),
+    hit_(0),
+    read_bytes_(0)
+  {}
+
+
+  // モデルをチャンクに分けて書き出す
+  // directory   チャンクを書き出す場所
+  // source_path 変換元のファイル(目次に大きさと更新時刻を記録する)
+  // chunk_faces 1チャンクのポリゴン数
+  void build(const Model& model, const std::string& directory, const std::string& source_path,
+             const u_int chunk_faces) {
+    index_path_ = indexPath(directory);
+
+    std::vector<FaceRef> faces;
+    const auto& meshes = model.mesh();
+    for (u_int im = 0; im < meshes.size(); ++im) {
+      const auto& m = *meshes[im];
+      for (u_int ip = 0; ip < m.faces(); ++ip) {
+        Triangle polygon = m.polygon(ip);
+        Vec3f center = (polygon.a + polygon.b + polygon.c) / 3;
+        faces.push_back({ im, ip, { float(center.x()), float(center.y()), float(center.z()) } });
+      }
+    }
+
+    if (!faces.empty()) {
+      construct(model, faces, 0, faces.size(), directory, std::max(chunk_faces, u_int(1)));
+    }
+    resident_.resize(chunks_.size());
+
+    // TIPS:チャンクを全て書き終えてから目次を書く
+    //      途中で止まった時は目次が古いままなので、次回作り直される
+    if (!writeIndex(directory, source_path, chunk_faces)) {
+      DOUT << "Can't write chunk index:" << indexPath(directory) << std::endl;
+    }
+
+    DOUT << "chunk:" << chunks_.size() << " faces:" << faces.size() << std::endl;
+  }
+
+  // 書き出し済みのチャンクを使う
+  // 目次が無いか古い場合はfalse
+  bool open(const std::string& directory, const std::string& source_path, const u_int chunk_faces) {
+    std::ifstream fstr(indexPath(directory), std::ios::binary);
+    if (!fstr) return false;
+
+    IndexHeader header;
+    if (!fstr.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    if (!isLatest(header, source_path, chunk_faces)) return false;
+
+    std::vector<NodeRecord> records(header.node_num);
+    if (header.node_num
+        && !fstr.read(reinterpret_cast<char*>(&records[0]), sizeof(NodeRecord) * records.size())) return false;
+
+    u_int faces = 0;
+    std::vector<Chunk>   chunks;
+    std::vector<TopNode> nodes;
+    const int node_num = int(records.size());
+    for (const auto& r : records) {
+      // 壊れた目次は古いものとして扱う
+      if (r.chunk >= node_num) return false;
+      if ((r.chunk < 0) && ((r.child[0] < 0) || (r.child[0] >= node_num)
+                         || (r.child[1] < 0) || (r.child[1] >= node_num))) return false;
+
+      TopNode node;
+      node.bbox.inf = Vec3f(r.inf[0], r.inf[1], r.inf[2]);
+      node.bbox.sup = Vec3f(r.sup[0], r.sup[1], r.sup[2]);
+      node.child[0] = r.child[0];
+      node.child[1] = r.child[1];
+      node.chunk    = r.chunk;
+      nodes.push_back(node);
+
+      if (r.chunk >= 0) {
+        // 書き出し途中で止まったチャンクがあれば作り直す
+        std::string path = chunkPath(directory, r.chunk);
+        uint64_t size;
+        uint64_t time;
+        if (!SceneFile::sourceInfo(size, time, path) || (size != r.bytes)) return false;
+
+        if (size_t(r.chunk) >= chunks.size()) chunks.resize(r.chunk + 1);
+        chunks[r.chunk] = { path, r.faces, r.bytes };
+        faces += r.faces;
+      }
+    }
+    index_path_ = indexPath(directory);
+
+    chunks_ = std::move(chunks);
+    nodes_  = std::move(nodes);
+    resident_.resize(chunks_.size());
+
+    DOUT << "chunk:" << chunks_.size() << " faces:" << faces << " (reused)" << std::endl;
+    return true;
+  }
+
+  // 書き出し済みのチャンクが使えるか
+  // TIPS:シーンを読み込む前に調べて、チャンクにしたメッシュの頂点を読み込まないようにする
+  static bool isLatest(const std::string& directory, const std::string& source_path, const u_int chunk_faces) {
+    std::ifstream fstr(indexPath(directory), std::ios::binary);
+    IndexHeader header;
+    if (!fstr || !fstr.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    return isLatest(header, source_path, chunk_faces);
+  }
+
+  // チャンクとは別に、頂点をメモリに残しておくマテリアルか
+  // TIPS:光源はLightTreeが、鏡面と透過はコースティクスの範囲を求める時に使う
+  static bool isResident(const Material& material) {
+    return !material.emissive().isZero()
+        || !material.reflective().isZero()
+        || !material.transparent().isZero();
+  }
+
+
+  // シーン全体のAABB
+  Bvh::BBox bbox() const {
+    return nodes_.empty() ? Bvh::emptyAABB() : nodes_[0].bbox;
+  }
+
+
+  // 最も近い交差点を求める
+  bool intersect(Bvh::TestInfo& res, const Vec3f& ray_start, const Vec3f& ray_vec, const bool back_face) {
+    if (nodes_.empty()) return false;
+    return intersect(res, ray_start, ray_vec, back_face, 0);
+  }
+
+  // 光線を遮るポリゴンがあるか調べる
+  bool occluded(const Vec3f& ray_start, const Vec3f& ray_vec, const Real max_distance = FLT_MAX) {
+    if (nodes_.empty()) return false;
+    return occluded(ray_start, ray_vec, max_distance, 0);
+  }
+
+
+  // 統計を出力して数え直す
+  void reportStats() {
+    size_t memory;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      memory = memory_;
+    }
+    DOUT << "chunk page in:" << page_in_.exchange(0)
+         << " page out:" << page_out_.exchange(0)
+         << " hit:" << hit_.exchange(0)
+         << " read:" << read_bytes_.exchange(0) / 1024 << "KB"
+         << " resident:" << memory / 1024 << "KB" << std::endl;
+  }
+
+
+private:
+  static std::string indexPath(const std::string& directory) {
+    return directory + "/chunks.index";
+  }
+
+  static std::string chunkPath(const std::string& directory, const size_t index) {
+    std::ostringstream path;
+    path << directory << "/" << index << ".chunk";
+    return path.str();
+  }
+
+  static bool isLatest(const IndexHeader& header, const std::string& source_path, const u_int chunk_faces) {
+    if ((header.magic != INDEX_MAGIC) || (header.version != INDEX_VERSION)) return false;
+    if (header.chunk_faces != chunk_faces) return false;
+
+    uint64_t size;
+    uint64_t time;
+    if (!SceneFile::sourceInfo(size, time, source_path)) return false;
+    return (header.source_size == size) && (header.source_time == time);
+  }
+
+  bool writeIndex(const std::string& directory, const std::string& source_path, const u_int chunk_faces) const {
+    IndexHeader header;
+    header.magic       = INDEX_MAGIC;
+    header.version     = INDEX_VERSION;
+    header.chunk_faces = chunk_faces;
+    header.node_num    = uint32_t(nodes_.size());
+    if (!SceneFile::sourceInfo(header.source_size, header.source_time, source_path)) return false;
+
+    std::vector<NodeRecord> records;
+    for (const auto& node : nodes_) {
+      NodeRecord r;
+      for (int i = 0; i < 3; ++i) {
+        r.inf[i] = node.bbox.inf(i);
+        r.sup[i] = node.bbox.sup(i);
+      }
+      r.child[0] = node.child[0];
+      r.child[1] = node.child[1];
+      r.chunk    = node.chunk;
+      r.faces    = (node.chunk >= 0) ? chunks_[node.chunk].faces : 0;
+      r.bytes    = (node.chunk >= 0) ? chunks_[node.chunk].bytes : 0;
+      records.push_back(r);
+    }
+
+    std::ofstream fstr(indexPath(directory), std::ios::binary);
+    if (!fstr) return false;
+    fstr.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!records.empty()) {
+      fstr.write(reinterpret_cast<const char*>(&records[0]), sizeof(NodeRecord) * records.size());
+    }
+    return bool(fstr);
+  }
+
+
+  // 光線とAABBの交差距離(交差しない場合はfalse)
+  static bool rayAABB(Real& t, const Vec3f& p, const Vec3f& d, const Bvh::BBox& b) {
+    Real tmin = 0.0;
+    Real tmax = FLT_MAX;
+
+    for (u_int i = 0; i < 3; ++i) {
+      if (std::abs(d(i)) < FLT_EPSILON) {
+        if (p(i) < b.inf(i) || p(i) > b.sup(i)) return false;
+      }
+      else {
+        Real ood = 1.0 / d(i);
+        Real t1 = (b.inf(i) - p(i)) * ood;
+        Real t2 = (b.sup(i) - p(i)) * ood;
+
+        if (t1 > t2) std::swap(t1, t2);
+        tmin = std::max(t1, tmin);
+        tmax = std::min(t2, tmax);
+
+        if (tmin > tmax) return false;
+      }
+    }
+
+    t = tmin;
+    return true;
+  }
+
+  // TIPS:手前の子供から調べて、交差点より奥のチャンクは読み込まない
+  bool intersect(Bvh::TestInfo& res, const Vec3f& ray_start, const Vec3f& ray_vec, const bool back_face,
+                 const int index) {
+    const auto& node = nodes_[index];
+
+    if (node.chunk >= 0) {
+      auto chunk = acquire(node.chunk);
+      return Bvh::intersect(res, ray_start, ray_vec, chunk->bvh, back_face);
+    }
+
+    Real t[2];
+    bool hit[2];
+    for (int i = 0; i < 2; ++i) {
+      hit[i] = rayAABB(t[i], ray_start, ray_vec, nodes_[node.child[i]].bbox);
+    }
+    int first = (hit[0] && hit[1] && (t[1] < t[0])) ? 1 : 0;
+
+    bool hit_res = false;
+    for (int i = 0; i < 2; ++i) {
+      int c = first ^ i;
+      if (!hit[c] || (t[c] > res.distance)) continue;
+      if (intersect(res, ray_start, ray_vec, back_face, node.child[c])) hit_res = true;
+    }
+    return hit_res;
+  }
+
+  bool occluded(const Vec3f& ray_start, const Vec3f& ray_vec, const Real max_distance,
+                const int index) {
+    const auto& node = nodes_[index];
+
+    Real t;
+    if (!rayAABB(t, ray_start, ray_vec, node.bbox) || (t > max_distance)) return false;
+
+    if (node.chunk >= 0) {
+      auto chunk = acquire(node.chunk);
+      return Bvh::occluded(ray_start, ray_vec, chunk->bvh, max_distance);
+    }
+
+    return occluded(ray_start, ray_vec, max_distance, node.child[0])
+        || occluded(ray_start, ray_vec, max_distance, node.child[1]);
+  }
+
+
+  // チャンクを使う
+  // 読み込まれていなければ読み込み、上限を超えた分は古い順に捨てる
+  // TIPS:使用中のチャンクはshared_ptrで保持されるので、捨てても解放されない
+  std::shared_ptr<Resident> acquire(const int index) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& r = resident_[index];
+      if (r) {
+        lru_.splice(lru_.begin(), lru_, r->lru);
+        hit_.fetch_add(1, std::memory_order_relaxed);
+        return r;
+      }
+    }
+
+    // 読み込み中はロックしない
+    auto chunk = load(index);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& r = resident_[index];
+    if (r) {
+      // 他のスレッドが先に読み込んだ
+      lru_.splice(lru_.begin(), lru_, r->lru);
+      return r;
+    }
+
+    lru_.push_front(index);
+    chunk->lru = lru_.begin();
+    r = chunk;
+    memory_ += chunk->memory;
+    page_in_.fetch_add(1, std::memory_order_relaxed);
+
+    while ((memory_ > budget_) && (lru_.size() > 1)) {
+      int last = lru_.back();
+      lru_.pop_back();
+      memory_ -= resident_[last]->memory;
+      resident_[last].reset();
+      page_out_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return chunk;
+  }
+
+  // チャンクの頂点と構築済みのBVHを読み込む
+  // TIPS:読めなかった時は目次を消して(次回作り直される)、空のチャンクとして扱う
+  std::shared_ptr<Resident> load(const int index) const {
+    const auto& chunk = chunks_[index];
+
+    auto r = std::make_shared<Resident>();
+    r->memory = 0;
+    if (!read(*r, chunk)) {
+      DOUT << "Can't read chunk:" << chunk.path << std::endl;
+      if (!index_path_.empty()) std::remove(index_path_.c_str());
+      r = std::make_shared<Resident>();
+      r->memory = 0;
+    }
+    return r;
+  }
+
+  bool read(Resident& r, const Chunk& chunk) const {
+    std::ifstream fstr(chunk.path, std::ios::binary);
+    ChunkHeader header;
+    if (!fstr.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    if ((header.magic != CHUNK_MAGIC) || (header.faces != chunk.faces) || !header.node_num) return false;
+
+    const u_int faces    = chunk.faces;
+    const u_int vertices = faces * 3;
+
+    // TIPS:圧縮する時は、法線とUVを一時的な領域に読み込む
+    const size_t position_size  = vertices * sizeof(Vtx);
+    const size_t attribute_size = vertices * (sizeof(Vtx) + sizeof(Uv));
+    const size_t face_size      = faces * (sizeof(Face) + sizeof(u_int));
+    r.buffer.resize(position_size + (quantize_ ? 0 : attribute_size) + face_size);
+
+    std::vector<u_char> attributes(quantize_ ? attribute_size : 0);
+    u_char* position_p  = &r.buffer[0];
+    u_char* attribute_p = quantize_ ? &attributes[0] : position_p + position_size;
+    u_char* face_p      = quantize_ ? position_p + position_size : attribute_p + attribute_size;
+
+    std::vector<BvhRecord> records(header.node_num);
+    std::vector<u_int>     refs(faces);
+    if (!fstr.read(reinterpret_cast<char*>(position_p), position_size)
+        || !fstr.read(reinterpret_cast<char*>(attribute_p), attribute_size)
+        || !fstr.read(reinterpret_cast<char*>(face_p), face_size)
+        || !fstr.read(reinterpret_cast<char*>(&records[0]), sizeof(BvhRecord) * records.size())
+        || !fstr.read(reinterpret_cast<char*>(&refs[0]), sizeof(u_int) * refs.size())) return false;
+    read_bytes_.fetch_add(sizeof(header) + position_size + attribute_size + face_size
+                          + sizeof(BvhRecord) * records.size() + sizeof(u_int) * refs.size(),
+                          std::memory_order_relaxed);
+
+    const auto* positions = reinterpret_cast<const Vtx*>(position_p);
+    const auto* normals   = reinterpret_cast<const Vtx*>(attribute_p);
+    const auto* uvs       = reinterpret_cast<const Uv*>(normals + vertices);
+    const auto* indices   = reinterpret_cast<const Face*>(face_p);
+    const auto* materials = reinterpret_cast<const u_int*>(indices + faces);
+
+    // 範囲外を参照しないか調べる
+    for (u_int i = 0; i < faces; ++i) {
+      const auto& f = indices[i];
+      if ((f.v1 >= vertices) || (f.v2 >= vertices) || (f.v3 >= vertices)) return false;
+      if (materials[i] >= materials_.size()) return false;
+    }
+    for (auto face : refs) {
+      if (face >= faces) return false;
+    }
+
+    // TIPS:buffer はResidentと一緒に解放されるので、storageは不要
+    r.geometry = Geometry(true, vertices, positions, normals, uvs, faces, indices,
+                          std::shared_ptr<const void>());
+    if (quantize_) r.geometry = r.geometry.quantized();
+
+    size_t node_index = 0;
+    size_t ref_index  = 0;
+    if (!restore(r.bvh, node_index, ref_index, records, refs, r.geometry, materials)) return false;
+    if ((node_index != records.size()) || (ref_index != refs.size())) return false;
+
+    r.memory = r.geometry.memory()
+             + faces * (sizeof(u_int) + sizeof(Bvh::BvhTriangle))
+             + records.size() * sizeof(Bvh::BvhNode);
+    return true;
+  }
+
+
+  // BVHを深さ優先で並べる
+  static void flatten(std::vector<BvhRecord>& records, std::vector<u_int>& refs, const Bvh::BvhNode& node) {
+    BvhRecord r;
+    for (int i = 0; i < 3; ++i) {
+      r.inf[i] = node.bbox.inf(i);
+      r.sup[i] = node.bbox.sup(i);
+    }
+    r.leaf      = node.children.empty() ? 1 : 0;
+    r.triangles = u_int(node.triangles.size());
+    records.push_back(r);
+
+    for (const auto& t : node.triangles) {
+      refs.push_back(t.face);
+    }
+    for (const auto& child : node.children) {
+      flatten(records, refs, child);
+    }
+  }
+
+  // 並べたBVHを木に戻す
+  bool restore(Bvh::BvhNode& node, size_t& node_index, size_t& ref_index,
+               const std::vector<BvhRecord>& records, const std::vector<u_int>& refs,
+               const Geometry& geometry, const u_int* materials) const {
+    if (node_index >= records.size()) return false;
+    const auto& r = records[node_index++];
+
+    // TIPS:Floatに丸める時は外側に広げる
+    for (int i = 0; i < 3; ++i) {
+      Float inf = Float(r.inf[i]);
+      Float sup = Float(r.sup[i]);
+      if (double(inf) > r.inf[i]) inf = std::nextafter(inf, -std::numeric_limits<Float>::infinity());
+      if (double(sup) < r.sup[i]) sup = std::nextafter(sup,  std::numeric_limits<Float>::infinity());
+      node.bbox.inf(i) = inf;
+      node.bbox.sup(i) = sup;
+    }
+
+    if ((ref_index + r.triangles) > refs.size()) return false;
+    for (u_int i = 0; i < r.triangles; ++i) {
+      u_int face = refs[ref_index++];
+      node.triangles.push_back({ &geometry, &materials_[materials[face]], face });
+    }
+
+    if (r.leaf) return true;
+
+    node.children.resize(2);
+    return restore(node.children[0], node_index, ref_index, records, refs, geometry, materials)
+        && restore(node.children[1], node_index, ref_index, records, refs, geometry, materials);
+  }
+
+
+  // 重心の広がりが一番大きい軸で半分に分けていく
+  int construct(const Model& model, std::vector<FaceRef>& faces, const size_t begin, const size_t end,
+                const std::string& directory, const u_int chunk_faces) {
+    int index = int(nodes_.size());
+    nodes_.push_back(TopNode());
+
+    if ((end - begin) <= chunk_faces) {
+      nodes_[index].bbox  = writeChunk(model, faces, begin, end, directory);
+      nodes_[index].child[0] = nodes_[index].child[1] = -1;
+      nodes_[index].chunk = int(chunks_.size() - 1);
+      return index;
+    }
+
+    float inf[3] = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+    float sup[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (size_t i = begin; i < end; ++i) {
+      for (int axis = 0; axis < 3; ++axis) {
+        inf[axis] = std::min(inf[axis], faces[i].center[axis]);
+        sup[axis] = std::max(sup[axis], faces[i].center[axis]);
+      }
+    }
+    int split_axis = 0;
+    for (int axis = 1; axis < 3; ++axis) {
+      if ((sup[axis] - inf[axis]) > (sup[split_axis] - inf[split_axis])) split_axis = axis;
+    }
+
+    size_t middle = (begin + end) / 2;
+    std::nth_element(faces.begin() + begin, faces.begin() + middle, faces.begin() + end,
+                     [split_axis](const FaceRef& a, const FaceRef& b) {
+                       return a.center[split_axis] < b.center[split_axis];
+                     });
+
+    int child0 = construct(model, faces, begin, middle, directory, chunk_faces);
+    int child1 = construct(model, faces, middle, end, directory, chunk_faces);
+
+    // TIPS:再帰中にnodes_が再確保されるので、ここで参照し直す
+    auto& node = nodes_[index];
+    node.child[0] = child0;
+    node.child[1] = child1;
+    node.chunk    = -1;
+    node.bbox     = Bvh::mergeAABB(nodes_[child0].bbox, nodes_[child1].bbox);
+
+    return index;
+  }
+
+  // チャンクをファイルに書き出して、AABBを返す
+  Bvh::BBox writeChunk(const Model& model, const std::vector<FaceRef>& faces, const size_t begin, const size_t end,
+                       const std::string& directory) {
+    std::string path = chunkPath(directory, chunks_.size());
+
+    const u_int face_num = u_int(end - begin);
+    std::vector<Vtx>   positions;
+    std::vector<Vtx>   normals;
+    std::vector<Uv>    uvs;
+    std::vector<Face>  indices;
+    std::vector<u_int> materials;
+    positions.reserve(face_num * 3);
+    normals.reserve(face_num * 3);
+    uvs.reserve(face_num * 3);
+    indices.reserve(face_num);
+    materials.reserve(face_num);
+
+    auto bbox = Bvh::emptyAABB();
+    const auto& meshes = model.mesh();
+    for (size_t i = begin; i < end; ++i) {
+      const auto& m = *meshes[faces[i].mesh];
+      const auto& f = m.indices()[faces[i].face];
+
+      u_int base = u_int(positions.size());
+      for (u_int v : { f.v1, f.v2, f.v3 }) {
+        const auto& pos = m.positions()[v];
+        positions.push_back(pos);
+        normals.push_back(m.normals()[v]);
+        uvs.push_back(m.hasTexture() ? m.uvs()[v] : Uv{ 0.0f, 0.0f });
+
+        bbox.inf = bbox.inf.cwiseMin(Vec3f(pos.x, pos.y, pos.z));
+        bbox.sup = bbox.sup.cwiseMax(Vec3f(pos.x, pos.y, pos.z));
+      }
+      indices.push_back({ base, base + 1, base + 2 });
+      materials.push_back(m.materialIndex());
+    }
+
+    // 読み込む時に作り直さないよう、BVHを構築して一緒に書き出す
+    Geometry geometry(true, u_int(positions.size()), &positions[0], &normals[0], &uvs[0],
+                      face_num, &indices[0], std::shared_ptr<const void>());
+    std::deque<Bvh::BuildTriangle> triangles;
+    for (u_int i = 0; i < face_num; ++i) {
+      triangles.push_back(Bvh::buildTriangle(geometry, materials_[materials[i]], i));
+    }
+    std::vector<BvhRecord> records;
+    std::vector<u_int>     refs;
+    flatten(records, refs, Bvh::construct(triangles));
+
+    ChunkHeader header;
+    header.magic    = CHUNK_MAGIC;
+    header.faces    = face_num;
+    header.node_num = uint32_t(records.size());
+    header.reserved = 0;
+
+    std::ofstream fstr(path, std::ios::binary);
+    fstr.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fstr.write(reinterpret_cast<const char*>(&positions[0]), sizeof(Vtx) * positions.size());
+    fstr.write(reinterpret_cast<const char*>(&normals[0]), sizeof(Vtx) * normals.size());
+    fstr.write(reinterpret_cast<const char*>(&uvs[0]), sizeof(Uv) * uvs.size());
+    fstr.write(reinterpret_cast<const char*>(&indices[0]), sizeof(Face) * indices.size());
+    fstr.write(reinterpret_cast<const char*>(&materials[0]), sizeof(u_int) * materials.size());
+    fstr.write(reinterpret_cast<const char*>(&records[0]), sizeof(BvhRecord) * records.size());
+    fstr.write(reinterpret_cast<const char*>(&refs[0]), sizeof(u_int) * refs.size());
+    if (!fstr) DOUT << "Can't write chunk:" << path << std::endl;
+
+    // TIPS:書き出しに失敗した時は大きさが合わないので、次回作り直される
+    uint64_t bytes = sizeof(header)
+                   + (sizeof(Vtx) * 2 + sizeof(Uv)) * positions.size()
+                   + (sizeof(Face) + sizeof(u_int)) * face_num
+                   + sizeof(BvhRecord) * records.size() + sizeof(u_int) * refs.size();
+    chunks_.push_back({ path, face_num, bytes });
+
+    return bbox;
+  }
+
+};
+
+}
@@ -0,0 +1,176 @@
+﻿
+#pragma once
+
+//
+// 法線やUVを少ないbit数に詰める
+//
+
+#include "defines.hpp"
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+
+namespace {
+
+// [-1, 1]を16bitの符号付き整数に
+int16_t packSnorm16(const float value) {
+  return int16_t(std::round(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f));
+}
+
+float unpackSnorm16(const int16_t value) {
+  return std::max(value / 32767.0f, -1.0f);
+}
+
+
+// 単位ベクトルを八面体に投影して、2つの16bitに詰める
+// SOURCE:Cigolle et al. "A Survey of Efficient Representations for Independent Unit Vectors" (JCGT 2014)
+uint32_t packOctahedral(const float x, const float y, const float z) {
+  float l = std::abs(x) + std::abs(y) + std::abs(z);
+  if (l <= 0.0f) return 0;
+
+  float u = x / l;
+  float v = y / l;
+  if (z < 0.0f) {
+    // 下半分は折り返す
+    float fu = (1.0f - std::abs(v)) * ((u >= 0.0f) ? 1.0f : -1.0f);
+    float fv = (1.0f - std::abs(u)) * ((v >= 0.0f) ? 1.0f : -1.0f);
+    u = fu;
+    v = fv;
+  }
+
+  return uint32_t(uint16_t(packSnorm16(u))) | (uint32_t(uint16_t(packSnorm16(v))) << 16);
+}
+
+// 戻り値は正規化されている
+template <typename Vec>
+Vec unpackOctahedral(const uint32_t packed) {
+  float u = unpackSnorm16(int16_t(packed & 0xffff));
+  float v = unpackSnorm16(int16_t(packed >> 16));
+  float z = 1.0f - std::abs(u) - std::abs(v);
+
+  // 下半分
+  float t = std::max(-z, 0.0f);
+  u += (u >= 0.0f) ? -t : t;
+  v += (v >= 0.0f) ? -t : t;
+
+  return Vec(u, v, z).normalized();
+}
+
+
+// float ←→ 半精度(IEEE 754 binary16)
+// TIPS:範囲外は無限大、非正規化数も扱う
+uint16_t floatToHalf(const float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  uint32_t sign     = (bits >> 16) & 0x8000;
+  int32_t  exponent = int32_t((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  // NaNと無限大
+  if (((bits >> 23) & 0xff) == 0xff) {
+    return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  }
+  if (exponent >= 31) return uint16_t(sign | 0x7c00);
+
+  if (exponent <= 0) {
+    // 非正規化数
+    if (exponent < -10) return uint16_t(sign);
+    mantissa |= 0x800000;
+    uint32_t shift = uint32_t(14 - exponent);
+    uint32_t half  = mantissa >> shift;
+    // 偶数丸め
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t mid  = 1u << (shift - 1);
+    if ((rest > mid) || ((rest == mid) && (half & 1))) half += 1;
+    return uint16_t(sign | half);
+  }
+
+  uint32_t half = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  // 繰り上がりは指数に伝わる
+  if ((rest > 0x1000) || ((rest == 0x1000) && (half & 1))) half += 1;
+  return uint16_t(half);
+}
+
+float halfToFloat(const uint16_t value) {
+  uint32_t sign     = uint32_t(value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1f;
+  uint32_t mantissa = value & 0x3ff;
+
+  uint32_t bits;
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    }
+    else {
+      // 非正規化数を正規化する
+      exponent = 127 - 15 + 1;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        exponent -= 1;
+      }
+      bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  }
+  else if (exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  }
+  else {
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+
+  float res;
+  std::memcpy(&res, &bits, sizeof(res));
+  return res;
+}
+
+
+// 2つの値を半精度で詰める
+uint32_t packHalf2(const float x, const float y) {
+  return uint32_t(floatToHalf(x)) | (uint32_t(floatToHalf(y)) << 16);
+}
+
+void unpackHalf2(float& x, float& y, const uint32_t packed) {
+  x = halfToFloat(uint16_t(packed & 0xffff));
+  y = halfToFloat(uint16_t(packed >> 16));
+}
+
+
+// RGBを共通の指数で詰める(Radiance HDRと同じ、R, G, B, 指数の順に8bitずつ)
+// SOURCE:http://www.graphics.cornell.edu/online/formats/rgbe/
+uint32_t packRgbe(const float r, const float g, const float b) {
+  float v = std::max({ r, g, b });
+  if (v < 1e-32f) return 0;
+
+  int e;
+  float m = std::frexp(v, &e) * 256.0f / v;
+  return uint32_t(u_char(r * m)) | (uint32_t(u_char(g * m)) << 8) | (uint32_t(u_char(b * m)) << 16)
+       | (uint32_t(e + 128) << 24);
+}
+
+// 指数部ごとの倍率(0は黒)
+// TIPS:展開のたびにldexpを呼ばないよう、表にしておく
+const float* rgbeScales() {
+  static const std::vector<float> table = []() {
+    std::vector<float> t(256);
+    t[0] = 0.0f;
+    for (int e = 1; e < 256; ++e) {
+      t[e] = std::ldexp(1.0f, e - (128 + 8));
+    }
+    return t;
+  }();
+  return &table[0];
+}
+
+void unpackRgbe(float& r, float& g, float& b, const uint32_t packed) {
+  float scale = rgbeScales()[packed >> 24];
+  r = float(packed & 0xff) * scale;
+  g = float((packed >> 8) & 0xff) * scale;
+  b = float((packed >> 16) & 0xff) * scale;
+}
+
+}
@@ -0,0 +1,53 @@
+﻿
+#pragma once
+
+//
+// 簡易的な並列処理
+//
+
+#include "defines.hpp"
+#include <vector>
+#include <future>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+
+namespace {
+
+// 使用するスレッド数
+u_int workerNum() {
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// func(0)〜func(num - 1)を複数のスレッドで実行する
+// TIPS:処理の重さがまちまちなので、空いたスレッドから順に次の番号を取る
+//      例外はfutureを経由して呼び出し元に投げ直される
+template <typename Func>
+void parallelFor(const size_t num, Func func) {
+  if (num == 0) return;
+
+  std::atomic<size_t> next(0);
+  auto worker = [&next, num, &func]() {
+    while (1) {
+      size_t index = next.fetch_add(1);
+      if (index >= num) break;
+      func(index);
+    }
+  };
+
+  size_t thread_num = std::min(size_t(workerNum()), num);
+  std::vector<std::future<void> > futures;
+  for (size_t i = 1; i < thread_num; ++i) {
+    futures.push_back(std::async(std::launch::async, worker));
+  }
+
+  // 呼び出したスレッドも処理する
+  worker();
+
+  for (auto& f : futures) {
+    f.get();
+  }
+}
+
+}
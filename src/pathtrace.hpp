@@ -10,8 +10,16 @@
 #include "collision.hpp"
 #include "random.hpp"
 #include "qmc.hpp"
+#include "simd.hpp"
 #include "bvh.hpp"
+#include "lightTree.hpp"
+#include "guiding.hpp"
+#include "photonMap.hpp"
+#include "radianceCache.hpp"
+#include "outOfCore.hpp"
 #include "hdri.hpp"
+#include "sharedImage.hpp"
+#include "liveFramebuffer.hpp"
 
 
 namespace Pathtrace {
@@ -27,18 +35,20 @@ struct TestInfo {
 
 
 
-Vec3f radiationVector_qmc(const Vec3f& w, Qmc& random) {
-  Vec3f u = (std::abs(w.x()) > 0.0001) ? Vec3f::UnitY().cross(w).normalized()
-                                       : Vec3f::UnitX().cross(w).normalized();
-  Vec3f v = w.cross(u);
+Vec3f radiationVector_qmc(const Vec3f& normal, Qmc& random) {
+  Vec4r w = toSimd<Real>(normal);
+  Vec4r u = (std::abs(normal.x()) > 0.0001) ? normalize3(cross3(Vec4r(0.0, 1.0, 0.0), w))
+                                            : normalize3(cross3(Vec4r(1.0, 0.0, 0.0), w));
+  Vec4r v = cross3(w, u);
 
   const Real r1  = 2.0 * M_PI * random.next();
   const Real r2  = random.next();
   const Real r2s = std::sqrt(r2);
-  
-  return (u * std::cos(r1) * r2s
-        + v * std::sin(r1) * r2s
-        + w * std::sqrt(1.0 - r2)).normalized();
+
+  Vec4r res = fmadd(u, Vec4r(std::cos(r1) * r2s),
+                    fmadd(v, Vec4r(std::sin(r1) * r2s),
+                          w * Vec4r(std::sqrt(1.0 - r2))));
+  return toVec3f(normalize3(res));
 }
 
 
@@ -51,8 +61,8 @@ std::pair<bool, TestInfo> testRayObj(const Vec3f& ray_start, const Vec3f& ray_ve
   bool hit           = false;
   Real hit_t_current = std::numeric_limits<Real>::max();
 
-  const Triangle* normal_current;
-  const Triangle* uv_current;
+  const Mesh* mesh_current;
+  u_int face_current;
   Vec3f hit_uvw_current;
 
   const auto& meshes = model.mesh();
@@ -66,18 +76,14 @@ std::pair<bool, TestInfo> testRayObj(const Vec3f& ray_start, const Vec3f& ray_ve
     if (bbox_hit_t > hit_t_current) continue;
         
     // Mesh内のPolygonと交差判定
-    const auto& polygons = mesh->polygons();
-    const auto& normals  = mesh->normals();
-    const auto& uvs      = mesh->uvs();
-
-    for (int ip = 0; ip < polygons.size(); ++ip) {
+    for (u_int ip = 0; ip < mesh->faces(); ++ip) {
       Vec3f hit_pos;
       Real hit_t;
       Vec3f hit_n;
       Vec3f hit_c;
       if (testRayTriangle(hit_pos, hit_t, hit_n, hit_c,
                           ray_start, ray_vec,
-                          polygons[ip], back_face)) {
+                          mesh->polygon(ip), back_face)) {
         hit = true;
 
         if (hit_t < hit_t_current) {
@@ -87,8 +93,8 @@ std::pair<bool, TestInfo> testRayObj(const Vec3f& ray_start, const Vec3f& ray_ve
           info.material = &model.material()[mesh->materialIndex()];
 
           hit_uvw_current = hit_c;
-          normal_current  = &normals[ip];
-          if (info.material->hasTexture()) uv_current = &uvs[ip];
+          mesh_current    = mesh.get();
+          face_current    = ip;
         }
       }
     }
@@ -96,15 +102,11 @@ std::pair<bool, TestInfo> testRayObj(const Vec3f& ray_start, const Vec3f& ray_ve
 
   if (hit) {
     // TIPS:面法線は頂点の法線と重心座標から求められる
-    info.hit_normal = (normal_current->a * hit_uvw_current.x()
-                     + normal_current->b * hit_uvw_current.y()
-                     + normal_current->c * hit_uvw_current.z()).normalized();
+    info.hit_normal = mesh_current->geometry().normal(face_current, hit_uvw_current);
 
     if (info.material->hasTexture()) {
       // TIPS:UV座標も重心座標から求められる
-      info.hit_uv = uv_current->a * hit_uvw_current.x()
-                  + uv_current->b * hit_uvw_current.y()
-                  + uv_current->c * hit_uvw_current.z();
+      info.hit_uv = mesh_current->geometry().uv(face_current, hit_uvw_current);
     }
   }
   
@@ -154,223 +156,568 @@ Vec2f concentricSampleDisk(const Real u1, const Real u2) {
 
 
 
+// 光線の広がり(レイコーン)
+// TIPS:交差点で光線が覆う幅から、テクスチャと環境マップの縮小画像を選ぶ
+//      曲面による広がりの変化は無視する
+// SOURCE:Akenine-Möller et al. "Texture Level of Detail Strategies for Real-Time Ray Tracing" (Ray Tracing Gems 20)
+struct RayCone {
+  Real width;                                       // 始点での幅
+  Real spread;                                      // 広がり角(ラジアン)
+
+  // 距離tでの幅
+  Real widthAt(const Real t) const { return width + spread * t; }
+};
+
+
+// レンダリング用の情報
+struct RenderInfo {
+  Vec2i size;
+
+  std::vector<GLint> viewport;
+
+  Camera3D camera;
+  Pixel ambient;
+  std::vector<Light> lights;
+  Model model;
+
+  // ポリゴンで近似しない形状
+  // TIPS:BVHが要素を参照するので、BVHの生成後は変更しない
+  std::vector<Material> shape_materials;
+  std::vector<Shape> shapes;
+
+  // チャンクに分けて読み込む場合は、解析的な形状だけを入れる
+  Bvh::BvhNode bvh_node;
+
+  // チャンクに分けて読み込む場合のシーン(使わない場合はnullptr)
+  std::shared_ptr<ChunkedScene> chunks;
+  LightTree::LightNode light_tree;
+
+  Hdri bg;
+
+  // パスガイディング(使わない場合はnullptr)
+  std::shared_ptr<SdTree> guiding;
+  int guiding_passes;
+
+  // コースティクス用のフォトンマップ(使わない場合はnullptr)
+  std::shared_ptr<PhotonMap> photon_map;
+
+  // 二回目以降の拡散反射で使うキャッシュ(使わない場合はnullptr)
+  std::shared_ptr<RadianceCache> radiance_cache;
+
+  // 外部のビューア向けに積算結果を書き出す先(使わない場合はnullptr)
+  std::shared_ptr<LiveFramebuffer> live;
+
+  // 拡散反射の色にテクスチャを使うか
+  bool use_texture;
+
+  // レイコーンで縮小画像を選ぶか
+  bool ray_cone;
+  // 拡散反射した後の広がり角
+  Real diffuse_spread;
+
+  int subpixel_num;
+  int sample_num;
+  int recursive_depth;
+
+  Real focal_distance;
+  Real lens_radius;
+
+
+  RenderInfo(const int width, const int height,
+             const std::vector<GLint>& src_viewport,
+             const Camera3D& src_camera,
+             const Pixel& src_ambient,
+             const std::vector<Light>& src_lights,
+             const Model& src_model,
+             Hdri&& src_bg,
+             const int src_subpixel_num,
+             const int src_sample_num,
+             const int src_recursive_depth,
+             const Real src_focal_distance,
+             const Real src_lens_radius) :
+    size(width, height),
+    viewport(src_viewport),
+    camera(src_camera),
+    ambient(src_ambient),
+    lights(src_lights),
+    model(src_model),
+    light_tree(LightTree::createFromModel(src_model)),
+    bg(std::move(src_bg)),
+    guiding_passes(0),
+    use_texture(true),
+    ray_cone(false),
+    diffuse_spread(0.0),
+    subpixel_num(src_subpixel_num),
+    sample_num(src_sample_num),
+    recursive_depth(src_recursive_depth),
+    focal_distance(src_focal_distance),
+    lens_radius(src_lens_radius)
+  { }
+};
+
+
+// シーンとの交差判定
+bool intersect(Bvh::TestInfo& res, const Vec3f& ray_start, const Vec3f& ray_vec, const bool back_face,
+               const RenderInfo& info) {
+  bool hit = info.chunks && info.chunks->intersect(res, ray_start, ray_vec, back_face);
+  // TIPS:チャンクの交差点より手前だけを調べる
+  if (Bvh::intersect(res, ray_start, ray_vec, info.bvh_node, back_face)) hit = true;
+  return hit;
+}
+
+// 交差点から光線を飛ばす時の開始位置
+Vec3f spawnPosition(const Bvh::TestInfo& test_info, const Vec3f& ray_vec) {
+  const auto& n = test_info.hit_geometric_normal;
+  return offsetRayOrigin(test_info.hit_pos, (ray_vec.dot(n) < 0.0) ? Vec3f(-n) : n);
+}
+
+bool occluded(const Vec3f& ray_start, const Vec3f& ray_vec, const RenderInfo& info,
+              const Real max_distance = FLT_MAX) {
+  return (info.chunks && info.chunks->occluded(ray_start, ray_vec, max_distance))
+      || Bvh::occluded(ray_start, ray_vec, info.bvh_node, max_distance);
+}
+
+
+// MISの重み(power heuristic)
+Real misWeight(const Real pdf, const Real other_pdf) {
+  Real a = pdf * pdf;
+  Real b = other_pdf * other_pdf;
+  return (a > 0.0) ? a / (a + b) : 0.0;
+}
+
+
+// 拡散反射でレイを選ぶ確率密度
+// cos分布とガイディングの分布をguide_fractionで混ぜる(dtreeはguide_fractionが0ならnullptrで良い)
+Real diffusePdf(const Vec3f& normal, const Vec3f& vec, const DTree* dtree, const Real guide_fraction) {
+  Real cos_term = std::max(normal.dot(vec), Real(0.0));
+  Real pdf = (1.0 - guide_fraction) * cos_term / M_PI;
+  if (guide_fraction > 0.0) pdf += guide_fraction * dtree->pdf(vec);
+  return pdf;
+}
+
+
+// 環境マップを重点サンプリングして直接光を求める
+// ※Lambertの1/πまで含めた値を返す
+// TIPS:MISの相手は、ガイディングと混ぜた拡散反射の確率密度
+//      学習中は直接光も入射光の分布に記録する
+Pixel sampleEnvironment(const Vec3f& pos, const Vec3f& normal,
+                        DTree* dtree, const Real guide_fraction,
+                        const RenderInfo& info,
+                        Qmc& random) {
+  const Real u1 = random.next();
+  const Real u2 = random.next();
+
+  Vec3f light_vec;
+  Real  light_pdf;
+  Pixel light = info.bg.sample(light_vec, light_pdf, u1, u2);
+
+  Real cos_term = normal.dot(light_vec);
+  if ((light_pdf <= 0.0) || (cos_term <= 0.0)) return Pixel::Zero();
+
+  // シャドウレイ
+  if (occluded(pos, light_vec, info)) return Pixel::Zero();
+
+  Real bsdf_pdf = diffusePdf(normal, light_vec, dtree, guide_fraction);
+  Real weight   = misWeight(light_pdf, bsdf_pdf);
+  if (dtree && info.guiding->recording()) {
+    dtree->record(light_vec, luminance(light) * weight / light_pdf, false);
+  }
+  return light * (cos_term / M_PI / light_pdf * weight);
+}
+
+
+// 発光ポリゴンを重要度に従って選び、直接光を求める
+// ※Lambertの1/πまで含めた値を返す
+// TIPS:学習中は直接光も入射光の分布に記録する
+Pixel sampleEmitter(const Vec3f& pos, const Vec3f& normal,
+                    DTree* dtree,
+                    const RenderInfo& info,
+                    Qmc& random) {
+  const Real u1 = random.next();
+  const Real u2 = random.next();
+  const Real u3 = random.next();
+
+  Real select_pdf;
+  const auto* emitter = LightTree::sample(select_pdf, pos, normal, info.light_tree, u1);
+  if (!emitter) return Pixel::Zero();
+
+  // ポリゴン内の位置を一様に選ぶ
+  Real su = std::sqrt(u2);
+  const auto& t = emitter->triangle;
+  Vec3f light_pos = t.a * (1.0 - su) + t.b * (su * (1.0 - u3)) + t.c * (su * u3);
+
+  Vec3f light_vec = light_pos - pos;
+  Real  distance  = light_vec.norm();
+  if (distance <= 0.0) return Pixel::Zero();
+  light_vec /= distance;
+
+  Real cos_term  = normal.dot(light_vec);
+  Real cos_light = -emitter->normal.dot(light_vec);
+  if ((cos_term <= 0.0) || (cos_light <= 0.0)) return Pixel::Zero();
+
+  // シャドウレイ(発光ポリゴン自身には当てない)
+  // TIPS:光源上の点には誤差があるので、距離に比例して手前で打ち切る
+  if (occluded(pos, light_vec, info, distance * (1.0 - 1e-4))) return Pixel::Zero();
+
+  // 面積あたりの確率密度を立体角あたりに変換
+  Real light_pdf = select_pdf / emitter->area * distance * distance / cos_light;
+  if (dtree && info.guiding->recording()) {
+    dtree->record(light_vec, luminance(emitter->radiance) / light_pdf, false);
+  }
+  return emitter->radiance * (cos_term / M_PI / light_pdf);
+}
+
+
+// 鏡面反射ベクトルを求める
+Vec3f reflection(const Vec3f& ray_vec, const Vec3f& normal) {
+  return toVec3f(reflect3(toSimd<Real>(ray_vec), toSimd<Real>(normal)));
+}
+
+// 屈折ベクトルと透過率を求める
+// 全反射の場合はfalseを返す
+bool refraction(Vec3f& refraction_vec, Real& transmittance,
+                const Vec3f& ray_vec, const Vec3f& normal, const Real ior) {
+  Real  refractive_index = ior;
+  Vec3f hit_normal       = normal;
+  Real F0;
+
+  // レイと法線との内積 >= 0 →透過物体から出る
+  if (ray_vec.dot(hit_normal) >= 0.0) {
+    // 反射量
+    F0 = std::pow(refractive_index - 1.0, 2.0) / std::pow(refractive_index + 1.0, 2.0);
+
+    hit_normal = -hit_normal;
+  }
+  else {
+    // 反射量
+    F0 = std::pow(1.0 - refractive_index, 2.0) / std::pow(1.0 + refractive_index, 2.0);
+
+    // Cheetah3Dの屈折率は素材の値なので、入射の場合、真空(1.0)との比にする
+    refractive_index = 1 / refractive_index;
+  }
+
+  // 全反射??
+  Real ddn = ray_vec.dot(hit_normal);
+  Real cos2t = 1.0 - refractive_index * refractive_index * (1.0 - ddn * ddn);
+  if (cos2t < 0.0) return false;
+
+  Vec4r refracted;
+  refract3(refracted, toSimd<Real>(ray_vec), toSimd<Real>(hit_normal), refractive_index);
+  refraction_vec = toVec3f(refracted);
+
+  // 屈折後の光の量
+  Real Re = F0 + (1.0 - F0) * std::pow(1.0 + ddn, 5.0);
+  transmittance = 1.0 - Re;
+
+  return true;
+}
+
+
+// 鏡面反射と屈折を経由して拡散反射面に届いたフォトンを集める
+void tracePhoton(std::vector<PhotonMap::Photon>& photons,
+                 Vec3f ray_start, Vec3f ray_vec, Pixel power,
+                 const RenderInfo& info,
+                 Qmc& random) {
+  bool back_face = false;
+  bool specular  = false;
+
+  for (int depth = 0; depth <= info.recursive_depth; ++depth) {
+    Bvh::TestInfo test_info;
+    if (!intersect(test_info, ray_start, ray_vec, back_face, info)) return;
+
+    const auto& material = *test_info.material;
+
+    // 鏡面反射か屈折を経由していればコースティクス
+    if (specular && !material.diffuse().isZero()) {
+      photons.push_back({ test_info.hit_pos, ray_vec, power });
+    }
+
+    // 鏡面反射か屈折をロシアンルーレットで選ぶ
+    // 拡散反射は通常のパストレースで扱うので、ここで追跡を終える
+    Real reflect_value = material.reflective().maxCoeff();
+    Real refract_value = material.transparent().maxCoeff();
+    if ((reflect_value + refract_value) > 1.0) {
+      Real total = reflect_value + refract_value;
+      reflect_value /= total;
+      refract_value /= total;
+    }
+
+    Real u = random.next();
+    if (u < reflect_value) {
+      power *= material.reflective() / reflect_value;
+      ray_vec = reflection(ray_vec, test_info.hit_normal);
+      back_face = false;
+    }
+    else if (u < (reflect_value + refract_value)) {
+      Vec3f refraction_vec;
+      Real  transmittance;
+      if (refraction(refraction_vec, transmittance, ray_vec, test_info.hit_normal, material.ior())) {
+        power *= material.transparent() * transmittance / refract_value;
+        ray_vec = refraction_vec;
+        back_face = true;
+      }
+      else {
+        power *= material.transparent() / refract_value;
+        ray_vec = reflection(ray_vec, test_info.hit_normal);
+        back_face = false;
+      }
+    }
+    else {
+      return;
+    }
+
+    // TIPS:ベクトルが同じ場所に衝突しないように少しずらしておく
+    ray_start = spawnPosition(test_info, ray_vec);
+    specular = true;
+  }
+}
+
+// 発光ポリゴンと環境マップからフォトンを飛ばす
+void shootPhotons(const RenderInfo& info, const int pass) {
+  auto& photon_map = *info.photon_map;
+  const int photon_num = photon_map.photonNum();
+
+  // 光源の全放射量(輝度)に比例して、環境マップか発光ポリゴンを選ぶ
+  const auto& target = photon_map.target();
+  Real target_area = M_PI * target.radius * target.radius;
+  Real env_power   = info.bg.integral() * target_area;
+  Real total_power = env_power + photon_map.emitterPower();
+  if (total_power <= 0.0) return;
+  Real env_select = env_power / total_power;
+
+  std::vector<PhotonMap::Photon> photons;
+
+  for (int i = 0; i < photon_num; ++i) {
+    Qmc random(i + pass * photon_num);
+
+    if (random.next() < env_select) {
+      // 環境マップ
+      // 鏡面・屈折物体を囲う球を覆う円盤から、平行光として飛ばす
+      const Real u1 = random.next();
+      const Real u2 = random.next();
+      Vec3f light_vec;
+      Real  light_pdf;
+      Pixel light = info.bg.sample(light_vec, light_pdf, u1, u2);
+      if (light_pdf <= 0.0) continue;
+
+      Vec3f u = (std::abs(light_vec.y()) < 0.9) ? Vec3f::UnitY().cross(light_vec).normalized()
+                                                : Vec3f::UnitX().cross(light_vec).normalized();
+      Vec3f v = light_vec.cross(u);
+
+      const Real u3 = random.next();
+      const Real u4 = random.next();
+      Vec2f disk = concentricSampleDisk(u3, u4) * target.radius;
+      Vec3f start = target.point + light_vec * target.radius + u * disk.x() + v * disk.y();
+
+      Pixel power = light * target_area / (light_pdf * env_select * photon_num);
+      tracePhoton(photons, start, -light_vec, power, info, random);
+    }
+    else {
+      // 発光ポリゴン
+      Real select_pdf;
+      const auto* emitter = photon_map.sampleEmitter(select_pdf, random.next());
+      if (!emitter) continue;
+
+      const Real u1 = random.next();
+      const Real u2 = random.next();
+      Real su = std::sqrt(u1);
+      const auto& t = emitter->triangle;
+      Vec3f start = t.a * (1.0 - su) + t.b * (su * (1.0 - u2)) + t.c * (su * u2);
+      Vec3f vec = radiationVector_qmc(emitter->normal, random);
+
+      // 拡散発光なので、cos分布で飛ばすと放射量は 輝度 * 面積 * π
+      Pixel power = emitter->radiance * emitter->area * M_PI
+                  / (select_pdf * (1.0 - env_select) * photon_num);
+      tracePhoton(photons, offsetRayOrigin(start, emitter->normal), vec, power, info, random);
+    }
+  }
+
+  photon_map.build(photons);
+}
+
+
 // 該当位置の色を求める
+// cone        光線の広がり
+// bsdf_pdf    拡散反射でレイを選んだ時の確率密度(それ以外は0)
+// diffuse_path これまでに拡散反射を経由したか
 Pixel rayTrace(const Vec3f ray_start, const Vec3f ray_vec,
+               const RayCone& cone,
                const int recursive_depth,
-               const int recursive_depth_max,
                const bool back_face,
-               const Model& model,
-               const Bvh::BvhNode& bvh_node,
-               const Hdri& bg,
+               const Real bsdf_pdf,
+               const bool diffuse_path,
+               const RenderInfo& info,
                Qmc& random) {
 
+  // 拡散反射→鏡面反射・屈折→光源 の経路はフォトンマップで計算済み
+  bool caustic_path = info.photon_map && diffuse_path && (bsdf_pdf <= 0.0);
+
   // BVHによるRayとMeshの交差判定
   Bvh::TestInfo test_info;
-  bool has_hit = Bvh::intersect(test_info, ray_start, ray_vec, bvh_node, back_face);
+  bool has_hit = intersect(test_info, ray_start, ray_vec, back_face, info);
 
   // 接触なし
   if (!has_hit) {
+    if (caustic_path) return Pixel::Zero();
+
     // 環境マップのピクセルを使う
-    Real thera = std::acos(ray_vec.y());
-    Real l = std::sqrt(ray_vec.x() * ray_vec.x() + ray_vec.z() * ray_vec.z());
-    Real xz = (l > 0.0) ? ray_vec.x() / l : 0.0;
-    Real phi = std::acos(xz);
-    if (ray_vec.z() < 0.0) {
-      phi = 2.0 * M_PI - phi;
-    }
+    // TIPS:無限遠なので、広がり角だけで縮小画像を選ぶ
+    Pixel bg_pixel = info.bg.pixel(ray_vec, info.bg.lod(cone.spread));
 
-    Real u = phi / (2.0 * M_PI) + 0.25;
-    Real v = thera / M_PI;
-    
-    return bg.pixel(u, v);
+    // 拡散反射からのレイは、環境マップの重点サンプリングとMISで合成する
+    if (bsdf_pdf > 0.0) {
+      bg_pixel *= misWeight(bsdf_pdf, info.bg.pdf(ray_vec));
+    }
+    return bg_pixel;
   }
 
   const auto& material = *test_info.material;
 
+  // 拡散反射からのレイが発光ポリゴンに当たった場合は、直接光として
+  // sampleEmitterで計算済み
+  Pixel emission = (((bsdf_pdf > 0.0) && (info.light_tree.power > 0.0)) || caustic_path) ? Pixel(Pixel::Zero())
+                                                                                         : material.emission();
+
   // 再帰上限を超えた
-  // FIXME:emissiveはツールで0.0~1.0の範囲でしか設定できないので、ここで大きな値にする
-  if (recursive_depth > recursive_depth_max) {
-    return material.emissive() * 100;
+  if (recursive_depth > info.recursive_depth) {
+    return emission;
   }
 
+  // 鏡面反射と屈折は広がり角をそのまま引き継ぐ
+  Real hit_width = cone.widthAt(test_info.distance);
+  RayCone specular_cone{ hit_width, cone.spread };
+
   // 鏡面反射を再帰で求める
   Pixel reflection_pixel(Pixel::Zero());
   if (!material.reflective().isZero()) {
-    Vec3f reflection_vec = reflectVec(ray_vec, test_info.hit_normal);
-    // TIPS:ベクトルが同じ場所に衝突しないように少し進めておく
-    Vec3f reflection_start = (test_info.hit_pos + reflection_vec * 0.001);
+    Vec3f reflection_vec = reflection(ray_vec, test_info.hit_normal);
+    // TIPS:ベクトルが同じ場所に衝突しないように少しずらしておく
+    Vec3f reflection_start = spawnPosition(test_info, reflection_vec);
 
     reflection_pixel = rayTrace(reflection_start, reflection_vec,
+                                specular_cone,
                                 recursive_depth + 1,
-                                recursive_depth_max,
                                 false,
-                                model,
-                                bvh_node,
-                                bg,
+                                0.0,
+                                diffuse_path,
+                                info,
                                 random);
   }
 
   // 屈折を再帰で求める
   Pixel refraction_pixel(Pixel::Zero());
   if (!material.transparent().isZero()) {
-    Real  refractive_index     = material.ior();
-    Vec3f hit_normal           = test_info.hit_normal;
-    bool  refraction_back_face = true;
-    Real F0;
-
-    // レイと法線との内積 >= 0 →透過物体から出る
-    if (ray_vec.dot(hit_normal) >= 0.0) {
-      // 反射量
-      F0 = std::pow(refractive_index - 1.0, 2.0) / std::pow(refractive_index + 1.0, 2.0);
-
-      hit_normal = -hit_normal;
-    }
-    else {
-      // 反射量
-      F0 = std::pow(1.0 - refractive_index, 2.0) / std::pow(1.0 + refractive_index, 2.0);
-
-      // Cheetah3Dの屈折率は素材の値なので、入射の場合、真空(1.0)との比にする
-      refractive_index = 1 / refractive_index;
-    }
-
-    // 全反射??
-    Real ddn = ray_vec.dot(hit_normal);
-    Real cos2t = 1.0 - refractive_index * refractive_index * (1.0 - ddn * ddn);
-    if (cos2t < 0.0) {
-      Vec3f reflection_vec = reflectVec(ray_vec, test_info.hit_normal);
-
-      // TIPS:ベクトルが同じ場所に衝突しないように少し進めておく
-      Vec3f reflection_start = (test_info.hit_pos + reflection_vec * 0.001);
+    Vec3f refraction_vec;
+    Real  transmittance;
+    if (!refraction(refraction_vec, transmittance, ray_vec, test_info.hit_normal, material.ior())) {
+      // 全反射
+      Vec3f reflection_vec = reflection(ray_vec, test_info.hit_normal);
+
+      // TIPS:ベクトルが同じ場所に衝突しないように少しずらしておく
+      Vec3f reflection_start = spawnPosition(test_info, reflection_vec);
       
       refraction_pixel = rayTrace(reflection_start, reflection_vec,
+                                  specular_cone,
                                   recursive_depth + 1,
-                                  recursive_depth_max,
                                   false,
-                                  model,
-                                  bvh_node,
-                                  bg,
+                                  0.0,
+                                  diffuse_path,
+                                  info,
                                   random);
     }
     else {
-      Vec3f refraction_vec = refractVec(ray_vec, hit_normal, refractive_index);
-      // TIPS:屈折ベクトルが同じ場所に衝突しないようにちょこっとだけ進めておく
-      Vec3f refraction_start = (test_info.hit_pos + refraction_vec * 0.001);
+      // TIPS:屈折ベクトルが同じ場所に衝突しないように面の反対側へずらしておく
+      Vec3f refraction_start = spawnPosition(test_info, refraction_vec);
 
-      // 屈折後の光の量
-      Real Re = F0 + (1.0 - F0) * std::pow(1.0 + ddn, 5.0);
-      Real Tr = 1.0 - Re;
-      
       refraction_pixel = rayTrace(refraction_start, refraction_vec,
+                                  specular_cone,
                                   recursive_depth + 1,
-                                  recursive_depth_max,
-                                  refraction_back_face,
-                                  model,
-                                  bvh_node,
-                                  bg,
-                                  random) * Tr;
+                                  true,
+                                  0.0,
+                                  diffuse_path,
+                                  info,
+                                  random) * transmittance;
     }
   }
 
+  // 拡散反射の色(テクスチャがあれば置き換える)
+  Pixel diffuse_color = material.diffuse();
+  if (info.use_texture && material.hasTexture()) {
+    const auto& texture = material.texture();
+    Real cos_term = std::abs(test_info.hit_geometric_normal.dot(ray_vec));
+    Real lod = (cos_term > 0.0) ? texture.lod(test_info.hit_uv_density, hit_width / cos_term) : 0.0;
+    diffuse_color = texture.pixel(test_info.hit_uv.x(), test_info.hit_uv.y(), lod);
+  }
+
   // 拡散反射
   Pixel light_diffuse = Pixel::Zero();
-  if (!material.diffuse().isZero()) {
-    // TIPS:ベクトルが同じ場所に衝突しないように少し浮かせる
-    Vec3f passtarce_start(test_info.hit_pos + test_info.hit_normal * 0.001);
-    Vec3f passtarce_vec = radiationVector_qmc(test_info.hit_normal, random);
-
-    light_diffuse = rayTrace(passtarce_start, passtarce_vec,
-                             recursive_depth + 1,
-                             recursive_depth_max,
-                             false,
-                             model,
-                             bvh_node,
-                             bg,
-                             random);
+  if (!diffuse_color.isZero()) {
+    // TIPS:ベクトルが同じ場所に衝突しないように法線の側へ少し浮かせる
+    Vec3f passtarce_start = spawnPosition(test_info, test_info.hit_normal);
+
+    // 二回目以降の拡散反射はキャッシュを使う
+    bool use_cache = info.radiance_cache && diffuse_path;
+    if (!use_cache || !info.radiance_cache->lookup(light_diffuse, test_info.hit_pos, test_info.hit_normal)) {
+      // ガイディングの分布とcos分布のどちらかで方向を選ぶ
+      DTree* dtree = info.guiding ? &info.guiding->dtree(test_info.hit_pos) : nullptr;
+      Real guide_fraction = (dtree && dtree->valid()) ? info.guiding->guideFraction() : 0.0;
+
+      // 環境マップと発光ポリゴンからの直接光
+      light_diffuse = sampleEnvironment(passtarce_start, test_info.hit_normal, dtree, guide_fraction, info, random)
+                    + sampleEmitter(passtarce_start, test_info.hit_normal, dtree, info, random);
+
+      // フォトンマップからコースティクス
+      if (info.photon_map) {
+        light_diffuse += info.photon_map->irradiance(test_info.hit_pos, test_info.hit_normal) / M_PI;
+      }
+
+      Vec3f passtarce_vec;
+      if ((guide_fraction > 0.0) && (random.next() < guide_fraction)) {
+        const Real u1 = random.next();
+        const Real u2 = random.next();
+        passtarce_vec = dtree->sample(u1, u2);
+      }
+      else {
+        passtarce_vec = radiationVector_qmc(test_info.hit_normal, random);
+      }
+
+      Real cos_term = std::max(test_info.hit_normal.dot(passtarce_vec), Real(0.0));
+      Real passtarce_pdf = diffusePdf(test_info.hit_normal, passtarce_vec, dtree, guide_fraction);
+
+      if ((cos_term > 0.0) && (passtarce_pdf > 0.0)) {
+        // TIPS:拡散反射した光線は粗い縮小画像で足りる
+        RayCone diffuse_cone{ hit_width, std::max(cone.spread, info.diffuse_spread) };
+        Pixel light = rayTrace(passtarce_start, passtarce_vec,
+                               diffuse_cone,
+                               recursive_depth + 1,
+                               false,
+                               passtarce_pdf,
+                               true,
+                               info,
+                               random);
+        light_diffuse += light * (cos_term / M_PI / passtarce_pdf);
+
+        // 入射光の分布を学習
+        if (dtree && info.guiding->recording()) {
+          dtree->record(passtarce_vec, luminance(light) / passtarce_pdf);
+        }
+      }
+
+      if (use_cache) info.radiance_cache->record(test_info.hit_pos, test_info.hit_normal, light_diffuse);
+    }
   }
   
   Real reflect_value = 1.0 - material.reflective().maxCoeff();
   Real refract_value = 1.0 - material.transparent().maxCoeff();
 
-  Pixel diffuse_color = material.diffuse();
-#if 0
-  if (material.hasTexture()) {
-    Real u = test_info.hit_uv.x();
-    Real v = test_info.hit_uv.y();
-    
-    diffuse_color = material.texture().pixel(u, v);
-  }
-#endif
-
   return diffuse_color * light_diffuse * reflect_value * refract_value
        + material.reflective() * reflection_pixel
        + material.transparent() * refraction_pixel
-       + material.emissive() * 100;
-}
-
-
-// レンダリング用の情報
-struct RenderInfo {
-  Vec2i size;
-
-  std::vector<GLint> viewport;
-
-  Camera3D camera;
-  Pixel ambient;
-  std::vector<Light> lights;
-  Model model;
-  Bvh::BvhNode bvh_node;
-
-  Hdri bg;
-
-  int subpixel_num;
-  int sample_num;
-  int recursive_depth;
-
-  Real focal_distance;
-  Real lens_radius;
-  
-  Real exposure;
-
-
-  RenderInfo(const int width, const int height,
-             const std::vector<GLint>& src_viewport,
-             const Camera3D& src_camera,
-             const Pixel& src_ambient,
-             const std::vector<Light>& src_lights,
-             const Model& src_model,
-             const std::string& bg_path,
-             const int src_subpixel_num,
-             const int src_sample_num,
-             const int src_recursive_depth,
-             const Real src_focal_distance,
-             const Real src_lens_radius,
-             const Real src_exposure) :
-    size(width, height),
-    viewport(src_viewport),
-    camera(src_camera),
-    ambient(src_ambient),
-    lights(src_lights),
-    model(src_model),
-    bvh_node(Bvh::createFromModel(src_model)),
-    bg(bg_path),
-    subpixel_num(src_subpixel_num),
-    sample_num(src_sample_num),
-    recursive_depth(src_recursive_depth),
-    focal_distance(src_focal_distance),
-    lens_radius(src_lens_radius),
-    exposure(src_exposure)
-  { }
-};
-
-
-// 露出計算
-// exposure 露出値(マイナス値)
-Real expose(const Real light, const Real exposure) {
-  return 1.0 - std::exp(light * exposure);
+       + emission;
 }
 
 
-bool render(std::shared_ptr<std::vector<u_char> > row_image,
+bool render(std::shared_ptr<SharedImage> row_image,
             std::shared_ptr<RenderInfo> info) {
   bool do_dof = info->lens_radius > 0.0;
 
@@ -378,74 +725,148 @@ bool render(std::shared_ptr<std::vector<u_char> > row_image,
   Vec3f to_far_z = info->camera.posToWorld(Vec3f(info->size.x() / 2, info->size.y() / 2, 1.0),
                                            Affinef::Identity(), info->viewport);
   to_far_z.normalize();
-  
-  for (int iy = 0; iy < info->size.y(); ++iy) {
-    std::vector<Pixel> image(info->size.x());
 
-    for (int ix = 0; ix < info->size.x(); ++ix) {
-      Pixel sub_pixel = Pixel::Zero();
+  // カメラの光線の広がり角(画面中央の1ピクセルが張る角度)
+  Real pixel_spread = 0.0;
+  if (info->ray_cone) {
+    auto pixel_vec = [&info](const Real x, const Real y) {
+      Vec3f start = info->camera.posToWorld(Vec3f(x, y, 0.0), Affinef::Identity(), info->viewport);
+      Vec3f end   = info->camera.posToWorld(Vec3f(x, y, 1.0), Affinef::Identity(), info->viewport);
+      return Vec3f((end - start).normalized());
+    };
+    Real cx = info->size.x() / 2;
+    Real cy = info->size.y() / 2;
+    pixel_spread = (pixel_vec(cx + 1.0, cy) - pixel_vec(cx, cy)).norm();
+  }
+  const RayCone camera_cone{ 0.0, pixel_spread };
+
+  // パスごとのサンプル範囲
+  // ガイディングを使う場合は、サンプル数を1, 2, 4...と倍にしながら学習し、
+  // 残りを1パスでまとめてレンダリングする
+  std::vector<std::pair<int, int> > passes;
+  {
+    int training_passes = info->guiding ? info->guiding_passes : 0;
+    int begin = 0;
+    for (int k = 0; (k < training_passes) && (begin < info->sample_num); ++k) {
+      int end = std::min(begin + (1 << k), info->sample_num);
+      passes.push_back(std::make_pair(begin, end));
+      begin = end;
+    }
+    if (info->photon_map) {
+      // フォトンマップの半径を縮めながら、1サンプルずつレンダリングする
+      for (; begin < info->sample_num; ++begin) {
+        passes.push_back(std::make_pair(begin, begin + 1));
+      }
+    }
+    else if (begin < info->sample_num) {
+      passes.push_back(std::make_pair(begin, info->sample_num));
+    }
+  }
+
+  // パスをまたいで結果を積算する
+  std::vector<Pixel> accum(info->size.x() * info->size.y(), Pixel::Zero());
+
+  // 統計は数パスごとにまとめて出力する
+  // TIPS:コースティクスを使う時は1サンプルごとのパスになるので、毎回出すと多すぎる
+  const size_t report_interval = std::max(passes.size() / 8, size_t(1));
+
+  for (size_t pass = 0; pass < passes.size(); ++pass) {
+    const int sample_begin = passes[pass].first;
+    const int sample_end   = passes[pass].second;
+
+    if (info->photon_map) shootPhotons(*info, int(pass));
+
+    for (int iy = 0; iy < info->size.y(); ++iy) {
+      std::vector<Pixel> image(info->size.x());
+
+      for (int ix = 0; ix < info->size.x(); ++ix) {
+        Pixel sub_pixel = Pixel::Zero();
       
-      for (int i = 0; i < info->subpixel_num; ++i) {
+        for (int i = 0; i < info->subpixel_num; ++i) {
 
-        for (int h = 0; h < info->sample_num; ++h) {
-          // １ピクセル内で乱数が完結するよう調節
-          Qmc render_random(h + i * info->sample_num + (ix + iy * info->size.x()) * (info->sample_num * info->subpixel_num));
+          for (int h = sample_begin; h < sample_end; ++h) {
+            // １ピクセル内で乱数が完結するよう調節
+            Qmc render_random(h + i * info->sample_num + (ix + iy * info->size.x()) * (info->sample_num * info->subpixel_num));
           
-          Real r1 = 2.0 * render_random.next();
-          Real r2 = 2.0 * render_random.next();
+            Real r1 = 2.0 * render_random.next();
+            Real r2 = 2.0 * render_random.next();
         
-          Real x = ix + ((r1 < 1.0) ? std::sqrt(r1) - 1.0 : 1.0 - std::sqrt(2.0 - r1));
-          Real y = iy + ((r2 < 1.0) ? std::sqrt(r2) - 1.0 : 1.0 - std::sqrt(2.0 - r2));
+            Real x = ix + ((r1 < 1.0) ? std::sqrt(r1) - 1.0 : 1.0 - std::sqrt(2.0 - r1));
+            Real y = iy + ((r2 < 1.0) ? std::sqrt(r2) - 1.0 : 1.0 - std::sqrt(2.0 - r2));
         
-          // 画面最前→最奥へ伸びる線分を計算
-          Vec3f ray_start = info->camera.posToWorld(Vec3f(x, y, 0.0),
+            // 画面最前→最奥へ伸びる線分を計算
+            Vec3f ray_start = info->camera.posToWorld(Vec3f(x, y, 0.0),
+                                                      Affinef::Identity(), info->viewport);
+            Vec3f ray_end = info->camera.posToWorld(Vec3f(x, y, 1.0),
                                                     Affinef::Identity(), info->viewport);
-          Vec3f ray_end = info->camera.posToWorld(Vec3f(x, y, 1.0),
-                                                  Affinef::Identity(), info->viewport);
 
-          Vec3f ray_vec = (ray_end - ray_start).normalized();
+            Vec3f ray_vec = (ray_end - ray_start).normalized();
           
-          if (do_dof) {
-            // レンズの屈折をシミュレーション(被写界深度)
-            // SOURCE:https://github.com/githole/simple-pathtracer/tree/simple-pathtracer-DOF
-
-            // フォーカスが合う位置
-            Real ft = std::abs(info->focal_distance / to_far_z.dot(ray_vec));
-            Vec3f focus_pos = ray_start + ray_vec * ft;
-
-            // 適当に決めたレンズの通過位置とフォーカスが合う位置からRayを作り直す(屈折効果)
-            Vec2f lens = concentricSampleDisk(render_random.next(), render_random.next()) * info->lens_radius;
-            ray_start.x() += lens.x();
-            ray_start.y() += lens.y();
-            ray_vec = (focus_pos - ray_start).normalized();
-          }
+            if (do_dof) {
+              // レンズの屈折をシミュレーション(被写界深度)
+              // SOURCE:https://github.com/githole/simple-pathtracer/tree/simple-pathtracer-DOF
+
+              // フォーカスが合う位置
+              Real ft = std::abs(info->focal_distance / to_far_z.dot(ray_vec));
+              Vec3f focus_pos = ray_start + ray_vec * ft;
+
+              // 適当に決めたレンズの通過位置とフォーカスが合う位置からRayを作り直す(屈折効果)
+              Vec2f lens = concentricSampleDisk(render_random.next(), render_random.next()) * info->lens_radius;
+              ray_start.x() += lens.x();
+              ray_start.y() += lens.y();
+              ray_vec = (focus_pos - ray_start).normalized();
+            }
           
-          sub_pixel += rayTrace(ray_start, ray_vec,
-                                0,
-                                info->recursive_depth,
-                                false,
-                                info->model,
-                                info->bvh_node,
-                                info->bg,
-                                render_random);
+            sub_pixel += rayTrace(ray_start, ray_vec,
+                                  camera_cone,
+                                  0,
+                                  false,
+                                  0.0,
+                                  false,
+                                  *info,
+                                  render_random);
+          }
+        }
+        auto& pixel = accum[ix + iy * info->size.x()];
+        pixel += sub_pixel;
+        image[ix] = pixel / (sample_end * info->subpixel_num);
+      }
+
+      if (info->live) {
+        info->live->writeRow(iy, &accum[iy * info->size.x()], uint32_t(sample_end * info->subpixel_num));
+      }
+
+      {
+        // 1ライン毎に露出をかける前の値を書き込む
+        // TIPS:露出やトーンカーブは取り出す側で行う
+        std::vector<float> line(info->size.x() * 3);
+        float* dst = &line[0];
+        for (const auto& pixel : image) {
+          *dst++ = float(pixel.x());
+          *dst++ = float(pixel.y());
+          *dst++ = float(pixel.z());
         }
+
+        row_image->writeRow(iy, &line[0]);
       }
-      image[ix] = sub_pixel / (info->sample_num * info->subpixel_num);
     }
 
-    {
-      // 1ライン毎にイメージを生成
-      // 0.0~1.0のピクセルの値を0~255へ正規化
-      int index = iy * info->size.x() * 3;
-      Real exposure = info->exposure;
-      std::for_each(image.begin(), image.end(),
-                    [&row_image, &index, &exposure](const Pixel& pixel) {
-                      (*row_image)[index + 0] = expose(pixel.x(), exposure) * 255;
-                      (*row_image)[index + 1] = expose(pixel.y(), exposure) * 255;
-                      (*row_image)[index + 2] = expose(pixel.z(), exposure) * 255;
-                      index += 3;
-                    });
+    if (info->live) info->live->setSpp(uint32_t(sample_end * info->subpixel_num));
+
+    if (info->guiding && info->guiding->recording()) {
+      // 学習した分布を次のパスから使う
+      info->guiding->update();
+      if ((pass + 2) >= passes.size()) info->guiding->recording(false);
     }
+
+    if ((((pass + 1) % report_interval) == 0) || ((pass + 1) == passes.size())) {
+      if (info->photon_map) info->photon_map->reportStats();
+      if (info->radiance_cache) info->radiance_cache->reportStats();
+      if (info->chunks) info->chunks->reportStats();
+      TextureCache::instance().reportStats();
+    }
+
+    if (info->photon_map) info->photon_map->shrink();
   }
 
   return true;
@@ -0,0 +1,239 @@
+﻿
+#pragma once
+
+//
+// コースティクス用のフォトンマップ
+// 半径をパスごとに縮めながら密度推定する(Progressive Photon Mapping)
+// SOURCE:Progressive Photon Mapping: A Probabilistic Approach
+//        by Claude Knaus and Matthias Zwicker
+//
+
+#include "defines.hpp"
+#include <vector>
+#include <algorithm>
+#include "vector.hpp"
+#include "color.hpp"
+#include "collision.hpp"
+#include "model.hpp"
+#include "lightTree.hpp"
+#include "shape.hpp"
+#include "utils.hpp"
+
+
+namespace {
+
+class PhotonMap {
+public:
+  struct Photon {
+    Vec3f pos;
+    Vec3f vec;                                      // 進行方向
+    Pixel power;
+  };
+
+
+private:
+  // 空間ハッシュ
+  std::vector<Photon> photons_;
+  std::vector<u_int>  cell_start_;
+  u_int hash_mask_;
+  Real  cell_size_;
+
+  int  photon_num_;
+  Real radius_;
+  Real alpha_;
+  int  iteration_;
+
+  // フォトンを飛ばす光源
+  std::vector<const LightTree::Emitter*> emitters_;
+  std::vector<Real> emitter_cdf_;
+  Real emitter_power_;
+
+  // 環境マップからのフォトンは鏡面・屈折物体を囲う球に向けて飛ばす
+  SphereVolume target_;
+
+
+public:
+  // photon_num 1パスで飛ばすフォトンの数
+  // radius     最初のパスの収集半径
+  // alpha      パスごとに半径を縮める割合(0, 1)
+  PhotonMap(const int photon_num, const Real radius, const Real alpha,
+            const LightTree::LightNode& light_tree,
+            const SphereVolume& target) :
+    hash_mask_(0),
+    cell_size_(radius * 2),
+    photon_num_(photon_num),
+    radius_(radius),
+    alpha_(alpha),
+    iteration_(0),
+    emitter_power_(0.0),
+    target_(target)
+  {
+    collectEmitters(light_tree);
+
+    // 全放射量に比例して光源を選ぶ
+    emitter_cdf_.reserve(emitters_.size());
+    for (const auto* e : emitters_) {
+      emitter_power_ += e->power;
+      emitter_cdf_.push_back(emitter_power_);
+    }
+  }
+
+
+  int photonNum() const { return photon_num_; }
+  Real radius() const { return radius_; }
+  const SphereVolume& target() const { return target_; }
+
+  Real emitterPower() const { return emitter_power_; }
+
+  // 全放射量に比例して発光ポリゴンを選ぶ
+  const LightTree::Emitter* sampleEmitter(Real& pdf, const Real u) const {
+    if (emitters_.empty()) return nullptr;
+
+    auto it = std::upper_bound(emitter_cdf_.begin(), emitter_cdf_.end(), u * emitter_power_);
+    size_t index = std::min(size_t(it - emitter_cdf_.begin()), emitters_.size() - 1);
+
+    pdf = emitters_[index]->power / emitter_power_;
+    return emitters_[index];
+  }
+
+
+  // フォトンから空間ハッシュを生成
+  void build(std::vector<Photon>& photons) {
+    photons_.clear();
+    u_int hash_size = int2pow(std::max(int(photons.size()), 1));
+    hash_mask_ = hash_size - 1;
+    cell_size_ = radius_ * 2;
+
+    // ハッシュ値ごとに数えてから並べる
+    cell_start_.assign(hash_size + 1, 0);
+    for (const auto& p : photons) {
+      cell_start_[hash(cell(p.pos)) + 1] += 1;
+    }
+    for (u_int i = 0; i < hash_size; ++i) {
+      cell_start_[i + 1] += cell_start_[i];
+    }
+
+    std::vector<u_int> offset(cell_start_.begin(), cell_start_.end() - 1);
+    photons_.resize(photons.size());
+    for (const auto& p : photons) {
+      photons_[offset[hash(cell(p.pos))]++] = p;
+    }
+  }
+
+  // フォトン数と現在の半径を出力
+  void reportStats() const {
+    DOUT << "photon:" << photons_.size() << " radius:" << radius_ << std::endl;
+  }
+
+  // 次のパスに向けて半径を縮める
+  void shrink() {
+    iteration_ += 1;
+    radius_ *= std::sqrt((iteration_ + alpha_) / (iteration_ + 1));
+  }
+
+
+  // 点pos(法線normal)の放射照度を推定する
+  Pixel irradiance(const Vec3f& pos, const Vec3f& normal) const {
+    Pixel power = Pixel::Zero();
+    if (photons_.empty()) return power;
+
+    // 半径の範囲に入るセル(最大2x2x2)を調べる
+    Vec3i inf = cell(pos - Vec3f::Constant(radius_));
+    Vec3i sup = cell(pos + Vec3f::Constant(radius_));
+
+    // TIPS:別のセルが同じハッシュ値になる場合があるので、重複して数えないようにする
+    u_int visited[8];
+    int visited_num = 0;
+
+    Real radius2 = radius_ * radius_;
+    for (int z = inf.z(); z <= sup.z(); ++z) {
+      for (int y = inf.y(); y <= sup.y(); ++y) {
+        for (int x = inf.x(); x <= sup.x(); ++x) {
+          u_int h = hash(Vec3i(x, y, z));
+          if (std::find(visited, visited + visited_num, h) != (visited + visited_num)) continue;
+          visited[visited_num++] = h;
+
+          for (u_int i = cell_start_[h]; i < cell_start_[h + 1]; ++i) {
+            const auto& p = photons_[i];
+            if ((p.pos - pos).squaredNorm() > radius2) continue;
+            // 裏から来たフォトンは数えない
+            if (p.vec.dot(normal) >= 0.0) continue;
+
+            power += p.power;
+          }
+        }
+      }
+    }
+
+    return power / (M_PI * radius2);
+  }
+
+
+private:
+  using Vec3i = Eigen::Matrix<int, 3, 1>;
+
+  Vec3i cell(const Vec3f& pos) const {
+    return Vec3i(int(std::floor(pos.x() / cell_size_)),
+                 int(std::floor(pos.y() / cell_size_)),
+                 int(std::floor(pos.z() / cell_size_)));
+  }
+
+  u_int hash(const Vec3i& cell) const {
+    return ((u_int(cell.x()) * 73856093u) ^ (u_int(cell.y()) * 19349663u) ^ (u_int(cell.z()) * 83492791u)) & hash_mask_;
+  }
+
+  void collectEmitters(const LightTree::LightNode& node) {
+    if (node.power <= 0.0) return;
+
+    if (node.children.empty()) {
+      emitters_.push_back(&node.emitter);
+      return;
+    }
+    for (const auto& child : node.children) {
+      collectEmitters(child);
+    }
+  }
+
+};
+
+
+// 鏡面反射・屈折するポリゴンと形状を囲う球を求める
+// 該当するものが無ければfalse
+bool specularBounds(SphereVolume& bounds, const Model& model, const std::vector<Shape>& shapes) {
+  auto bbox = Bvh::emptyAABB();
+  bool found = false;
+
+  for (const auto& s : shapes) {
+    const auto& mat = s.material();
+    if (mat.reflective().isZero() && mat.transparent().isZero()) continue;
+
+    Vec3f inf;
+    Vec3f sup;
+    s.bounds(inf, sup);
+    bbox.inf = bbox.inf.cwiseMin(inf);
+    bbox.sup = bbox.sup.cwiseMax(sup);
+    found = true;
+  }
+
+  const auto& material = model.material();
+  for (const auto& m : model.mesh()) {
+    const auto& mat = material[m->materialIndex()];
+    if (mat.reflective().isZero() && mat.transparent().isZero()) continue;
+
+    for (u_int ip = 0; ip < m->faces(); ++ip) {
+      Triangle polygon = m->polygon(ip);
+      for (const auto* v : { &polygon.a, &polygon.b, &polygon.c }) {
+        bbox.inf = bbox.inf.cwiseMin(*v);
+        bbox.sup = bbox.sup.cwiseMax(*v);
+      }
+      found = true;
+    }
+  }
+  if (!found) return false;
+
+  bounds.point  = (bbox.inf + bbox.sup) / 2;
+  bounds.radius = (bbox.sup - bbox.inf).norm() / 2;
+  return true;
+}
+
+}
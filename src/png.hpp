@@ -201,7 +201,9 @@ public:
 };
 
 // RGB8で書き出し
-void WritePng(const std::string& path, const u_int width, const u_int height, u_char* image) {
+// compression_level zlibの圧縮レベル(0〜9、小さいほど速い)
+void WritePng(const std::string& path, const u_int width, const u_int height, u_char* image,
+              const int compression_level = Z_DEFAULT_COMPRESSION) {
   // 書き出しテーブルの用意
   // TIPS:上下を反転
 	std::vector<png_bytep> row_pointers(height);
@@ -219,6 +221,7 @@ void WritePng(const std::string& path, const u_int width, const u_int height, u_
 	}
 
 	png_init_io(png.hdl(), fp);
+	png_set_compression_level(png.hdl(), compression_level);
 
 	png_set_IHDR(png.hdl(), png.info(), width, height, 8,
 							 PNG_COLOR_TYPE_RGB,
@@ -0,0 +1,149 @@
+﻿
+#pragma once
+
+//
+// 表示用の変換(露出、トーンカーブ、sRGB、ディザ)
+// 露出をかける前のRGB(float)を1行ずつRGB8にする
+// TIPS:RGBの区別なく4要素ずつまとめて計算する
+//      レンダリングとは別に、途中経過や結果を取り出す時に行うので、
+//      露出やトーンカーブを変えてもレンダリングし直す必要は無い
+//
+
+#include "defines.hpp"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "simd.hpp"
+#include "random.hpp"
+
+
+namespace {
+
+struct PostProcess {
+  enum ToneCurve {
+    EXPONENTIAL,                                    // 1 - exp(light * exposure)
+    REINHARD,                                       // x / (1 + x)
+    ACES,                                           // ACES Filmicの近似
+    LINEAR,                                         // 1で切り捨てるだけ
+  };
+
+  // 露出値(マイナス値)
+  // TIPS:EXPONENTIAL以外は-exposure倍してからカーブに通す
+  Real exposure;
+  ToneCurve tone_curve;
+  // sRGBのガンマをかける
+  bool srgb;
+  // 8bitに丸める前にノイズを加えて、階調の段差を目立たなくする
+  bool dither;
+
+
+  PostProcess() :
+    exposure(-1.0),
+    tone_curve(EXPONENTIAL),
+    srgb(false),
+    dither(false)
+  {}
+
+
+  // 名前からトーンカーブを選ぶ(知らない名前はEXPONENTIAL)
+  static ToneCurve toneCurve(const std::string& name) {
+    if (name == "reinhard") return REINHARD;
+    if (name == "aces")     return ACES;
+    if (name == "linear")   return LINEAR;
+    if (name != "exponential") DOUT << "Unknown tone curve:" << name << std::endl;
+    return EXPONENTIAL;
+  }
+
+  // 1行分を変換する
+  // dst RGB8 x width
+  // src RGB(float) x width
+  // y   ディザの模様を選ぶ行番号
+  void applyRow(u_char* dst, const float* src, const int width, const int y) const {
+    using Vec4 = Simd4<float>;
+
+    const Vec4 zero(0.0f);
+    const Vec4 one(1.0f);
+    const Vec4 scale(float(-exposure));
+    // exp(x) = 2^(x * log2(e))
+    const Vec4 exp_scale(float(exposure * 1.44269504088896));
+
+    const float* noise = ditherRow(y);
+
+    auto convert = [&](const float* p, const size_t i) {
+      Vec4 x = max(Vec4::load(p), zero);
+
+      switch (tone_curve) {
+      case EXPONENTIAL:
+        x = one - exp2(x * exp_scale);
+        break;
+
+      case REINHARD:
+        x = x * scale;
+        x = x / (one + x);
+        break;
+
+      case ACES:
+        // SOURCE:Krzysztof Narkowicz "ACES Filmic Tone Mapping Curve"
+        x = x * scale;
+        x = (x * fmadd(x, Vec4(2.51f), Vec4(0.03f))) / fmadd(x, fmadd(x, Vec4(2.43f), Vec4(0.59f)), Vec4(0.14f));
+        break;
+
+      case LINEAR:
+        x = x * scale;
+        break;
+      }
+      x = min(x, one);
+
+      if (srgb) {
+        Vec4 curve = fmadd(exp2(log2(x) * Vec4(float(1.0 / 2.4))), Vec4(1.055f), Vec4(-0.055f));
+        x = selectLess(x, Vec4(0.0031308f), x * Vec4(12.92f), curve);
+      }
+
+      // TIPS:ディザが無い時は、これまでと同じく切り捨てる
+      //      ディザは切り捨てで平均が元の値になるようずらしてある
+      x = x * Vec4(255.0f);
+      if (noise) x = x + Vec4::load(&noise[i % DITHER_ROW]);
+      return x;
+    };
+
+    const size_t num = size_t(width) * 3;
+    size_t i = 0;
+    for (; (i + 4) <= num; i += 4) {
+      convert(&src[i], i).storeU8(&dst[i]);
+    }
+    if (i < num) {
+      // 端数は4要素に詰めてから計算する
+      float tail[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      u_char bytes[4];
+      std::copy(&src[i], &src[num], tail);
+      convert(tail, i).storeU8(bytes);
+      std::copy(bytes, bytes + (num - i), &dst[i]);
+    }
+  }
+
+
+private:
+  enum {
+    DITHER_SIZE = 64,                               // 模様の1辺のピクセル数
+    DITHER_ROW  = DITHER_SIZE * 3,                  // 1行の要素数(4の倍数)
+  };
+
+  // 三角分布のノイズ([-0.5, 1.5))を敷き詰める模様
+  // TIPS:毎回同じ模様にして、途中経過を並べてもちらつかないようにする
+  const float* ditherRow(const int y) const {
+    if (!dither) return nullptr;
+
+    static const std::vector<float> table = []() {
+      Random random;
+      std::vector<float> t(DITHER_ROW * DITHER_SIZE);
+      for (auto& v : t) {
+        v = float(random.fromZeroToOne() + random.fromZeroToOne() - 0.5);
+      }
+      return t;
+    }();
+    return &table[(y % DITHER_SIZE) * DITHER_ROW];
+  }
+
+};
+
+}
@@ -0,0 +1,158 @@
+﻿
+#pragma once
+
+//
+// 二回目以降の拡散反射で使う放射輝度キャッシュ
+// ワールド空間をボクセルに分け、法線の向きごとに入射光を平均する
+// ボクセルはハッシュテーブルに遅延して登録する
+//
+
+#include "defines.hpp"
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include "vector.hpp"
+#include "color.hpp"
+#include "utils.hpp"
+
+
+namespace {
+
+class RadianceCache {
+  struct Entry {
+    std::atomic<uint64_t> key;                      // 0は空き
+    std::atomic<float>    radiance[3];
+    std::atomic<u_int>    count;
+  };
+
+  std::unique_ptr<Entry[]> entries_;
+  u_int mask_;
+
+  Real  cell_size_;
+  u_int min_samples_;
+
+  // 統計
+  mutable std::atomic<u_int> queries_;
+  mutable std::atomic<u_int> hits_;
+
+  // 空きが見つからない場合に調べる最大数
+  enum { PROBE_NUM = 8 };
+
+
+public:
+  // cell_size   ボクセルの大きさ(小さいほど正確)
+  // min_samples 値を使い始めるまでのサンプル数(多いほどノイズが少ない)
+  // table_size  キャッシュの要素数(2のべき乗に切り上げる)
+  RadianceCache(const Real cell_size, const int min_samples, const int table_size) :
+    entries_(new Entry[int2pow(table_size)]),
+    mask_(int2pow(table_size) - 1),
+    cell_size_(cell_size),
+    min_samples_(std::max(min_samples, 1)),
+    queries_(0),
+    hits_(0)
+  {
+    for (u_int i = 0; i <= mask_; ++i) {
+      auto& e = entries_[i];
+      e.key = 0;
+      e.radiance[0] = 0.0f;
+      e.radiance[1] = 0.0f;
+      e.radiance[2] = 0.0f;
+      e.count = 0;
+    }
+
+    DOUT << "radiance cache:" << (mask_ + 1) * sizeof(Entry) / 1024 << "KB" << std::endl;
+  }
+
+
+  // 十分なサンプルが集まっていれば、その平均をradianceに返す
+  bool lookup(Pixel& radiance, const Vec3f& pos, const Vec3f& normal) const {
+    queries_.fetch_add(1, std::memory_order_relaxed);
+
+    const Entry* e = find(key(pos, normal));
+    if (!e) return false;
+
+    u_int count = e->count.load(std::memory_order_acquire);
+    if (count < min_samples_) return false;
+
+    radiance = Pixel(e->radiance[0].load(std::memory_order_relaxed),
+                     e->radiance[1].load(std::memory_order_relaxed),
+                     e->radiance[2].load(std::memory_order_relaxed)) / count;
+
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // 計算した値を追加する
+  // 複数のスレッドから同時に呼び出してもよい
+  void record(const Vec3f& pos, const Vec3f& normal, const Pixel& radiance) {
+    Entry* e = insert(key(pos, normal));
+    if (!e) return;
+
+    atomicAdd(e->radiance[0], float(radiance.x()));
+    atomicAdd(e->radiance[1], float(radiance.y()));
+    atomicAdd(e->radiance[2], float(radiance.z()));
+    e->count.fetch_add(1, std::memory_order_release);
+  }
+
+
+  // 統計を出力して数え直す
+  void reportStats() const {
+    u_int queries = queries_.exchange(0);
+    u_int hits    = hits_.exchange(0);
+    DOUT << "radiance cache hit:" << hits << "/" << queries << std::endl;
+  }
+
+
+private:
+  uint64_t key(const Vec3f& pos, const Vec3f& normal) const {
+    // 法線は一番大きな成分の軸と符号で6方向に分ける
+    int axis;
+    normal.cwiseAbs().maxCoeff(&axis);
+    uint64_t face = axis * 2 + ((normal(axis) < 0.0) ? 1 : 0);
+
+    uint64_t x = uint64_t(int64_t(std::floor(pos.x() / cell_size_))) & 0xfffff;
+    uint64_t y = uint64_t(int64_t(std::floor(pos.y() / cell_size_))) & 0xfffff;
+    uint64_t z = uint64_t(int64_t(std::floor(pos.z() / cell_size_))) & 0xfffff;
+
+    // TIPS:0は空きを表すので最上位ビットを立てておく
+    return (x | (y << 20) | (z << 40) | (face << 60)) | (uint64_t(1) << 63);
+  }
+
+  static u_int hash(uint64_t key) {
+    // SOURCE:splitmix64
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return u_int(key ^ (key >> 31));
+  }
+
+  const Entry* find(const uint64_t key) const {
+    u_int index = hash(key);
+    for (int i = 0; i < PROBE_NUM; ++i) {
+      const Entry& e = entries_[(index + i) & mask_];
+      uint64_t k = e.key.load(std::memory_order_acquire);
+      if (k == key) return &e;
+      if (k == 0) return nullptr;
+    }
+    return nullptr;
+  }
+
+  Entry* insert(const uint64_t key) {
+    u_int index = hash(key);
+    for (int i = 0; i < PROBE_NUM; ++i) {
+      Entry& e = entries_[(index + i) & mask_];
+      uint64_t k = e.key.load(std::memory_order_acquire);
+      if (k == 0) {
+        // 空きを確保(他のスレッドに先を越されたらその値を調べる)
+        uint64_t empty = 0;
+        if (e.key.compare_exchange_strong(empty, key, std::memory_order_acq_rel)) return &e;
+        k = empty;
+      }
+      if (k == key) return &e;
+    }
+    // キャッシュが一杯
+    return nullptr;
+  }
+
+};
+
+}
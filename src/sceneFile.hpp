@@ -0,0 +1,307 @@
+﻿
+#pragma once
+
+//
+// 変換済みシーンの書き出しと読み込み
+// Assimpで読み込んだシーンをバイナリ形式で保存しておき、
+// 次回からはファイルをメモリに割り当てて使う
+//
+
+#include "defines.hpp"
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <sys/stat.h>
+#include "sceneFormat.hpp"
+#include "sceneLoader.hpp"
+#include "os.hpp"
+
+
+namespace SceneFile {
+
+// 変換元ファイルの大きさと更新時刻
+bool sourceInfo(uint64_t& size, uint64_t& time, const std::string& path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) return false;
+
+  size = uint64_t(info.st_size);
+  time = uint64_t(info.st_mtime);
+  return true;
+}
+
+
+// 書き込み位置を境界に揃えて、その位置を返す
+uint64_t align(std::ofstream& fstr) {
+  uint64_t pos = uint64_t(fstr.tellp());
+  while (pos % SceneFormat::ALIGNMENT) {
+    fstr.put(0);
+    pos += 1;
+  }
+  return pos;
+}
+
+template <typename T>
+void writeArray(std::ofstream& fstr, const T* data, const size_t num) {
+  if (num) fstr.write(reinterpret_cast<const char*>(data), sizeof(T) * num);
+}
+
+template <typename T>
+void copyColor(float* dst, const T& color) {
+  dst[0] = color.x();
+  dst[1] = color.y();
+  dst[2] = color.z();
+}
+
+
+// 階層構造を親→子の順で並べる
+void collectNode(std::vector<SceneFormat::NodeRecord>& nodes, std::vector<u_int>& mesh_indexes,
+                 const Node& node) {
+  SceneFormat::NodeRecord record;
+  for (u_int i = 0; i < 16; ++i) {
+    record.matrix[i] = node.matrix().data()[i];
+  }
+  record.mesh_num  = u_int(node.meshIndexes().size());
+  record.child_num = u_int(node.childs().size());
+  nodes.push_back(record);
+
+  mesh_indexes.insert(mesh_indexes.end(), node.meshIndexes().begin(), node.meshIndexes().end());
+
+  for (const auto& child : node.childs()) {
+    collectNode(nodes, mesh_indexes, child);
+  }
+}
+
+
+// 書き出し
+// TIPS:途中で止まったファイルが残らないよう、別名で書き出してから名前を変える
+bool write(const std::string& path, const Scene& scene, const std::string& source_path) {
+  std::string temp_path = path + ".tmp";
+  std::ofstream fstr(temp_path, std::ios::binary);
+  if (!fstr) return false;
+
+  SceneFormat::Header header;
+  std::memset(&header, 0, sizeof(header));
+
+  header.magic   = SceneFormat::MAGIC;
+  header.version = SceneFormat::VERSION;
+  sourceInfo(header.source_size, header.source_time, source_path);
+
+  // カメラ
+  const auto& camera = scene.camera;
+  header.camera.fovy   = camera.fovy();
+  header.camera.near_z = camera.nearZ();
+  header.camera.far_z  = camera.farZ();
+  for (int i = 0; i < 3; ++i) {
+    header.camera.position[i] = camera.eyePosition()(i);
+  }
+  header.camera.rotate[0] = camera.rotate().w();
+  header.camera.rotate[1] = camera.rotate().x();
+  header.camera.rotate[2] = camera.rotate().y();
+  header.camera.rotate[3] = camera.rotate().z();
+
+  copyColor(header.ambient, scene.ambient);
+
+  // ヘッダは最後に書き直す
+  fstr.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  // ライト
+  header.light_num = u_int(scene.lights.size());
+  header.lights    = align(fstr);
+  for (const auto& light : scene.lights) {
+    SceneFormat::LightRecord record;
+    copyColor(record.diffuse, light.diffuse);
+    copyColor(record.position, light.position);
+    fstr.write(reinterpret_cast<const char*>(&record), sizeof(record));
+  }
+
+  // マテリアル
+  const auto& materials = scene.model.material();
+  header.material_num = u_int(materials.size());
+  header.materials    = align(fstr);
+  for (const auto& m : materials) {
+    SceneFormat::MaterialRecord record;
+    std::memset(&record, 0, sizeof(record));
+
+    copyColor(record.diffuse, m.diffuse());
+    copyColor(record.specular, m.specular());
+    record.shininess = m.shininess();
+    copyColor(record.emissive, m.emissive());
+    copyColor(record.reflective, m.reflective());
+    copyColor(record.transparent, m.transparent());
+    record.ior = m.ior();
+
+    if (m.hasTexture()) {
+      std::strncpy(record.texture, m.textureName().c_str(), SceneFormat::TEXTURE_NAME_LENGTH - 1);
+    }
+    fstr.write(reinterpret_cast<const char*>(&record), sizeof(record));
+  }
+
+  // メッシュ
+  // 頂点配列を書き出してから、位置を記録したMeshRecordを書く
+  const auto& meshes = scene.model.mesh();
+  std::vector<SceneFormat::MeshRecord> mesh_records;
+  for (const auto& m : meshes) {
+    SceneFormat::MeshRecord record;
+    std::memset(&record, 0, sizeof(record));
+
+    record.material_index = m->materialIndex();
+    record.has_normal     = m->hasNormal();
+    record.has_texture    = m->hasTexture();
+    record.vertex_num     = m->vertices();
+    record.face_num       = m->faces();
+
+    record.positions = align(fstr);
+    writeArray(fstr, m->positions(), m->vertices());
+    record.normals = align(fstr);
+    writeArray(fstr, m->normals(), m->vertices());
+    if (m->hasTexture()) {
+      record.uvs = align(fstr);
+      writeArray(fstr, m->uvs(), m->vertices());
+    }
+    record.faces = align(fstr);
+    writeArray(fstr, m->indices(), m->faces());
+
+    mesh_records.push_back(record);
+  }
+  header.mesh_num = u_int(mesh_records.size());
+  header.meshes   = align(fstr);
+  writeArray(fstr, mesh_records.data(), mesh_records.size());
+
+  // 階層構造
+  std::vector<SceneFormat::NodeRecord> nodes;
+  std::vector<u_int> mesh_indexes;
+  collectNode(nodes, mesh_indexes, scene.model.rootNode());
+
+  header.node_num = u_int(nodes.size());
+  header.nodes    = align(fstr);
+  writeArray(fstr, nodes.data(), nodes.size());
+
+  header.node_mesh_num = u_int(mesh_indexes.size());
+  header.node_meshes   = align(fstr);
+  writeArray(fstr, mesh_indexes.data(), mesh_indexes.size());
+
+  fstr.seekp(0);
+  fstr.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  fstr.close();
+
+  if (!fstr || (std::rename(temp_path.c_str(), path.c_str()) != 0)) {
+    std::remove(temp_path.c_str());
+    return false;
+  }
+
+  DOUT << "write scene:" << path << std::endl;
+
+  return true;
+}
+
+
+// 配列がファイルに収まっているか
+template <typename T>
+bool inFile(const MappedFile& file, const uint64_t offset, const uint64_t num) {
+  const uint64_t size = file.size();
+  return !(offset % SceneFormat::ALIGNMENT)
+      && (offset <= size) && (num <= (size - offset) / sizeof(T));
+}
+
+// 各セクションがファイルに収まり、番号が範囲内か調べる
+// TIPS:頂点配列の中身には触れない(読み込まないメッシュをメモリに載せないため)
+bool isValid(const MappedFile& file) {
+  if (!file.valid() || (file.size() < sizeof(SceneFormat::Header))) return false;
+
+  const u_char* data = file.data();
+  const auto& header = *SceneFormat::pointer<SceneFormat::Header>(data, 0);
+
+  if (!inFile<SceneFormat::LightRecord>(file, header.lights, header.light_num)
+      || !inFile<SceneFormat::MaterialRecord>(file, header.materials, header.material_num)
+      || !inFile<SceneFormat::MeshRecord>(file, header.meshes, header.mesh_num)
+      || !inFile<SceneFormat::NodeRecord>(file, header.nodes, header.node_num)
+      || !inFile<u_int>(file, header.node_meshes, header.node_mesh_num)) return false;
+
+  const auto* materials = SceneFormat::pointer<SceneFormat::MaterialRecord>(data, header.materials);
+  for (u_int i = 0; i < header.material_num; ++i) {
+    if (!std::memchr(materials[i].texture, 0, SceneFormat::TEXTURE_NAME_LENGTH)) return false;
+  }
+
+  const auto* meshes = SceneFormat::pointer<SceneFormat::MeshRecord>(data, header.meshes);
+  for (u_int i = 0; i < header.mesh_num; ++i) {
+    const auto& m = meshes[i];
+    if ((m.material_index >= header.material_num)
+        || !inFile<Mesh::Vtx>(file, m.positions, m.vertex_num)
+        || !inFile<Mesh::Vtx>(file, m.normals, m.vertex_num)
+        || (m.has_texture && !inFile<Mesh::Uv>(file, m.uvs, m.vertex_num))
+        || !inFile<Mesh::Face>(file, m.faces, m.face_num)) return false;
+  }
+
+  // 親→子の順に並んでいるので、子の数の合計はノード数より1少ない
+  if (!header.node_num) return false;
+  const auto* nodes = SceneFormat::pointer<SceneFormat::NodeRecord>(data, header.nodes);
+  uint64_t child_num = 0;
+  uint64_t mesh_num  = 0;
+  for (u_int i = 0; i < header.node_num; ++i) {
+    child_num += nodes[i].child_num;
+    mesh_num  += nodes[i].mesh_num;
+  }
+  if ((child_num != header.node_num - 1) || (mesh_num != header.node_mesh_num)) return false;
+
+  const auto* node_meshes = SceneFormat::pointer<u_int>(data, header.node_meshes);
+  for (u_int i = 0; i < header.node_mesh_num; ++i) {
+    if (node_meshes[i] >= header.mesh_num) return false;
+  }
+
+  return true;
+}
+
+
+// 変換元から作り直されたファイルか調べる
+bool isLatest(const MappedFile& file, const std::string& source_path) {
+  if (!isValid(file)) return false;
+
+  const auto& header = *SceneFormat::pointer<SceneFormat::Header>(file.data(), 0);
+  if ((header.magic != SceneFormat::MAGIC) || (header.version != SceneFormat::VERSION)) return false;
+
+  uint64_t size;
+  uint64_t time;
+  if (!sourceInfo(size, time, source_path)) return true;
+
+  return (header.source_size == size) && (header.source_time == time);
+}
+
+
+// 読み込み
+// source_path 変換元のファイル(テクスチャはこのファイルと同じ場所から読む)
+// filter      頂点を読み込むメッシュをマテリアルで選ぶ
+Scene load(const std::shared_ptr<MappedFile>& file, const std::string& source_path,
+           const Model::MeshFilter& filter = nullptr) {
+  if (!isValid(*file)) throw "Broken scene file.";
+
+  const u_char* data = file->data();
+  const auto& header = *SceneFormat::pointer<SceneFormat::Header>(data, 0);
+
+  Scene scene{
+    { header.camera.fovy, header.camera.near_z, header.camera.far_z },
+    { header.ambient[0], header.ambient[1], header.ambient[2] },
+    {},
+    { data, file, source_path, filter },
+    nullptr,
+  };
+
+  const auto& camera = header.camera;
+  scene.camera.eyePosition({ camera.position[0], camera.position[1], camera.position[2] });
+  scene.camera.rotate(Quatf{ camera.rotate[0], camera.rotate[1], camera.rotate[2], camera.rotate[3] });
+
+  const auto* lights = SceneFormat::pointer<SceneFormat::LightRecord>(data, header.lights);
+  for (u_int i = 0; i < header.light_num; ++i) {
+    const auto& l = lights[i];
+    Light light = {
+      Pixel(l.diffuse[0], l.diffuse[1], l.diffuse[2]),
+      Vec3f(l.position[0], l.position[1], l.position[2]),
+    };
+    scene.lights.push_back(light);
+  }
+
+  DOUT << "read scene:" << file->size() / 1024 << "KB" << std::endl;
+
+  return scene;
+}
+
+}
@@ -0,0 +1,105 @@
+﻿
+#pragma once
+
+//
+// 変換済みシーンのバイナリ形式
+// ファイルをメモリに割り当てて、頂点配列などはコピーせずに使う
+// TIPS:各セクションは16bytes境界に揃え、オフセットはファイル先頭からの位置
+//
+
+#include "defines.hpp"
+#include <cstdint>
+
+
+namespace SceneFormat {
+
+enum {
+  MAGIC   = 0x53545253,                             // 'SRTS'
+  VERSION = 1,
+
+  ALIGNMENT = 16,
+  TEXTURE_NAME_LENGTH = 256,
+};
+
+
+struct CameraRecord {
+  double fovy;
+  double near_z;
+  double far_z;
+  double position[3];
+  double rotate[4];                                 // w, x, y, z
+};
+
+struct LightRecord {
+  float diffuse[3];
+  float position[3];
+};
+
+struct MaterialRecord {
+  float diffuse[3];
+  float specular[3];
+  float shininess;
+  float emissive[3];
+  float reflective[3];
+  float transparent[3];
+  float ior;
+
+  char texture[TEXTURE_NAME_LENGTH];                // 空文字列はテクスチャ無し
+};
+
+// 頂点配列はMesh::Vtx, Mesh::Uv, Mesh::Faceと同じ並び
+struct MeshRecord {
+  u_int material_index;
+  u_int has_normal;
+  u_int has_texture;
+  u_int vertex_num;
+  u_int face_num;
+  u_int reserved;
+
+  uint64_t positions;
+  uint64_t normals;
+  uint64_t uvs;                                     // has_textureが0の時は無効
+  uint64_t faces;
+};
+
+// 階層は親→子の順(深さ優先)で並べる
+// メッシュ番号はnode_meshesに同じ順番で並ぶ
+struct NodeRecord {
+  float matrix[16];                                 // 列優先
+  u_int mesh_num;
+  u_int child_num;
+};
+
+
+struct Header {
+  u_int magic;
+  u_int version;
+
+  // 変換元のファイル(更新されていたら変換し直す)
+  uint64_t source_size;
+  uint64_t source_time;
+
+  CameraRecord camera;
+  float ambient[3];
+
+  u_int light_num;
+  u_int material_num;
+  u_int mesh_num;
+  u_int node_num;
+  u_int node_mesh_num;
+
+  uint64_t lights;
+  uint64_t materials;
+  uint64_t meshes;
+  uint64_t nodes;
+  uint64_t node_meshes;
+};
+
+
+// ファイル先頭からのオフセットでデータを参照する
+template <typename T>
+const T* pointer(const u_char* base, const uint64_t offset) {
+  return reinterpret_cast<const T*>(base + offset);
+}
+
+}
@@ -14,6 +14,7 @@
 #include "camera3D.hpp"
 #include "light.hpp"
 #include "model.hpp"
+#include "animation.hpp"
 
 
 namespace {
@@ -23,6 +24,9 @@ struct Scene {
   Pixel              ambient;
   std::vector<Light> lights;
   Model              model;
+
+  // アニメーションを読み込んだ時だけ持つ
+  std::shared_ptr<Animation> animation;
 };
 
 }
@@ -41,6 +45,15 @@ enum {
                  aiProcess_PreTransformVertices
 };
 
+// アニメーション用
+// TIPS:階層構造を残して、フレームごとに頂点を変換する
+enum {
+  animation_flags = aiProcess_JoinIdenticalVertices |
+                    aiProcess_Triangulate |
+                    aiProcess_FlipUVs |
+                    aiProcess_SortByPType
+};
+
 
 Real horizontalFov(const Real fovx, const Real near_z, const Real aspect) {
   // fovyとnear_zから投影面の幅の半分を求める
@@ -54,12 +67,32 @@ Real horizontalFov(const Real fovx, const Real near_z, const Real aspect) {
 }
 
 
-Scene load(const std::string& path) {
+// カメラの位置と向きを設定
+// position, look_at, up ワールド座標系でのaiCameraの値
+void setupCamera(Camera3D& camera, const Vec3f& position, const Vec3f& look_at, const Vec3f& up) {
+  // カメラの位置と向きは逆向きに設定
+  camera.eyePosition(-position);
+
+  // aiCamera::GetCameraMatrixと同じ行列からQuaternionを求める
+  Eigen::Matrix<Real, 3, 3> matrix;
+  matrix.row(0) = up.cross(look_at).normalized();
+  matrix.row(1) = up.normalized();
+  matrix.row(2) = look_at.normalized();
+  Quatf r{ matrix };
+
+  // FIXME:カメラの向きを逆にするのに、Y軸に180度回転している
+  camera.rotate(Quatf{ AngleAxis(M_PI, Vec3f::UnitY()) } * r);
+}
+
+
+// animation trueの時はアニメーションを読み込む
+// filter    頂点を読み込むメッシュをマテリアルで選ぶ
+Scene load(const std::string& path, const bool animation = false, const Model::MeshFilter& filter = nullptr) {
   Assimp::Importer importer;
-  const auto* ai_scene = importer.ReadFile(path, import_flags);
+  const auto* ai_scene = importer.ReadFile(path, animation ? u_int(animation_flags) : u_int(import_flags));
   if (!ai_scene) {
     DOUT << importer.GetErrorString() << std::endl;
-    throw;
+    throw "Can't read scene.";
   }
 
   // カメラ
@@ -81,21 +114,22 @@ Scene load(const std::string& path) {
       scene_camera->mClipPlaneNear, scene_camera->mClipPlaneFar },
     {},
     {},
-    { ai_scene, path },
+    { ai_scene, path, filter },
+    nullptr,
   };
 
-  // カメラの位置と向きは逆向きに設定
-  const aiVector3D& pos = scene_camera->mPosition;
-  scene.camera.eyePosition({ -pos.x, -pos.y, -pos.z });
-
-  // Matrix→Quaternion
-  aiMatrix4x4 mat4x4;
-  scene_camera->GetCameraMatrix(mat4x4);
-  aiQuaternion rotate = aiQuaternion(aiMatrix3x3{ mat4x4 });
-
-  // FIXME:カメラの向きを逆にするのに、Y軸に180度回転している
-  Quatf r{ rotate.w, rotate.x, rotate.y, rotate.z };
-  scene.camera.rotate(Quatf{ AngleAxis(M_PI, Vec3f::UnitY()) } * r);
+  if (animation) {
+    scene.animation = std::make_shared<Animation>(*ai_scene);
+  }
+  else {
+    const auto& pos     = scene_camera->mPosition;
+    const auto& look_at = scene_camera->mLookAt;
+    const auto& up      = scene_camera->mUp;
+    setupCamera(scene.camera,
+                { pos.x, pos.y, pos.z },
+                { look_at.x, look_at.y, look_at.z },
+                { up.x, up.y, up.z });
+  }
 
   
   // ライト
@@ -105,7 +139,7 @@ Scene load(const std::string& path) {
 
   // Cheetah3Dの光源はパラメーターから種類が判別できないので
   // １個目を環境光と決め打ち
-  for (int i = 0; i < ai_scene->mNumLights; ++i) {
+  for (u_int i = 0; i < ai_scene->mNumLights; ++i) {
     const auto* light = ai_scene->mLights[i];
 
     switch (i) {
@@ -0,0 +1,228 @@
+﻿
+#pragma once
+
+//
+// ポリゴンで近似しない形状(球、円盤、四角形)
+// 交差判定を解析的に行うので、シルエットが正確でメモリも少ない
+// TIPS:精度が必要なので、交差判定はRealで行う
+//
+
+#include "defines.hpp"
+#include <cmath>
+#include <algorithm>
+#include "vector.hpp"
+#include "material.hpp"
+
+
+namespace {
+
+class Shape {
+public:
+  enum Type {
+    SPHERE,
+    DISK,
+    QUAD,
+  };
+
+
+private:
+  Type type_;
+  const Material* material_;
+
+  Vec3f center_;                                    // 球と円盤の中心、四角形の頂点
+  Vec3f normal_;                                    // 円盤と四角形の表側
+  Vec3f edge_u_;                                    // 四角形の二辺
+  Vec3f edge_v_;
+  Real  radius_;
+
+
+public:
+  static Shape sphere(const Vec3f& center, const Real radius, const Material& material) {
+    Shape s(SPHERE, material);
+    s.center_ = center;
+    s.radius_ = radius;
+    return s;
+  }
+
+  // normal 表側の向き
+  static Shape disk(const Vec3f& center, const Vec3f& normal, const Real radius, const Material& material) {
+    Shape s(DISK, material);
+    s.center_ = center;
+    s.normal_ = normal.normalized();
+    s.radius_ = radius;
+    return s;
+  }
+
+  // corner + edge_u * a + edge_v * b (0 <= a, b <= 1)の平行四辺形
+  // 表側はedge_u × edge_vの向き
+  static Shape quad(const Vec3f& corner, const Vec3f& edge_u, const Vec3f& edge_v, const Material& material) {
+    Shape s(QUAD, material);
+    s.center_ = corner;
+    s.edge_u_ = edge_u;
+    s.edge_v_ = edge_v;
+    s.normal_ = edge_u.cross(edge_v).normalized();
+    return s;
+  }
+
+
+  Type type() const { return type_; }
+  const Material& material() const { return *material_; }
+
+
+  // 囲うAABB
+  void bounds(Vec3f& inf, Vec3f& sup) const {
+    switch (type_) {
+    case SPHERE:
+      inf = center_ - Vec3f::Constant(radius_);
+      sup = center_ + Vec3f::Constant(radius_);
+      break;
+
+    case DISK:
+      {
+        // 各軸方向の広がりは radius * sqrt(1 - n^2)
+        Vec3f extent = (Vec3f::Ones() - normal_.cwiseProduct(normal_)).cwiseMax(0.0).cwiseSqrt() * radius_;
+        inf = center_ - extent;
+        sup = center_ + extent;
+      }
+      break;
+
+    case QUAD:
+      inf = sup = center_;
+      for (const Vec3f& p : { Vec3f(center_ + edge_u_), Vec3f(center_ + edge_v_), Vec3f(center_ + edge_u_ + edge_v_) }) {
+        inf = inf.cwiseMin(p);
+        sup = sup.cwiseMax(p);
+      }
+      break;
+    }
+  }
+
+
+  // 光線(p + td)との交差判定
+  // back_face 裏側(球は内側)も対象にする
+  bool intersect(Real& t, const Vec3f& p, const Vec3f& d, const bool back_face, const Real max_t) const {
+    switch (type_) {
+    case SPHERE:
+      return intersectSphere(t, p, d, back_face, max_t);
+
+    case DISK:
+    case QUAD:
+      return intersectPlane(t, p, d, back_face, max_t);
+    }
+    return false;
+  }
+
+  // 交差点の法線とUV
+  // TIPS:球は交差点を球面上に置き直して、誤差を減らす
+  void surface(Vec3f& pos, Vec3f& normal, Vec3f& uv) const {
+    switch (type_) {
+    case SPHERE:
+      {
+        normal = (pos - center_).normalized();
+        pos    = center_ + normal * radius_;
+
+        Real phi = std::atan2(normal.z(), normal.x());
+        Real theta = std::acos(std::min(std::max(normal.y(), Real(-1)), Real(1)));
+        uv = Vec3f(phi / (2.0 * M_PI) + 0.5, 1.0 - theta / M_PI, 0.0);
+      }
+      break;
+
+    case DISK:
+      {
+        normal = normal_;
+
+        Vec3f u = (std::abs(normal_.y()) < 0.9) ? Vec3f::UnitY().cross(normal_).normalized()
+                                                : Vec3f::UnitX().cross(normal_).normalized();
+        Vec3f v = normal_.cross(u);
+        Vec3f w = pos - center_;
+        uv = Vec3f(w.norm() / radius_, std::atan2(w.dot(v), w.dot(u)) / (2.0 * M_PI) + 0.5, 0.0);
+      }
+      break;
+
+    case QUAD:
+      {
+        normal = normal_;
+
+        Real a;
+        Real b;
+        quadCoords(a, b, pos);
+        uv = Vec3f(a, b, 0.0);
+      }
+      break;
+    }
+  }
+
+
+private:
+  Shape(const Type type, const Material& material) :
+    type_(type),
+    material_(&material),
+    center_(Vec3f::Zero()),
+    normal_(Vec3f::UnitY()),
+    edge_u_(Vec3f::Zero()),
+    edge_v_(Vec3f::Zero()),
+    radius_(0.0)
+  {}
+
+
+  // 外側から当たる手前が表、内側から当たる奥が裏
+  // SOURCE:Haines et al. "Precision Improvements for Ray/Sphere Intersection" (Ray Tracing Gems 7)
+  bool intersectSphere(Real& t, const Vec3f& p, const Vec3f& d, const bool back_face, const Real max_t) const {
+    Vec3f m = p - center_;
+    Real b = m.dot(d);
+    Real c = m.dot(m) - radius_ * radius_;
+
+    // b^2 - c を桁落ちしにくい形で求める
+    Vec3f f = m - b * d;
+    Real disc = radius_ * radius_ - f.dot(f);
+    if (disc < 0.0) return false;
+
+    Real q  = -b - std::copysign(std::sqrt(disc), b);
+    Real t0 = c / q;
+    Real t1 = q;
+    if (t0 > t1) std::swap(t0, t1);
+
+    if ((t0 > 0.0) && (t0 < max_t)) {
+      t = t0;
+      return true;
+    }
+    if (back_face && (t1 > 0.0) && (t1 < max_t)) {
+      t = t1;
+      return true;
+    }
+    return false;
+  }
+
+  bool intersectPlane(Real& t, const Vec3f& p, const Vec3f& d, const bool back_face, const Real max_t) const {
+    Real dn = d.dot(normal_);
+    if ((dn == 0.0) || (!back_face && (dn > 0.0))) return false;
+
+    Real hit_t = (center_ - p).dot(normal_) / dn;
+    if ((hit_t <= 0.0) || (hit_t >= max_t)) return false;
+
+    Vec3f pos = p + d * hit_t;
+    if (type_ == DISK) {
+      if ((pos - center_).squaredNorm() > (radius_ * radius_)) return false;
+    }
+    else {
+      Real a;
+      Real b;
+      quadCoords(a, b, pos);
+      if ((a < 0.0) || (a > 1.0) || (b < 0.0) || (b > 1.0)) return false;
+    }
+
+    t = hit_t;
+    return true;
+  }
+
+  // 四角形上の位置を二辺の係数で表す
+  void quadCoords(Real& a, Real& b, const Vec3f& pos) const {
+    Vec3f n = edge_u_.cross(edge_v_);
+    Vec3f w = pos - center_;
+    Real inv = 1.0 / n.dot(n);
+    a = n.dot(w.cross(edge_v_)) * inv;
+    b = n.dot(edge_u_.cross(w)) * inv;
+  }
+
+};
+
+}
@@ -0,0 +1,109 @@
+﻿
+#pragma once
+
+//
+// レンダリング中の画像
+// 描画スレッドが露出をかける前の値を書き込みながら、別のスレッドが途中経過を取り出す
+// TIPS:書き込みは1行ずつ、取り出しは画像全体をロックして写すので、
+//      行の途中で書き換わった画像にはならない
+//      表示用の変換は取り出す側で、ロックを外してから行う
+//      露出をかける前の値(HDR/PFMの書き出し、サーバーの返答)もここから1行ずつ取り出す
+//
+
+#include "defines.hpp"
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+#include "postProcess.hpp"
+
+
+namespace {
+
+class SharedImage : private boost::noncopyable {
+  int width_;
+  int height_;
+  // まだ書き込まれていない行の色
+  u_char value_;
+
+  // RGB(float)、下から上に並ぶ
+  std::vector<float> image_;
+  std::vector<bool> written_;
+  PostProcess post_process_;
+  mutable std::mutex mutex_;
+
+
+public:
+  SharedImage(const int width, const int height, const u_char value = 255) :
+    width_(width),
+    height_(height),
+    value_(value),
+    image_(width * height * 3, 0.0f),
+    written_(height, false)
+  {}
+
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // 表示用の変換の設定
+  // TIPS:次に取り出す画像から反映される
+  void postProcess(const PostProcess& post_process) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    post_process_ = post_process;
+  }
+
+  PostProcess postProcess() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return post_process_;
+  }
+
+  // 1行分(RGB x width)を書き込む
+  void writeRow(const int y, const float* row) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::copy(row, row + width_ * 3, image_.begin() + y * width_ * 3);
+    written_[y] = true;
+  }
+
+  // y行目の露出をかける前の値(RGB x width)を写す
+  // TIPS:HDR/PFMの書き出しなどで、画像全体をコピーせずに1行ずつ取り出す
+  void readRow(const int y, float* row) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto begin = image_.begin() + y * width_ * 3;
+    std::copy(begin, begin + width_ * 3, row);
+  }
+
+  // その時点の画像をRGB8にして写す
+  // TIPS:dstの領域は使い回す
+  void snapshot(std::vector<u_char>& dst) const {
+    std::vector<float> image;
+    std::vector<bool> written;
+    PostProcess post_process;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      image        = image_;
+      written      = written_;
+      post_process = post_process_;
+    }
+
+    dst.resize(image.size());
+    for (int y = 0; y < height_; ++y) {
+      u_char* row = &dst[y * width_ * 3];
+      if (written[y]) {
+        post_process.applyRow(row, &image[y * width_ * 3], width_, y);
+      }
+      else {
+        std::fill(row, row + width_ * 3, value_);
+      }
+    }
+  }
+
+  std::vector<u_char> snapshot() const {
+    std::vector<u_char> dst;
+    snapshot(dst);
+    return dst;
+  }
+
+};
+
+}
@@ -0,0 +1,357 @@
+﻿
+#pragma once
+
+//
+// レンダリング用の4要素ベクトル
+// 位置と方向を4要素(wは0)で扱い、SSE/AVXの命令で一度に計算する
+// TIPS:Eigenの3要素ベクトルはベクトル化されないので、計算の多い所だけこちらを使う
+//      シーンのデータとの変換は明示的に行う(toSimd, toVec3f)
+//      std::vectorなどには入れず、関数の中だけで使う(アライメントの問題を避ける)
+//
+
+#include "defines.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include "vector.hpp"
+
+#if defined (__SSE2__) || defined (_M_X64)
+#define SIMD_SSE 1
+#include <immintrin.h>
+#else
+#define SIMD_SSE 0
+#endif
+
+
+namespace {
+
+// 命令セットの無い環境向け
+template <typename T>
+class Simd4 {
+  T v_[4];
+
+public:
+  Simd4() = default;
+
+  explicit Simd4(const T s) : v_{ s, s, s, s } {}
+  Simd4(const T x, const T y, const T z, const T w = 0) : v_{ x, y, z, w } {}
+
+  static Simd4 load(const T* p) { return Simd4(p[0], p[1], p[2], p[3]); }
+  void store(T* p) const { std::copy(v_, v_ + 4, p); }
+  T operator[](const int i) const { return v_[i]; }
+
+  // [0, 255]に収めて切り捨てた値を4byte書き出す
+  void storeU8(u_char* p) const {
+    for (int i = 0; i < 4; ++i) {
+      p[i] = u_char(std::min(std::max(v_[i], T(0)), T(255)));
+    }
+  }
+
+  Simd4 operator+(const Simd4& rhs) const { return map(rhs, [](T a, T b) { return a + b; }); }
+  Simd4 operator-(const Simd4& rhs) const { return map(rhs, [](T a, T b) { return a - b; }); }
+  Simd4 operator*(const Simd4& rhs) const { return map(rhs, [](T a, T b) { return a * b; }); }
+  Simd4 operator/(const Simd4& rhs) const { return map(rhs, [](T a, T b) { return a / b; }); }
+
+  friend Simd4 min(const Simd4& a, const Simd4& b) { return a.map(b, [](T x, T y) { return std::min(x, y); }); }
+  friend Simd4 max(const Simd4& a, const Simd4& b) { return a.map(b, [](T x, T y) { return std::max(x, y); }); }
+  friend Simd4 sqrt(const Simd4& a) { return a.map(a, [](T x, T) { return std::sqrt(x); }); }
+
+  // 2のべき乗と2を底とする対数(0以下の対数は最小の正規化数で計算する)
+  friend Simd4 exp2(const Simd4& a) { return a.map(a, [](T x, T) { return std::exp2(x); }); }
+  friend Simd4 log2(const Simd4& a) {
+    return a.map(a, [](T x, T) { return std::log2(std::max(x, std::numeric_limits<T>::min())); });
+  }
+
+  // a < b ? x : y
+  friend Simd4 selectLess(const Simd4& a, const Simd4& b, const Simd4& x, const Simd4& y) {
+    return Simd4((a.v_[0] < b.v_[0]) ? x.v_[0] : y.v_[0], (a.v_[1] < b.v_[1]) ? x.v_[1] : y.v_[1],
+                 (a.v_[2] < b.v_[2]) ? x.v_[2] : y.v_[2], (a.v_[3] < b.v_[3]) ? x.v_[3] : y.v_[3]);
+  }
+
+  // a * b + c
+  friend Simd4 fmadd(const Simd4& a, const Simd4& b, const Simd4& c) { return a * b + c; }
+
+  // (x, y, z, w) → (y, z, x, w)
+  Simd4 yzx() const { return Simd4(v_[1], v_[2], v_[0], v_[3]); }
+
+
+private:
+  template <typename Func>
+  Simd4 map(const Simd4& rhs, Func func) const {
+    return Simd4(func(v_[0], rhs.v_[0]), func(v_[1], rhs.v_[1]),
+                 func(v_[2], rhs.v_[2]), func(v_[3], rhs.v_[3]));
+  }
+
+};
+
+
+#if SIMD_SSE
+
+// float x 4 (SSE)
+template <>
+class Simd4<float> {
+  __m128 v_;
+
+public:
+  Simd4() = default;
+
+  explicit Simd4(const __m128 v) : v_(v) {}
+  explicit Simd4(const float s) : v_(_mm_set1_ps(s)) {}
+  Simd4(const float x, const float y, const float z, const float w = 0) : v_(_mm_set_ps(w, z, y, x)) {}
+
+  static Simd4 load(const float* p) { return Simd4(_mm_loadu_ps(p)); }
+  void store(float* p) const { _mm_storeu_ps(p, v_); }
+  float operator[](const int i) const {
+    float p[4];
+    store(p);
+    return p[i];
+  }
+
+  void storeU8(u_char* p) const {
+    __m128i i = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v_, _mm_setzero_ps()), _mm_set1_ps(255.0f)));
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+    int32_t bytes = _mm_cvtsi128_si32(i);
+    std::memcpy(p, &bytes, sizeof(bytes));
+  }
+
+  Simd4 operator+(const Simd4& rhs) const { return Simd4(_mm_add_ps(v_, rhs.v_)); }
+  Simd4 operator-(const Simd4& rhs) const { return Simd4(_mm_sub_ps(v_, rhs.v_)); }
+  Simd4 operator*(const Simd4& rhs) const { return Simd4(_mm_mul_ps(v_, rhs.v_)); }
+  Simd4 operator/(const Simd4& rhs) const { return Simd4(_mm_div_ps(v_, rhs.v_)); }
+
+  friend Simd4 min(const Simd4& a, const Simd4& b) { return Simd4(_mm_min_ps(a.v_, b.v_)); }
+  friend Simd4 max(const Simd4& a, const Simd4& b) { return Simd4(_mm_max_ps(a.v_, b.v_)); }
+  friend Simd4 sqrt(const Simd4& a) { return Simd4(_mm_sqrt_ps(a.v_)); }
+
+  // 整数部は指数に直接書き込み、小数部([-0.5, 0.5])を多項式で近似する
+  // SOURCE:Cephes Math Library(exp2f, logf)
+  friend Simd4 exp2(const Simd4& a) {
+    __m128 x = _mm_min_ps(_mm_max_ps(a.v_, _mm_set1_ps(-126.0f)), _mm_set1_ps(126.0f));
+    __m128i n = _mm_cvtps_epi32(x);
+    Simd4 f(_mm_sub_ps(x, _mm_cvtepi32_ps(n)));
+
+    Simd4 p(1.535336188319500e-4f);
+    p = fmadd(p, f, Simd4(1.339887440266574e-3f));
+    p = fmadd(p, f, Simd4(9.618437357674640e-3f));
+    p = fmadd(p, f, Simd4(5.550332471162809e-2f));
+    p = fmadd(p, f, Simd4(2.402264791363012e-1f));
+    p = fmadd(p, f, Simd4(6.931472028550421e-1f));
+    p = fmadd(p, f, Simd4(1.0f));
+
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+    return p * Simd4(scale);
+  }
+
+  // 仮数部を[√0.5, √2)に寄せてからlog(1 + t)を多項式で近似する
+  friend Simd4 log2(const Simd4& a) {
+    __m128i bits = _mm_castps_si128(_mm_max_ps(a.v_, _mm_set1_ps(std::numeric_limits<float>::min())));
+    __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                             _mm_set1_epi32(0x3f800000)));
+    __m128 large = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+    m = _mm_or_ps(_mm_and_ps(large, _mm_mul_ps(m, _mm_set1_ps(0.5f))), _mm_andnot_ps(large, m));
+    // 比較結果は-1なので引くと1増える
+    e = _mm_sub_epi32(e, _mm_castps_si128(large));
+
+    Simd4 t(_mm_sub_ps(m, _mm_set1_ps(1.0f)));
+    Simd4 z = t * t;
+    Simd4 p(7.0376836292e-2f);
+    p = fmadd(p, t, Simd4(-1.1514610310e-1f));
+    p = fmadd(p, t, Simd4(1.1676998740e-1f));
+    p = fmadd(p, t, Simd4(-1.2420140846e-1f));
+    p = fmadd(p, t, Simd4(1.4249322787e-1f));
+    p = fmadd(p, t, Simd4(-1.6668057665e-1f));
+    p = fmadd(p, t, Simd4(2.0000714765e-1f));
+    p = fmadd(p, t, Simd4(-2.4999993993e-1f));
+    p = fmadd(p, t, Simd4(3.3333331174e-1f));
+    Simd4 ln = fmadd(p * z, t, fmadd(z, Simd4(-0.5f), t));
+
+    return fmadd(ln, Simd4(1.44269504f), Simd4(_mm_cvtepi32_ps(e)));
+  }
+
+  friend Simd4 selectLess(const Simd4& a, const Simd4& b, const Simd4& x, const Simd4& y) {
+    __m128 mask = _mm_cmplt_ps(a.v_, b.v_);
+    return Simd4(_mm_or_ps(_mm_and_ps(mask, x.v_), _mm_andnot_ps(mask, y.v_)));
+  }
+
+  friend Simd4 fmadd(const Simd4& a, const Simd4& b, const Simd4& c) {
+#ifdef __FMA__
+    return Simd4(_mm_fmadd_ps(a.v_, b.v_, c.v_));
+#else
+    return Simd4(_mm_add_ps(_mm_mul_ps(a.v_, b.v_), c.v_));
+#endif
+  }
+
+  Simd4 yzx() const { return Simd4(_mm_shuffle_ps(v_, v_, _MM_SHUFFLE(3, 0, 2, 1))); }
+};
+
+
+// double x 4 (AVX)
+// TIPS:exp2, log2, selectLess, storeU8はfloatでしか使わないので用意していない
+// TIPS:AVXが無い時はSSE2の2要素を2つ使う
+template <>
+class Simd4<double> {
+#ifdef __AVX__
+  __m256d v_;
+
+  explicit Simd4(const __m256d v) : v_(v) {}
+#else
+  __m128d lo_;                                      // x, y
+  __m128d hi_;                                      // z, w
+
+  Simd4(const __m128d lo, const __m128d hi) : lo_(lo), hi_(hi) {}
+#endif
+
+public:
+  Simd4() = default;
+
+#ifdef __AVX__
+  explicit Simd4(const double s) : v_(_mm256_set1_pd(s)) {}
+  Simd4(const double x, const double y, const double z, const double w = 0) : v_(_mm256_set_pd(w, z, y, x)) {}
+
+  void store(double* p) const { _mm256_storeu_pd(p, v_); }
+
+  Simd4 operator+(const Simd4& rhs) const { return Simd4(_mm256_add_pd(v_, rhs.v_)); }
+  Simd4 operator-(const Simd4& rhs) const { return Simd4(_mm256_sub_pd(v_, rhs.v_)); }
+  Simd4 operator*(const Simd4& rhs) const { return Simd4(_mm256_mul_pd(v_, rhs.v_)); }
+  Simd4 operator/(const Simd4& rhs) const { return Simd4(_mm256_div_pd(v_, rhs.v_)); }
+
+  friend Simd4 min(const Simd4& a, const Simd4& b) { return Simd4(_mm256_min_pd(a.v_, b.v_)); }
+  friend Simd4 max(const Simd4& a, const Simd4& b) { return Simd4(_mm256_max_pd(a.v_, b.v_)); }
+  friend Simd4 sqrt(const Simd4& a) { return Simd4(_mm256_sqrt_pd(a.v_)); }
+
+  friend Simd4 fmadd(const Simd4& a, const Simd4& b, const Simd4& c) {
+#ifdef __FMA__
+    return Simd4(_mm256_fmadd_pd(a.v_, b.v_, c.v_));
+#else
+    return Simd4(_mm256_add_pd(_mm256_mul_pd(a.v_, b.v_), c.v_));
+#endif
+  }
+
+  Simd4 yzx() const {
+#ifdef __AVX2__
+    return Simd4(_mm256_permute4x64_pd(v_, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
+    double p[4];
+    store(p);
+    return Simd4(p[1], p[2], p[0], p[3]);
+#endif
+  }
+
+#else
+  explicit Simd4(const double s) : lo_(_mm_set1_pd(s)), hi_(_mm_set1_pd(s)) {}
+  Simd4(const double x, const double y, const double z, const double w = 0) :
+    lo_(_mm_set_pd(y, x)),
+    hi_(_mm_set_pd(w, z))
+  {}
+
+  void store(double* p) const {
+    _mm_storeu_pd(p, lo_);
+    _mm_storeu_pd(p + 2, hi_);
+  }
+
+  Simd4 operator+(const Simd4& rhs) const { return Simd4(_mm_add_pd(lo_, rhs.lo_), _mm_add_pd(hi_, rhs.hi_)); }
+  Simd4 operator-(const Simd4& rhs) const { return Simd4(_mm_sub_pd(lo_, rhs.lo_), _mm_sub_pd(hi_, rhs.hi_)); }
+  Simd4 operator*(const Simd4& rhs) const { return Simd4(_mm_mul_pd(lo_, rhs.lo_), _mm_mul_pd(hi_, rhs.hi_)); }
+  Simd4 operator/(const Simd4& rhs) const { return Simd4(_mm_div_pd(lo_, rhs.lo_), _mm_div_pd(hi_, rhs.hi_)); }
+
+  friend Simd4 min(const Simd4& a, const Simd4& b) { return Simd4(_mm_min_pd(a.lo_, b.lo_), _mm_min_pd(a.hi_, b.hi_)); }
+  friend Simd4 max(const Simd4& a, const Simd4& b) { return Simd4(_mm_max_pd(a.lo_, b.lo_), _mm_max_pd(a.hi_, b.hi_)); }
+  friend Simd4 sqrt(const Simd4& a) { return Simd4(_mm_sqrt_pd(a.lo_), _mm_sqrt_pd(a.hi_)); }
+
+  friend Simd4 fmadd(const Simd4& a, const Simd4& b, const Simd4& c) { return a * b + c; }
+
+  Simd4 yzx() const {
+    return Simd4(_mm_shuffle_pd(lo_, hi_, 0x1),     // y, z
+                 _mm_shuffle_pd(lo_, hi_, 0x2));    // x, w
+  }
+#endif
+
+  double operator[](const int i) const {
+    double p[4];
+    store(p);
+    return p[i];
+  }
+};
+
+#endif
+
+
+// 交差判定用(Float)とシェーディング用(Real)
+using Vec4s = Simd4<Float>;
+using Vec4r = Simd4<Real>;
+
+
+// 3要素の内積
+template <typename T>
+T dot3(const Simd4<T>& a, const Simd4<T>& b) {
+  T p[4];
+  (a * b).store(p);
+  return p[0] + p[1] + p[2];
+}
+
+// 3要素の外積
+template <typename T>
+Simd4<T> cross3(const Simd4<T>& a, const Simd4<T>& b) {
+  return (a * b.yzx() - a.yzx() * b).yzx();
+}
+
+template <typename T>
+Simd4<T> normalize3(const Simd4<T>& a) {
+  return a * Simd4<T>(1 / std::sqrt(dot3(a, a)));
+}
+
+// 3要素の最大値
+template <typename T>
+T maxCoeff3(const Simd4<T>& a) {
+  T p[4];
+  a.store(p);
+  return std::max({ p[0], p[1], p[2] });
+}
+
+
+// 3要素の最小値
+template <typename T>
+T minCoeff3(const Simd4<T>& a) {
+  T p[4];
+  a.store(p);
+  return std::min({ p[0], p[1], p[2] });
+}
+
+
+// Eigenとの変換
+template <typename T, typename Vec>
+Simd4<T> toSimd(const Vec& v) {
+  return Simd4<T>(T(v.x()), T(v.y()), T(v.z()));
+}
+
+template <typename T>
+Vec3f toVec3f(const Simd4<T>& a) {
+  T p[4];
+  a.store(p);
+  return Vec3f(p[0], p[1], p[2]);
+}
+
+
+// 反射(n:正規化された法線)
+template <typename T>
+Simd4<T> reflect3(const Simd4<T>& v, const Simd4<T>& n) {
+  return fmadd(n, Simd4<T>(-2 * dot3(n, v)), v);
+}
+
+// 屈折(全反射の時はfalse)
+// ior = 屈折率の比
+template <typename T>
+bool refract3(Simd4<T>& res, const Simd4<T>& v, const Simd4<T>& n, const T ior) {
+  T nv = dot3(n, v);
+  T k  = 1 - ior * ior * (1 - nv * nv);
+  if (k < 0) return false;
+
+  res = Simd4<T>(ior) * v - Simd4<T>(ior * nv + std::sqrt(k)) * n;
+  return true;
+}
+
+}
@@ -10,6 +10,7 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <mutex>
 #include "texture.hpp"
 #include "fileUtil.hpp"
 
@@ -24,9 +25,14 @@ public:
 private:
 	std::map<std::string, TexPtr> tex_obj_;
 
+  // TIPS:複数のスレッドから読み込めるようにする(コピーしても共有する)
+  std::shared_ptr<std::mutex> mutex_;
+
   
 public:
-	TexMng() {
+	TexMng() :
+    mutex_(std::make_shared<std::mutex>())
+  {
 		DOUT << "TexMng()" << std::endl;
 	}
   
@@ -37,22 +43,35 @@ public:
   
 	TexPtr read(const std::string& path) {
 		std::string name = getFilename(path);
-		auto it = tex_obj_.find(name);
-    if (it != tex_obj_.end()) {
-      return it->second;
+    {
+      std::lock_guard<std::mutex> lock(*mutex_);
+      auto it = tex_obj_.find(name);
+      if (it != tex_obj_.end()) {
+        return it->second;
+      }
     }
 
     // 見つからない場合はテクスチャを読み込んでコンテナに格納する
+    // TIPS:デコード中はロックしない
     DOUT << "texmng read: " << path << std::endl;
     TexPtr obj(std::make_shared<Texture>(path));
 
-    // shared_ptrなので、emplaceである必要性は低い
-    tex_obj_.insert(std::map<std::string, TexPtr>::value_type(name, obj));
-
-    return obj;
+    // 他のスレッドが先に格納していたら、そちらを使う
+    std::lock_guard<std::mutex> lock(*mutex_);
+    auto result = tex_obj_.insert(std::map<std::string, TexPtr>::value_type(name, obj));
+    return result.first->second;
 	}
 
+  // 読み込んだテクスチャをOpenGLへ転送する
+  void upload() {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    for (auto& obj : tex_obj_) {
+      obj.second->upload();
+    }
+  }
+
 	TexPtr get(const std::string& name) {
+    std::lock_guard<std::mutex> lock(*mutex_);
 		auto it = tex_obj_.find(name);
     if (it != tex_obj_.end()) {
       return it->second;
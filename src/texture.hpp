@@ -3,12 +3,23 @@
 
 //
 // テクスチャ管理
+// TIPS:レイトレ用にはRGBA8(sRGB)のまま持ち、参照する時にリニアへ展開する
+//      縮小画像を読み込み時に作り、4x4のタイル単位で並べる
+//      (バイリニア補間で参照する4テクセルがほとんど同じタイルに収まる)
+//      TextureCacheを使う時は、ファイルに書き出してページ単位で読み込む
 //
 
 #include "defines.hpp"
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <boost/noncopyable.hpp>
 #include "png.hpp"
+#include "textureCache.hpp"
 #include "color.hpp"
 #include "utils.hpp"
 
@@ -21,32 +32,125 @@ class Texture : private boost::noncopyable {
   int width_;
   int height_;
 
-  std::vector<Pixel> pixel_;
+  // レイトレ用の縮小画像の列([0]が元の画像)
+  struct Level {
+    int width;
+    int height;
+    int tiles_x;                                    // 横に並ぶタイルの数
+    std::vector<uint32_t> texels;                   // R, G, B, Aの順に8bitずつ
+
+    // TextureCacheを使う時
+    int pages_x;                                    // 横に並ぶページの数
+    size_t first_slot;                              // 最初のページの置き場所
+  };
+  std::vector<Level> levels_;
+
+  // TextureCacheを使う時は、texelsを空にしてページの置き場所を持つ
+  bool cached_;
+  std::string cache_path_;
+  mutable std::vector<TextureCache::Slot> slots_;
+
+  enum {
+    TILE_SHIFT = 2,
+    TILE_SIZE  = 1 << TILE_SHIFT,
+    TILE_MASK  = TILE_SIZE - 1,
+  };
+
+  // OpenGLへ転送するまでのイメージ
+  GLint type_;
+  std::vector<u_char> image_;
   
 	
 public:
-	Texture(const std::string& filename) {
+  // TIPS:画像の読み込みだけを行うので、どのスレッドからでも生成できる
+	Texture(const std::string& filename) :
+    id_(0),
+    cached_(false)
+  {
     DOUT << "Texture()" << std::endl;
-		glGenTextures(1, &id_);
     setupPng(filename);
 	}
 	
 	~Texture() {
     DOUT << "~Texture()" << std::endl;
-		glDeleteTextures(1, &id_);
+		if (id_) glDeleteTextures(1, &id_);
+
+    if (cached_) {
+      TextureCache::instance().release(slots_);
+      std::remove(cache_path_.c_str());
+    }
 	}
 
 
+  // OpenGLへ転送する
+  // ※OpenGLのコンテキストがあるスレッドで呼ぶ
+  void upload() {
+    if (id_ || image_.empty()) return;
+
+		glGenTextures(1, &id_);
+		glBindTexture(GL_TEXTURE_2D, id_);
+		setupTextureParam();
+
+    // TIPS:RGBで幅が4の倍数でない時は、行の終わりが4bytes境界に揃っていない
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, type_, width_, height_, 0, type_, GL_UNSIGNED_BYTE, &image_[0]);
+
+    // 転送後は不要
+    std::vector<u_char>().swap(image_);
+  }
+
+
   // サイズを返す
   int width() const { return width_; }
   int height() const { return height_; }
 
 
+  // 縮小画像の段数
+  int levels() const { return int(levels_.size()); }
+
+  // レイトレ用に使っているメモリ量
+  size_t memory() const {
+    size_t size = 0;
+    for (const auto& level : levels_) {
+      size += level.texels.size() * sizeof(uint32_t);
+    }
+    return size;
+  }
+
+
+  // 光線の太さに合う縮小画像の段数
+  // uv_density ポリゴンのUV上の面積 / 空間での面積
+  // footprint  交差点での光線の太さ / |cosθ|
+  // SOURCE:Akenine-Möller et al. "Texture Level of Detail Strategies for Real-Time Ray Tracing" (Ray Tracing Gems 20)
+  Real lod(const Real uv_density, const Real footprint) const {
+    if ((uv_density <= 0.0) || (footprint <= 0.0)) return 0.0;
+    return 0.5 * std::log2(uv_density * width_ * height_) + std::log2(footprint);
+  }
+
+
+  // バイリニア補間した値(リニア)
+  // TIPS:UVは繰り返す
   Pixel pixel(const Real u, const Real v) const {
-    int x = int(width_ * u) % width_;
-    int y = int(height_ * v) % height_;
-    
-    return pixel_[y * width_ + x];
+    return pixel(u, v, 0.0);
+  }
+
+  // 縮小画像の間も補間した値(トライリニア)
+  // lod 縮小画像の段数(0が元の画像)
+  Pixel pixel(const Real u, const Real v, const Real lod) const {
+    if (levels_.empty()) return Pixel::Ones();
+
+    Real l  = minmax(lod, Real(0.0), Real(levels_.size() - 1));
+    int  l0 = int(l);
+    Real t  = l - l0;
+
+    if (cached_) {
+      PagePins pins(*this);
+      Pixel p0 = bilinear(levels_[l0], u, v, pins);
+      return (t > 0.0) ? Pixel(p0 * (1.0 - t) + bilinear(levels_[l0 + 1], u, v, pins) * t) : p0;
+    }
+
+    Pixel p0 = bilinear(levels_[l0], u, v, LevelTexels());
+    return (t > 0.0) ? Pixel(p0 * (1.0 - t) + bilinear(levels_[l0 + 1], u, v, LevelTexels()) * t) : p0;
   }
 
   
@@ -75,33 +179,255 @@ private:
 		Png png_obj(filename);
     width_ = png_obj.width();
     height_ = png_obj.height();
-    if ((width_ != int2pow(width_)) || (height_ != int2pow(height_))) {
-      DOUT << "Texture size error " << width_ << ":" << height_ << std::endl;
-      // サイズが2のべき乗でなければエラー
-      return;
-    }
-
-		glBindTexture(GL_TEXTURE_2D, id_);
-		setupTextureParam();
 
 		GLint type = (png_obj.type() == PNG_COLOR_TYPE_RGB) ? GL_RGB : GL_RGBA;
-		glTexImage2D(GL_TEXTURE_2D, 0, type, width_, height_, 0, type, GL_UNSIGNED_BYTE, png_obj.image());
+    type_ = type;
+    int next_pixel = (type == GL_RGB) ? 3 : 4;
+    image_.assign(png_obj.image(), png_obj.image() + width_ * height_ * next_pixel);
 		
-    DOUT << "Texture:" << ((type == PNG_COLOR_TYPE_RGB) ? " RGB" : " RGBA") << std::endl;
+    DOUT << "Texture:" << ((type == GL_RGB) ? " RGB " : " RGBA ") << width_ << "x" << height_ << std::endl;
 
     // レイトレ用にイメージを取り出す
-    pixel_.reserve(width_ * height_);
+    Level level = createLevel(width_, height_);
     const u_char* image = png_obj.image();
-    int next_pixel = (type == GL_RGB) ? 3 : 4;
-    for (int i = 0; i < (width_ * height_); ++i) {
-      Real r = image[0] / 255.0;
-      Real g = image[1] / 255.0;
-      Real b = image[2] / 255.0;
-      
-      pixel_.push_back({ r, g, b });
-      image += next_pixel;
+    for (int y = 0; y < height_; ++y) {
+      for (int x = 0; x < width_; ++x) {
+        const u_char* p = &image[(y * width_ + x) * next_pixel];
+        u_char alpha = (next_pixel == 4) ? p[3] : 255;
+        texelRef(level, x, y) = uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(alpha) << 24);
+      }
+    }
+    levels_.push_back(std::move(level));
+
+    createMips();
+    DOUT << "Texture mips:" << levels_.size() << " " << memory() / 1024 << "KB" << std::endl;
+
+    if (TextureCache::instance().enable()) {
+      writeCache();
+
+      // TIPS:プレビュー用のイメージも持たない(プレビューではテクスチャを表示しない)
+      std::vector<u_char>().swap(image_);
     }
 	}
+
+
+  // 縮小画像をページに分けて書き出し、メモリからは捨てる
+  // TIPS:端のページの余りは、端のテクセルで埋める
+  void writeCache() {
+    auto& cache = TextureCache::instance();
+    cache_path_ = cache.createPath();
+    std::ofstream fstr(cache_path_, std::ios::binary);
+
+    size_t num = 0;
+    for (auto& level : levels_) {
+      level.pages_x    = (level.width + TextureCache::PAGE_MASK) >> TextureCache::PAGE_SHIFT;
+      level.first_slot = num;
+      num += level.pages_x * ((level.height + TextureCache::PAGE_MASK) >> TextureCache::PAGE_SHIFT);
+    }
+    std::vector<TextureCache::Slot>(num).swap(slots_);
+
+    std::vector<uint32_t> page(TextureCache::PAGE_TEXELS);
+    size_t index = 0;
+    for (auto& level : levels_) {
+      for (int py = 0; py < (level.height + TextureCache::PAGE_MASK) >> TextureCache::PAGE_SHIFT; ++py) {
+        for (int px = 0; px < level.pages_x; ++px) {
+          for (int y = 0; y < TextureCache::PAGE_SIZE; ++y) {
+            int sy = std::min((py << TextureCache::PAGE_SHIFT) + y, level.height - 1);
+            for (int x = 0; x < TextureCache::PAGE_SIZE; ++x) {
+              int sx = std::min((px << TextureCache::PAGE_SHIFT) + x, level.width - 1);
+              page[pageOffset(x, y)] = level.texels[texelIndex(level, sx, sy)];
+            }
+          }
+          fstr.write(reinterpret_cast<const char*>(&page[0]), TextureCache::PAGE_BYTES);
+
+          auto& slot  = slots_[index];
+          slot.path   = &cache_path_;
+          slot.offset = index * TextureCache::PAGE_BYTES;
+          index += 1;
+        }
+      }
+      std::vector<uint32_t>().swap(level.texels);
+    }
+
+    cached_ = bool(fstr);
+    if (!cached_) {
+      DOUT << "Texture cache write error:" << cache_path_ << std::endl;
+      throw "Can't write texture cache.";
+    }
+  }
+
+
+  // タイルの端数を切り上げて確保する
+  static Level createLevel(const int width, const int height) {
+    int tiles_x = (width  + TILE_MASK) >> TILE_SHIFT;
+    int tiles_y = (height + TILE_MASK) >> TILE_SHIFT;
+    return Level{ width, height, tiles_x, std::vector<uint32_t>(tiles_x * tiles_y * TILE_SIZE * TILE_SIZE), 0, 0 };
+  }
+
+  static size_t texelIndex(const Level& level, const int x, const int y) {
+    size_t tile = (y >> TILE_SHIFT) * level.tiles_x + (x >> TILE_SHIFT);
+    return tile * (TILE_SIZE * TILE_SIZE) + (y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+  }
+
+  static uint32_t& texelRef(Level& level, const int x, const int y) {
+    return level.texels[texelIndex(level, x, y)];
+  }
+
+  // ページ内の位置(ページの中も4x4のタイルに並べる)
+  static int pageOffset(const int x, const int y) {
+    int tile = (y >> TILE_SHIFT) * (TextureCache::PAGE_SIZE >> TILE_SHIFT) + (x >> TILE_SHIFT);
+    return tile * (TILE_SIZE * TILE_SIZE) + (y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+  }
+
+
+  // メモリ上の縮小画像からテクセルを取り出す
+  struct LevelTexels {
+    uint32_t operator()(const Level& level, const int x, const int y) const {
+      return level.texels[texelIndex(level, x, y)];
+    }
+  };
+
+  // TextureCacheのページからテクセルを取り出す
+  // TIPS:1回の参照で使うページを覚えておき、最後にまとめて手放す
+  class PagePins {
+    enum { MAX_PINS = 8 };
+
+    const Texture& texture_;
+    const TextureCache::Slot* slots_[MAX_PINS];
+    TextureCache::Page* pages_[MAX_PINS];
+    int num_;
+
+  public:
+    explicit PagePins(const Texture& texture) :
+      texture_(texture),
+      num_(0)
+    {}
+
+    ~PagePins() {
+      for (int i = 0; i < num_; ++i) {
+        TextureCache::instance().unpin(pages_[i]);
+      }
+    }
+
+    uint32_t operator()(const Level& level, const int x, const int y) {
+      size_t index = level.first_slot
+                   + (y >> TextureCache::PAGE_SHIFT) * level.pages_x + (x >> TextureCache::PAGE_SHIFT);
+      auto& slot = texture_.slots_[index];
+
+      TextureCache::Page* page = nullptr;
+      for (int i = 0; i < num_; ++i) {
+        if (slots_[i] == &slot) page = pages_[i];
+      }
+      if (!page) {
+        page = TextureCache::instance().pin(slot);
+        slots_[num_] = &slot;
+        pages_[num_] = page;
+        num_ += 1;
+      }
+
+      return page->texels[pageOffset(x & TextureCache::PAGE_MASK, y & TextureCache::PAGE_MASK)];
+    }
+  };
+
+  // 範囲外は繰り返す
+  static int wrap(const int value, const int size) {
+    if (u_int(value) < u_int(size)) return value;
+    int res = value % size;
+    return (res < 0) ? res + size : res;
+  }
+
+  // TIPS:4テクセルを展開しながら重みを掛けて足す
+  template <typename Fetch>
+  static Pixel bilinear(const Level& level, const Real u, const Real v, Fetch&& fetch) {
+    Real fx = u * level.width  - 0.5;
+    Real fy = v * level.height - 0.5;
+    // TIPS:std::floorは関数呼び出しになるので、切り捨てから求める
+    int x0 = int(fx) - (fx < 0.0);
+    int y0 = int(fy) - (fy < 0.0);
+    float tx = float(fx - x0);
+    float ty = float(fy - y0);
+
+    int xa = wrap(x0, level.width);
+    int ya = wrap(y0, level.height);
+    int xb = ((xa + 1) < level.width)  ? xa + 1 : 0;
+    int yb = ((ya + 1) < level.height) ? ya + 1 : 0;
+
+    const uint32_t texels[] = {
+      fetch(level, xa, ya), fetch(level, xb, ya),
+      fetch(level, xa, yb), fetch(level, xb, yb),
+    };
+    const float weights[] = {
+      (1.0f - tx) * (1.0f - ty), tx * (1.0f - ty),
+      (1.0f - tx) * ty,          tx * ty,
+    };
+
+    const float* table = srgbTable();
+    float r = 0.0f;
+    float g = 0.0f;
+    float b = 0.0f;
+    for (int i = 0; i < 4; ++i) {
+      r += table[texels[i] & 0xff]         * weights[i];
+      g += table[(texels[i] >> 8) & 0xff]  * weights[i];
+      b += table[(texels[i] >> 16) & 0xff] * weights[i];
+    }
+    return Pixel(r, g, b);
+  }
+
+  // 縮小する時に参照するテクセルと重み
+  // TIPS:大きさが奇数でも端のテクセルを落とさないよう、縮小後の1テクセルが覆う範囲をそのまま平均する
+  struct Tap {
+    int   index;
+    float weight;
+  };
+  static std::vector<std::vector<Tap> > boxTaps(const int src, const int dst) {
+    std::vector<std::vector<Tap> > taps(dst);
+    float scale = float(src) / dst;
+    for (int i = 0; i < dst; ++i) {
+      float begin = i * scale;
+      float end   = (i + 1) * scale;
+      for (int s = int(begin); s < std::min(int(std::ceil(end)), src); ++s) {
+        float weight = (std::min(end, float(s + 1)) - std::max(begin, float(s))) / scale;
+        if (weight > 0.0f) taps[i].push_back({ s, weight });
+      }
+    }
+    return taps;
+  }
+
+  // リニアで平均して半分の大きさにしていく
+  void createMips() {
+    const float* table = srgbTable();
+    while ((levels_.back().width > 1) || (levels_.back().height > 1)) {
+      const Level& src = levels_.back();
+      Level dst = createLevel(std::max(src.width / 2, 1), std::max(src.height / 2, 1));
+
+      auto taps_x = boxTaps(src.width,  dst.width);
+      auto taps_y = boxTaps(src.height, dst.height);
+      for (int y = 0; y < dst.height; ++y) {
+        for (int x = 0; x < dst.width; ++x) {
+          float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+          for (const auto& ty : taps_y[y]) {
+            for (const auto& tx : taps_x[x]) {
+              uint32_t value = src.texels[texelIndex(src, tx.index, ty.index)];
+              float weight = tx.weight * ty.weight;
+              for (int c = 0; c < 3; ++c) {
+                sum[c] += table[(value >> (c * 8)) & 0xff] * weight;
+              }
+              sum[3] += (value >> 24) / 255.0f * weight;
+            }
+          }
+
+          uint32_t packed = 0;
+          for (int c = 0; c < 4; ++c) {
+            float encoded = (c < 3) ? linearToSrgb(sum[c]) : sum[c];
+            packed |= uint32_t(std::min(std::max(int(encoded * 255.0f + 0.5f), 0), 255)) << (c * 8);
+          }
+          texelRef(dst, x, y) = packed;
+        }
+      }
+
+      levels_.push_back(std::move(dst));
+    }
+  }
   
 };
 
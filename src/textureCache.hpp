@@ -0,0 +1,306 @@
+﻿
+#pragma once
+
+//
+// テクスチャのページキャッシュ
+// 縮小画像を含めたテクセルを64x64のページに分けてファイルに書き出し、
+// 参照されたページだけを読み込む。上限を超えたら最近使っていないページから捨てる
+// TIPS:ページの器は使い回して解放しないので、参照中のスレッドがあっても安全に捨てられる
+//      捨てる順番はLRUの近似(CLOCK)
+//      ファイル名にプロセスIDを含めるので、同じディレクトリを複数のプロセスで使える
+//
+
+#include "defines.hpp"
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+#include "os.hpp"
+
+
+namespace {
+
+class TextureCache : private boost::noncopyable {
+public:
+  enum {
+    PAGE_SHIFT = 6,
+    PAGE_SIZE  = 1 << PAGE_SHIFT,                   // 1辺のテクセル数
+    PAGE_MASK  = PAGE_SIZE - 1,
+    PAGE_TEXELS = PAGE_SIZE * PAGE_SIZE,
+    PAGE_BYTES  = PAGE_TEXELS * sizeof(uint32_t),
+  };
+
+  struct Page {
+    std::vector<uint32_t> texels;
+    std::atomic<int>  users;                        // 参照中のスレッド数
+    std::atomic<bool> referenced;                   // 最後に捨てる候補を調べてから参照されたか
+
+    Page() :
+      texels(PAGE_TEXELS),
+      users(0),
+      referenced(false)
+    {}
+  };
+
+  // ページの置き場所(テクスチャがページの数だけ持つ)
+  struct Slot {
+    std::atomic<Page*> page;
+    const std::string* path;                        // 読み込むファイル
+    size_t offset;                                  // ファイル内の位置
+    int resident;                                   // resident_での位置(読み込まれていない時は-1)
+
+    Slot() :
+      page(nullptr),
+      path(nullptr),
+      offset(0),
+      resident(-1)
+    {}
+  };
+
+
+private:
+  bool enable_;
+  std::string directory_;
+  size_t budget_;
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Page> > pages_;       // 確保したすべてのページ
+  std::vector<Page*> free_;                         // 空いているページ
+  std::vector<Page*> retired_;                      // 捨てたが参照中のページ
+  std::vector<Slot*> resident_;                     // 読み込まれているページの置き場所
+  size_t hand_;                                     // 捨てる候補を調べる位置
+
+  std::atomic<u_int> file_count_;
+
+  // 統計
+  std::atomic<size_t> hit_;
+  std::atomic<size_t> miss_;
+  std::atomic<size_t> evict_;
+  std::atomic<size_t> read_bytes_;
+
+
+public:
+  TextureCache() :
+    enable_(false),
+    budget_(0),
+    hand_(0),
+    file_count_(0),
+    hit_(0),
+    miss_(0),
+    evict_(0),
+    read_bytes_(0)
+  {}
+
+  // TIPS:すべてのテクスチャで上限を共有する
+  static TextureCache& instance() {
+    static TextureCache cache;
+    return cache;
+  }
+
+
+  // ページを書き出す場所と、ページに使うメモリの上限(bytes)
+  // ※テクスチャを読み込む前に呼ぶ
+  void setup(const std::string& directory, const size_t budget) {
+    enable_    = true;
+    directory_ = directory;
+    budget_    = std::max(budget, size_t(PAGE_BYTES));
+    DOUT << "texture cache:" << directory_ << " budget:" << budget_ / 1024 << "KB" << std::endl;
+
+    removeStaleFiles();
+  }
+
+  bool enable() const { return enable_; }
+
+  // テクスチャごとのファイル名を決める
+  std::string createPath() {
+    return directory_ + "/texture_" + std::to_string(Os::processId())
+         + "_" + std::to_string(file_count_.fetch_add(1)) + ".bin";
+  }
+
+
+  // ページを参照する(読み込まれていなければ読み込む)
+  // ※使い終わったらunpinを呼ぶ
+  Page* pin(Slot& slot) {
+    while (1) {
+      Page* page = slot.page.load();
+      if (!page) break;
+
+      // TIPS:数えてから置き場所を確かめ直す
+      //      捨てる側は置き場所を空けてから数を調べるので、どちらかが必ず気づく
+      page->users.fetch_add(1);
+      if (slot.page.load() == page) {
+        if (!page->referenced.load(std::memory_order_relaxed)) {
+          page->referenced.store(true, std::memory_order_relaxed);
+        }
+        hit_.fetch_add(1, std::memory_order_relaxed);
+        return page;
+      }
+      page->users.fetch_sub(1);
+    }
+
+    return load(slot);
+  }
+
+  void unpin(Page* page) {
+    page->users.fetch_sub(1);
+  }
+
+  // テクスチャを破棄する時に、置き場所からページを外す
+  void release(std::vector<Slot>& slots) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots) {
+      if (slot.resident < 0) continue;
+      Page* page = slot.page.exchange(nullptr);
+      removeResident(slot);
+      free_.push_back(page);
+    }
+  }
+
+
+  // 統計を出力して数え直す
+  void reportStats() {
+    if (!enable_) return;
+
+    size_t resident;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      resident = resident_.size() * PAGE_BYTES;
+    }
+    size_t hit  = hit_.exchange(0);
+    size_t miss = miss_.exchange(0);
+    size_t total = hit + miss;
+    DOUT << "texture cache hit:" << hit
+         << " miss:" << miss
+         << " hit rate:" << (total ? 100.0 * hit / total : 0.0) << "%"
+         << " evict:" << evict_.exchange(0)
+         << " read:" << read_bytes_.exchange(0) / 1024 << "KB"
+         << " resident:" << resident / 1024 << "KB" << std::endl;
+  }
+
+
+private:
+  // 読み込み中はロックしない
+  Page* load(Slot& slot) {
+    Page* page;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      page = allocate();
+    }
+
+    // TIPS:読めなかったページは黒にする
+    std::ifstream fstr(*slot.path, std::ios::binary);
+    fstr.seekg(slot.offset);
+    if (fstr.read(reinterpret_cast<char*>(&page->texels[0]), PAGE_BYTES)) {
+      read_bytes_.fetch_add(PAGE_BYTES, std::memory_order_relaxed);
+    }
+    else {
+      DOUT << "Can't read texture page:" << *slot.path << " offset:" << slot.offset << std::endl;
+      std::fill(page->texels.begin(), page->texels.end(), 0);
+    }
+    miss_.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Page* current = slot.page.load();
+    if (current) {
+      // 他のスレッドが先に読み込んだ
+      // TIPS:ロック中は捨てられないので、そのまま数えて良い
+      free_.push_back(page);
+      current->users.fetch_add(1);
+      return current;
+    }
+
+    // TIPS:古い置き場所を見たスレッドが一時的に数えていることがあるので、0にはしない
+    page->users.fetch_add(1);
+    page->referenced.store(true, std::memory_order_relaxed);
+    slot.resident = int(resident_.size());
+    resident_.push_back(&slot);
+    slot.page.store(page);
+    return page;
+  }
+
+  // 終了したプロセスが残したファイルを消す
+  // TIPS:同じプロセスIDのファイルは、IDが使い回される前のもの(まだ何も書き出していない)
+  void removeStaleFiles() {
+    const int self = Os::processId();
+    for (const auto& name : Os::listFiles(directory_)) {
+      int id;
+      u_int index;
+      char ext[4];
+      if (std::sscanf(name.c_str(), "texture_%d_%u.%3s", &id, &index, ext) != 3) continue;
+      if (std::string(ext) != "bin") continue;
+      if ((id != self) && Os::isProcessAlive(id)) continue;
+
+      std::remove((directory_ + "/" + name).c_str());
+    }
+  }
+
+  // 空いているページを用意する
+  // TIPS:上限に達したら、しばらく参照されていないページを捨てて使い回す
+  Page* allocate() {
+    // 参照が終わった捨てたページを空きに戻す
+    for (size_t i = 0; i < retired_.size();) {
+      if (retired_[i]->users.load() == 0) {
+        free_.push_back(retired_[i]);
+        retired_[i] = retired_.back();
+        retired_.pop_back();
+      }
+      else {
+        ++i;
+      }
+    }
+
+    if (free_.empty() && ((pages_.size() * PAGE_BYTES) >= budget_)) evict();
+
+    if (free_.empty()) {
+      // 上限に達していないか、すべて参照中
+      pages_.emplace_back(new Page);
+      return pages_.back().get();
+    }
+
+    Page* page = free_.back();
+    free_.pop_back();
+    return page;
+  }
+
+  // 時計の針を進めながら、参照の印が無いページを1つ捨てる
+  void evict() {
+    size_t limit = resident_.size() * 2;
+    for (size_t i = 0; (i < limit) && !resident_.empty(); ++i) {
+      if (hand_ >= resident_.size()) hand_ = 0;
+
+      Slot& slot = *resident_[hand_];
+      Page* page = slot.page.load();
+      if (page->referenced.exchange(false, std::memory_order_relaxed)) {
+        ++hand_;
+        continue;
+      }
+
+      slot.page.store(nullptr);
+      removeResident(slot);
+      evict_.fetch_add(1, std::memory_order_relaxed);
+
+      if (page->users.load() == 0) {
+        free_.push_back(page);
+        return;
+      }
+      retired_.push_back(page);
+    }
+  }
+
+  void removeResident(Slot& slot) {
+    int index = slot.resident;
+    resident_[index] = resident_.back();
+    resident_[index]->resident = index;
+    resident_.pop_back();
+    slot.resident = -1;
+  }
+
+};
+
+}
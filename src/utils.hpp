@@ -6,6 +6,7 @@
 //
 
 #include "defines.hpp"
+#include <atomic>
 
 
 namespace {
@@ -47,4 +48,10 @@ T minmax(const T& value, const T& min_value, const T& max_value) {
   return std::max(std::min(value, max_value), min_value);
 }
 
+// float値をアトミックに加算
+void atomicAdd(std::atomic<float>& dst, const float value) {
+  float current = dst.load(std::memory_order_relaxed);
+  while (!dst.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+}
+
 }
@@ -17,6 +17,9 @@ using Vec2f = Eigen::Matrix<Real, 2, 1>;
 using Vec3f = Eigen::Matrix<Real, 3, 1>;
 using Vec4f = Eigen::Matrix<Real, 4, 1>;
 
+// 交差判定用
+using Vec3t = Eigen::Matrix<Float, 3, 1>;
+
 
 using Quatf = Eigen::Quaternion<Real>;
 using AngleAxis = Eigen::AngleAxis<Real>;